@@ -0,0 +1,172 @@
+/*  =========================================================================
+    cmcheckpoint - Background writer of the cmstats state
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// cmcheckpoint - Background writer of the cmstats state
+
+#include "cmcheckpoint.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fty_log.h>
+
+// body of the writer thread
+static void s_writer(cmcheckpoint_t* self)
+{
+    std::unique_lock<std::mutex> lock(self->mutex);
+    for (;;) {
+        self->cond.wait(lock, [self] {
+            return self->has_pending || self->terminate;
+        });
+        if (!self->has_pending)
+            break;
+
+        self->buffer.swap(self->pending);
+        self->writing_full = self->pending_full;
+        self->has_pending  = false;
+        self->writing      = true;
+        lock.unlock();
+
+        // full state replaces the state file and the delta log, delta is appended to the log
+        auto start = std::chrono::steady_clock::now();
+        int  r     = self->writing_full ? cmstats_write(self->filename.c_str(), self->buffer, self->sync)
+                                        : cmstats_append(self->filename.c_str(), self->buffer, self->sync);
+        auto duration_ms =
+            uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+        if (r == -1)
+            log_error("cmcheckpoint:\tFailed to save '%s': %s", self->filename.c_str(), strerror(errno));
+        else
+            log_info("cmcheckpoint:\t'%s' saved succesfully (%s), size=%zuB, duration=%" PRIu64 "ms",
+                self->filename.c_str(), self->writing_full ? "full" : "delta", self->buffer.size(), duration_ms);
+
+        lock.lock();
+        if (r == -1) {
+            // changes of this snapshot are lost, only the full state can recover them
+            self->info.errors++;
+            self->need_full = true;
+        } else {
+            self->info.count++;
+            self->info.size        = self->buffer.size();
+            self->info.duration_ms = duration_ms;
+            if (self->writing_full) {
+                self->info.full++;
+                self->info.full_size  = self->buffer.size();
+                self->info.delta_size = 0;
+            } else
+                self->info.delta_size += self->buffer.size();
+        }
+        self->writing = false;
+        self->cond.notify_all();
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmcheckpoint
+
+cmcheckpoint_t* cmcheckpoint_new(const char* filename, bool sync, uint32_t compact)
+{
+    assert(filename);
+
+    cmcheckpoint_t* self = new cmcheckpoint_t();
+    self->filename       = filename;
+    self->sync           = sync;
+    self->compact        = compact;
+    self->need_full      = true;
+    self->writer         = std::thread(s_writer, self);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmcheckpoint
+
+void cmcheckpoint_destroy(cmcheckpoint_t** self_p)
+{
+    if (*self_p) {
+        cmcheckpoint_t* self = *self_p;
+        {
+            std::lock_guard<std::mutex> lock(self->mutex);
+            self->terminate = true;
+        }
+        self->cond.notify_all();
+        self->writer.join();
+        delete self;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Take the snapshot of stats for the writer thread
+
+void cmcheckpoint_request(cmcheckpoint_t* self, cmshards_t* stats)
+{
+    assert(self);
+    assert(stats);
+
+    auto                        start = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(self->mutex);
+
+    bool full = self->need_full || self->deltas >= self->compact || self->info.delta_size > self->info.full_size ||
+                (self->has_pending && self->pending_full);
+    if (full) {
+        // full state includes everything, not yet written snapshot is replaced
+        if (self->has_pending)
+            self->info.skipped++;
+        self->pending.clear();
+        cmshards_encode(stats, true, self->pending);
+        self->deltas    = 0;
+        self->need_full = false;
+    } else {
+        // delta frames not yet written are kept, the new one is appended after them
+        if (!self->has_pending)
+            self->pending.clear();
+        cmshards_encode(stats, false, self->pending);
+        self->deltas++;
+    }
+    self->pending_full   = full;
+    self->has_pending    = true;
+    self->info.encode_us = uint64_t(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    self->cond.notify_all();
+}
+
+//  --------------------------------------------------------------------------
+//  Wait until all requested snapshots are written
+
+void cmcheckpoint_wait(cmcheckpoint_t* self)
+{
+    assert(self);
+
+    std::unique_lock<std::mutex> lock(self->mutex);
+    self->cond.wait(lock, [self] {
+        return !self->has_pending && !self->writing;
+    });
+}
+
+//  --------------------------------------------------------------------------
+//  Return the statistics of the written checkpoints
+
+cmcheckpoint_info_t cmcheckpoint_info(cmcheckpoint_t* self)
+{
+    assert(self);
+
+    std::lock_guard<std::mutex> lock(self->mutex);
+    return self->info;
+}
@@ -0,0 +1,83 @@
+/*  =========================================================================
+    cmcheckpoint - Background writer of the cmstats state
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+#include "cmshards.h"
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+//  Statistics of the written checkpoints
+struct cmcheckpoint_info_t
+{
+    uint64_t count;       // number of written checkpoints
+    uint64_t full;        // number of written full checkpoints (compactions)
+    uint64_t errors;      // number of failed writes
+    uint64_t skipped;     // number of snapshots replaced by newer one before they were written
+    uint64_t size;        // size of the last checkpoint [B]
+    uint64_t full_size;   // size of the last full checkpoint [B]
+    uint64_t delta_size;  // size of the delta log written since the last full checkpoint [B]
+    uint64_t encode_us;   // time spent by the last snapshot of the stats [us]
+    uint64_t duration_ms; // duration of the last write [ms]
+};
+
+//  Structure of our class
+//  The snapshot is taken by the caller into the pending buffer,
+//  the writer thread swaps it with its own buffer and writes it, so both buffers are reused
+//  Snapshot is either full state or delta frames with the series changed since the previous
+//  snapshot, full state is taken every compact snapshots or when delta log outgrows it
+struct cmcheckpoint_t
+{
+    std::string             filename;     // state file name
+    bool                    sync;         // fsync the file before it replaces the previous one
+    uint32_t                compact;      // number of delta snapshots between full ones, 0 means full only
+    uint32_t                deltas;       // number of delta snapshots since the last full one
+    bool                    need_full;    // next snapshot must be full state (nothing written yet or write failed)
+    bool                    terminate;    // writer thread has to end
+    bool                    has_pending;  // pending buffer contains a snapshot not written yet
+    bool                    pending_full; // pending snapshot is full state
+    bool                    writing_full; // snapshot being written is full state
+    bool                    writing;      // writer thread is busy
+    std::string             pending;      // snapshot waiting for the writer
+    std::string             buffer;       // snapshot being written
+    cmcheckpoint_info_t     info;         // statistics of the written checkpoints
+    std::mutex              mutex;        // protects all above except buffer
+    std::condition_variable cond;         // signals new snapshot, end of write and termination
+    std::thread             writer;       // writer thread
+};
+
+//  Create a new cmcheckpoint writing to filename and start its writer thread
+//  The first snapshot is always full state, then full state is taken after compact delta snapshots
+cmcheckpoint_t* cmcheckpoint_new(const char* filename, bool sync, uint32_t compact);
+
+//  Destroy the cmcheckpoint, pending snapshot is written before the writer thread ends
+void cmcheckpoint_destroy(cmcheckpoint_t** self_p);
+
+//  Take the snapshot of stats and let the writer thread write it
+//  Shards are locked one by one while their snapshot is taken, the disk is never touched here
+void cmcheckpoint_request(cmcheckpoint_t* self, cmshards_t* stats);
+
+//  Wait until all requested snapshots are written
+void cmcheckpoint_wait(cmcheckpoint_t* self);
+
+//  Return the statistics of the written checkpoints
+cmcheckpoint_info_t cmcheckpoint_info(cmcheckpoint_t* self);
@@ -0,0 +1,107 @@
+/*  =========================================================================
+    cmpool - Pool of worker threads processing one batch together
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// cmpool - Pool of worker threads processing one batch together
+
+#include "cmpool.h"
+#include <algorithm>
+#include <cassert>
+
+// body of the worker thread
+static void s_worker(cmpool_t* self, size_t worker)
+{
+    uint64_t                     generation = 0;
+    std::unique_lock<std::mutex> lock(self->mutex);
+    for (;;) {
+        self->cond.wait(lock, [self, generation] {
+            return self->terminate || self->generation != generation;
+        });
+        if (self->terminate)
+            break;
+
+        generation              = self->generation;
+        const cmpool_job_t* job = self->job;
+        lock.unlock();
+        (*job)(worker);
+        lock.lock();
+
+        if (--self->running == 0)
+            self->done.notify_all();
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmpool
+
+cmpool_t* cmpool_new(size_t nworkers)
+{
+    cmpool_t* self = new cmpool_t();
+    nworkers       = std::max(nworkers, size_t(1));
+    for (size_t i = 0; i < nworkers; i++)
+        self->threads.emplace_back(s_worker, self, i);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmpool
+
+void cmpool_destroy(cmpool_t** self_p)
+{
+    if (*self_p) {
+        cmpool_t* self = *self_p;
+        {
+            std::lock_guard<std::mutex> lock(self->mutex);
+            self->terminate = true;
+        }
+        self->cond.notify_all();
+        for (std::thread& thread : self->threads)
+            thread.join();
+        delete self;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return the number of workers
+
+size_t cmpool_size(cmpool_t* self)
+{
+    assert(self);
+    return self->threads.size();
+}
+
+//  --------------------------------------------------------------------------
+//  Run the job in all workers at once
+
+void cmpool_run(cmpool_t* self, const cmpool_job_t& job)
+{
+    assert(self);
+
+    std::unique_lock<std::mutex> lock(self->mutex);
+    self->job     = &job;
+    self->running = self->threads.size();
+    self->generation++;
+    self->cond.notify_all();
+    self->done.wait(lock, [self] {
+        return self->running == 0;
+    });
+    self->job = nullptr;
+}
@@ -0,0 +1,56 @@
+/*  =========================================================================
+    cmpool - Pool of worker threads processing one batch together
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  Job of one worker, called with the index of the worker
+typedef std::function<void(size_t worker)> cmpool_job_t;
+
+//  Structure of our class
+struct cmpool_t
+{
+    std::vector<std::thread> threads;    // worker threads
+    std::mutex               mutex;      // protects all below
+    std::condition_variable  cond;       // signals new job and termination to workers
+    std::condition_variable  done;       // signals end of the job to cmpool_run
+    const cmpool_job_t*      job;        // job being run, NULL if none
+    uint64_t                 generation; // incremented for each job
+    size_t                   running;    // number of workers still running the job
+    bool                     terminate;  // workers have to end
+};
+
+//  Create a new cmpool with nworkers threads (at least one)
+cmpool_t* cmpool_new(size_t nworkers);
+
+//  Destroy the cmpool, wait for the workers to end
+void cmpool_destroy(cmpool_t** self_p);
+
+//  Return the number of workers
+size_t cmpool_size(cmpool_t* self);
+
+//  Run the job in all workers at once, return when all of them have finished it
+void cmpool_run(cmpool_t* self, const cmpool_job_t& job);
@@ -0,0 +1,223 @@
+/*  =========================================================================
+    cmpublish - Statistics of the ended intervals written to shm in batches
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/// cmpublish - Statistics of the ended intervals written to shm in batches
+
+#include "cmpublish.h"
+#include "fty_mc_server.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <fty_log.h>
+#include <fty_shm.h>
+
+// order of the statistics written over the smoothing window, the shortest steps first
+static bool s_shorter(const cmpublish_entry_t& a, const cmpublish_entry_t& b)
+{
+    return a.step < b.step;
+}
+
+// write and destroy every stride-th statistic of batch starting by first
+// return the number of statistics which were not written
+static size_t s_write(std::vector<cmpublish_entry_t>& batch, size_t first, size_t stride)
+{
+    size_t failed = 0;
+    for (size_t i = first; i < batch.size(); i += stride) {
+        if (fty::shm::write_metric(batch[i].bmsg) == -1)
+            failed++;
+        fty_proto_destroy(&batch[i].bmsg);
+    }
+    return failed;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmpublish
+
+cmpublish_t* cmpublish_new(size_t nwriters)
+{
+    cmpublish_t* self = new cmpublish_t();
+    if (nwriters > 0)
+        self->pool = cmpool_new(nwriters);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmpublish
+
+void cmpublish_destroy(cmpublish_t** self_p)
+{
+    if (*self_p) {
+        cmpublish_t* self = *self_p;
+        cmpool_destroy(&self->pool);
+        for (cmpublish_entry_t& entry : self->batch)
+            fty_proto_destroy(&entry.bmsg);
+        delete self;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return the number of writer threads
+
+size_t cmpublish_writers(cmpublish_t* self)
+{
+    assert(self);
+    return self->pool ? cmpool_size(self->pool) : 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Set the smoothing window
+
+void cmpublish_set_window(cmpublish_t* self, uint64_t window_ms)
+{
+    assert(self);
+
+    std::lock_guard<std::mutex> lock(self->mutex);
+    // statistics waiting without the window were not ordered
+    if (self->window_ms == 0 && window_ms != 0)
+        std::stable_sort(self->batch.begin(), self->batch.end(), s_shorter);
+    self->window_ms = window_ms;
+    // statistics already waiting are written by the new window
+    self->last_ms = zclock_mono();
+    self->end_ms  = self->last_ms + int64_t(window_ms);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the time until the next flush has something to write
+
+int64_t cmpublish_next(cmpublish_t* self)
+{
+    assert(self);
+
+    std::lock_guard<std::mutex> lock(self->mutex);
+    if (self->batch.empty())
+        return -1;
+    if (self->window_ms == 0)
+        return 0;
+    // the batch is written evenly till the end of the window
+    int64_t now_ms = zclock_mono();
+    int64_t next   = self->last_ms + (self->end_ms - self->last_ms) / int64_t(self->batch.size());
+    next           = std::max(next, self->last_ms + CMPUBLISH_TICK_MS);
+    return std::max(std::min(next, self->end_ms) - now_ms, int64_t(0));
+}
+
+//  --------------------------------------------------------------------------
+//  Move all messages from the list to the batch
+
+void cmpublish_append(cmpublish_t* self, zlist_t* published)
+{
+    assert(self);
+    assert(published);
+
+    if (zlist_size(published) == 0)
+        return;
+    std::lock_guard<std::mutex> lock(self->mutex);
+    // new burst is spread over the whole window, statistics appended to the waiting ones
+    // are written by the end of the current window, the ones left after its end by the new window
+    int64_t now_ms = zclock_mono();
+    if (self->batch.empty() || now_ms >= self->end_ms) {
+        self->last_ms = now_ms;
+        self->end_ms  = now_ms + int64_t(self->window_ms);
+    }
+    if (self->window_ms == 0) {
+        for (fty_proto_t* bmsg = reinterpret_cast<fty_proto_t*>(zlist_pop(published)); bmsg != nullptr;
+             bmsg              = reinterpret_cast<fty_proto_t*>(zlist_pop(published)))
+            self->batch.push_back({uint32_t(fty_proto_aux_number(bmsg, AGENT_CM_STEP, 0)), bmsg});
+        return;
+    }
+
+    // statistics of the shortest steps are written first - only the appended ones are sorted,
+    // then they are merged with the waiting ones, which are already ordered
+    self->appended.clear();
+    for (fty_proto_t* bmsg = reinterpret_cast<fty_proto_t*>(zlist_pop(published)); bmsg != nullptr;
+         bmsg              = reinterpret_cast<fty_proto_t*>(zlist_pop(published)))
+        self->appended.push_back({uint32_t(fty_proto_aux_number(bmsg, AGENT_CM_STEP, 0)), bmsg});
+    std::stable_sort(self->appended.begin(), self->appended.end(), s_shorter);
+    size_t waiting = self->batch.size();
+    self->batch.insert(self->batch.end(), self->appended.begin(), self->appended.end());
+    std::inplace_merge(self->batch.begin(), self->batch.begin() + ptrdiff_t(waiting), self->batch.end(), s_shorter);
+}
+
+//  --------------------------------------------------------------------------
+//  Write all statistics of the batch to shm
+
+size_t cmpublish_flush(cmpublish_t* self, cmpublish_info_t* info)
+{
+    assert(self);
+
+    std::lock_guard<std::mutex> flushing(self->flushing);
+    size_t                      backlog = 0;
+    {
+        // appending threads wait only for taking the statistics, not for the writes
+        std::lock_guard<std::mutex> lock(self->mutex);
+        int64_t                     now_ms = zclock_mono();
+        size_t                      n      = self->batch.size();
+        if (n != 0 && self->window_ms != 0 && now_ms < self->end_ms) {
+            // share of the batch due since the previous flush, rounded up
+            int64_t elapsed = now_ms - self->last_ms;
+            int64_t left    = self->end_ms - self->last_ms;
+            n               = size_t((int64_t(n) * elapsed + left - 1) / left);
+        }
+        if (n == self->batch.size())
+            self->writing.swap(self->batch);
+        else if (n != 0) {
+            self->writing.assign(self->batch.begin(), self->batch.begin() + ptrdiff_t(n));
+            self->batch.erase(self->batch.begin(), self->batch.begin() + ptrdiff_t(n));
+        }
+        if (n != 0)
+            self->last_ms = now_ms;
+        backlog = self->batch.size();
+    }
+    if (self->writing.empty()) {
+        if (info)
+            *info = self->info;
+        return 0;
+    }
+
+    int64_t start_ms = zclock_mono();
+    size_t  failed   = 0;
+    if (self->pool && self->writing.size() > 1) {
+        size_t              nwriters = cmpool_size(self->pool);
+        std::atomic<size_t> failures(0);
+        cmpool_run(self->pool, [self, nwriters, &failures](size_t writer) {
+            failures += s_write(self->writing, writer, nwriters);
+        });
+        failed = failures;
+    } else
+        failed = s_write(self->writing, 0, 1);
+
+    if (failed != 0)
+        log_error("cmpublish:\tCannot publish %zu of %zu statistics", failed, self->writing.size());
+
+    size_t size = self->writing.size();
+    self->info.count += size - failed;
+    self->info.errors += failed;
+    self->info.flushes++;
+    self->info.size        = size;
+    self->info.max_size    = std::max(self->info.max_size, uint64_t(size));
+    self->info.duration_ms = uint64_t(zclock_mono() - start_ms);
+    self->info.backlog     = backlog;
+    if (info)
+        *info = self->info;
+    self->writing.clear();
+    return size;
+}
@@ -0,0 +1,101 @@
+/*  =========================================================================
+    cmpublish - Statistics of the ended intervals written to shm in batches
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#pragma once
+#include "cmpool.h"
+#include <cstdint>
+#include <fty_proto.h>
+#include <mutex>
+#include <vector>
+
+//  Statistic waiting to be written with its step, which orders the batch with smoothing
+struct cmpublish_entry_t
+{
+    uint32_t     step; // step of the statistic [s], taken from its aux AGENT_CM_STEP
+    fty_proto_t* bmsg; // the statistic
+};
+
+//  Statistics of the written batches
+struct cmpublish_info_t
+{
+    uint64_t count;       // number of written statistics
+    uint64_t errors;      // number of statistics failed to be written
+    uint64_t flushes;     // number of flushes which wrote something
+    uint64_t size;        // number of statistics of the last flush
+    uint64_t max_size;    // maximal number of statistics of one flush (the largest burst)
+    uint64_t duration_ms; // duration of the last flush [ms]
+    uint64_t backlog;     // number of statistics left for the next flushes (smoothing)
+};
+
+//  Structure of our class
+//  Statistics closed at the same time (e.g. all 15m, 30m and 1h statistics at the top of the hour)
+//  are collected from all shards and written together, optionally by several writer threads.
+//  Buffers are kept between the flushes, so a burst does not allocate once they are large enough.
+//  With smoothing window, the burst is spread over the window instead - every flush writes only
+//  the share of the batch due since the previous one, statistics of the shortest steps first.
+//  Timestamps of the statistics are not changed, they are only written later.
+struct cmpublish_t
+{
+    std::mutex                     mutex;     // protects all below except writing and pool
+    std::mutex                     flushing;  // serializes the flushes, they share writing, pool and info
+    std::vector<cmpublish_entry_t> batch;     // statistics waiting to be written, ordered by step with smoothing
+    std::vector<cmpublish_entry_t> writing;   // statistics being written, taken from batch
+    std::vector<cmpublish_entry_t> appended;  // statistics being appended, reused
+    cmpool_t*                      pool;      // writer threads, NULL if the batch is written by the caller
+    uint64_t                       window_ms; // smoothing window, 0 means the batch is written at once
+    int64_t                        last_ms;   // monotonic time the batch was written up to [ms]
+    int64_t                        end_ms;    // monotonic time the whole batch has to be written by [ms]
+    cmpublish_info_t               info;      // statistics of the written batches
+};
+
+//  Minimal period of the flushes while the batch is spread over the smoothing window [ms]
+#define CMPUBLISH_TICK_MS 100
+
+//  Create a new cmpublish with nwriters writer threads, 0 means the batch is written by the caller
+cmpublish_t* cmpublish_new(size_t nwriters);
+
+//  Destroy the cmpublish, statistics not flushed yet are dropped
+void cmpublish_destroy(cmpublish_t** self_p);
+
+//  Return the number of writer threads, 0 if the batch is written by the caller
+size_t cmpublish_writers(cmpublish_t* self);
+
+//  Set the smoothing window - statistics appended at once are written over window_ms,
+//  0 means they are written by the next flush. The window has to be shorter than the shortest
+//  step, so the statistic is written before the next one of the same series - the caller checks it.
+void cmpublish_set_window(cmpublish_t* self, uint64_t window_ms);
+
+//  Return the time until the next flush has something to write [ms], -1 if the batch is empty
+int64_t cmpublish_next(cmpublish_t* self);
+
+//  Move all fty_proto_t messages from the list published to the batch, the list is left empty
+//  Step of every message is its aux AGENT_CM_STEP, the burst appended after the end of the window
+//  starts the new window
+//  Thread safe, the batch takes the ownership of the messages
+void cmpublish_append(cmpublish_t* self, zlist_t* published);
+
+//  Write the statistics of the batch due now to shm and destroy them - the whole batch without
+//  smoothing window, its share due since the previous flush otherwise
+//  Thread safe, statistics appended during the flush are written by the next one
+//  Statistics of the written batches including this flush are copied to info (if not NULL)
+//  Return the number of statistics of this flush (both written and failed)
+size_t cmpublish_flush(cmpublish_t* self, cmpublish_info_t* info);
@@ -0,0 +1,127 @@
+/*  =========================================================================
+    cmqueue - Lock-free single producer single consumer queue of received samples
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/// cmqueue - Lock-free single producer single consumer queue of received samples
+
+#include "cmqueue.h"
+#include <cassert>
+
+//  --------------------------------------------------------------------------
+//  Create a new cmqueue
+
+cmqueue_t* cmqueue_new(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    cmqueue_t* self = new cmqueue_t();
+    self->ring.resize(size);
+    self->mask      = size - 1;
+    self->head      = 0;
+    self->tail      = 0;
+    self->dropped   = 0;
+    self->max_depth = 0;
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmqueue
+
+void cmqueue_destroy(cmqueue_t** self_p)
+{
+    if (*self_p) {
+        delete *self_p;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return the number of samples the queue can hold
+
+size_t cmqueue_capacity(cmqueue_t* self)
+{
+    assert(self);
+    return self->ring.size();
+}
+
+//  --------------------------------------------------------------------------
+//  Return the number of samples waiting in the queue
+
+size_t cmqueue_size(cmqueue_t* self)
+{
+    assert(self);
+    return size_t(self->tail.load(std::memory_order_acquire) - self->head.load(std::memory_order_acquire));
+}
+
+//  --------------------------------------------------------------------------
+//  Push the sample
+
+bool cmqueue_push(cmqueue_t* self, const cmqueue_sample_t& sample)
+{
+    assert(self);
+
+    uint64_t tail  = self->tail.load(std::memory_order_relaxed);
+    uint64_t depth = tail - self->head.load(std::memory_order_acquire);
+    if (depth == self->ring.size()) {
+        self->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    self->ring[tail & self->mask] = sample;
+    // the sample (and its series) is visible to the consumer together with the new tail
+    self->tail.store(tail + 1, std::memory_order_release);
+    if (depth + 1 > self->max_depth.load(std::memory_order_relaxed))
+        self->max_depth.store(depth + 1, std::memory_order_relaxed);
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  Pop the oldest sample
+
+bool cmqueue_pop(cmqueue_t* self, cmqueue_sample_t* sample)
+{
+    assert(self);
+    assert(sample);
+
+    uint64_t head = self->head.load(std::memory_order_relaxed);
+    if (head == self->tail.load(std::memory_order_acquire))
+        return false;
+    *sample = self->ring[head & self->mask];
+    // the slot can be reused by the producer once the sample is copied
+    self->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the statistics of the queue
+
+cmqueue_info_t cmqueue_info(cmqueue_t* self)
+{
+    assert(self);
+
+    cmqueue_info_t info;
+    info.depth     = cmqueue_size(self);
+    info.pushed    = self->tail.load(std::memory_order_acquire);
+    info.dropped   = self->dropped.load(std::memory_order_relaxed);
+    info.max_depth = self->max_depth.load(std::memory_order_relaxed);
+    return info;
+}
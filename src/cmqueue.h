@@ -0,0 +1,103 @@
+/*  =========================================================================
+    cmqueue - Lock-free single producer single consumer queue of received samples
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//  Series of the received samples, created by the producer before its first sample is pushed
+//  and never changed while samples refer to it by pointer, the producer frees it only after
+//  the consumer released all samples pushed before the series was retired
+struct cmqueue_series_t
+{
+    std::string sender;        // sender of the metrics
+    std::string quantity;      // type of the metric, empty for deleted asset
+    std::string asset;         // name of the asset
+    std::string unit;          // unit of the metrics, a new series is created when it changes
+    uint32_t    rules_version;    // consumer only - version of cmrules the rule was found in, 0 if not yet
+    int32_t     rule;             // consumer only - cached index of the rule of the sender, -1 if none
+    uint32_t    selector_version; // consumer only - version of the selector selected was found by, 0 if not yet
+    bool        selected;         // consumer only - cached match of the quantity by the selector
+};
+
+//  Kind of the sample
+enum cmqueue_kind_t
+{
+    CMQUEUE_METRIC = 0, // new value of the series
+    CMQUEUE_DELETE      // the asset of the series was deleted
+};
+
+//  One decoded sample
+struct cmqueue_sample_t
+{
+    cmqueue_series_t* series; // series of the sample
+    double            value;  // value of the metric
+    uint64_t          time;   // timestamp of the metric [s]
+    cmqueue_kind_t    kind;   // kind of the sample
+};
+
+//  Statistics of the queue
+struct cmqueue_info_t
+{
+    uint64_t pushed;    // number of pushed samples
+    uint64_t dropped;   // number of samples dropped because the queue was full
+    uint64_t depth;     // number of samples waiting in the queue
+    uint64_t max_depth; // maximal number of samples waiting in the queue
+};
+
+//  Structure of our class
+//  Ring buffer of samples, one thread pushes and another one pops them without any lock.
+//  Head and tail are on their own cache lines, so the threads do not share them on every access.
+struct cmqueue_t
+{
+    std::vector<cmqueue_sample_t>     ring;      // samples, size is a power of 2
+    uint64_t                          mask;      // size of ring - 1
+    alignas(64) std::atomic<uint64_t> head;      // next sample to be popped, written by the consumer
+    alignas(64) std::atomic<uint64_t> tail;      // next free slot, written by the producer
+    alignas(64) std::atomic<uint64_t> dropped;   // samples dropped by the producer
+    std::atomic<uint64_t>             max_depth; // maximal depth seen by the producer
+};
+
+//  Create a new cmqueue for at least capacity samples
+cmqueue_t* cmqueue_new(size_t capacity);
+
+//  Destroy the cmqueue
+void cmqueue_destroy(cmqueue_t** self_p);
+
+//  Return the number of samples the queue can hold
+size_t cmqueue_capacity(cmqueue_t* self);
+
+//  Return the number of samples waiting in the queue
+size_t cmqueue_size(cmqueue_t* self);
+
+//  Push the sample, producer only
+//  Return false if the queue is full, the sample is dropped then
+bool cmqueue_push(cmqueue_t* self, const cmqueue_sample_t& sample);
+
+//  Pop the oldest sample to sample, consumer only
+//  Return false if the queue is empty
+bool cmqueue_pop(cmqueue_t* self, cmqueue_sample_t* sample);
+
+//  Return the statistics of the queue
+cmqueue_info_t cmqueue_info(cmqueue_t* self);
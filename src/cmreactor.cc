@@ -0,0 +1,220 @@
+/*  =========================================================================
+    cmreactor - Event loop on descriptors and timerfd deadlines
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/// cmreactor - Event loop on descriptors and timerfd deadlines
+
+#include "cmreactor.h"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <czmq.h>
+#include <fty_log.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// add the source and register its descriptor in epoll, return its id
+static int s_add(cmreactor_t* self, const cmreactor_source_t& source)
+{
+    int                id = int(self->sources.size());
+    struct epoll_event event;
+    event.events   = EPOLLIN;
+    event.data.u64 = uint64_t(id);
+    if (epoll_ctl(self->epoll, EPOLL_CTL_ADD, source.fd, &event) == -1) {
+        log_error("cmreactor:\tCannot watch descriptor %d: %s", source.fd, strerror(errno));
+        return -1;
+    }
+    self->sources.push_back(source);
+    return id;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmreactor
+
+cmreactor_t* cmreactor_new(void)
+{
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll == -1) {
+        log_error("cmreactor:\tCannot create epoll: %s", strerror(errno));
+        return nullptr;
+    }
+    cmreactor_t* self = new cmreactor_t();
+    self->epoll       = epoll;
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmreactor
+
+void cmreactor_destroy(cmreactor_t** self_p)
+{
+    if (*self_p) {
+        cmreactor_t* self = *self_p;
+        for (const cmreactor_source_t& source : self->sources) {
+            if (source.timer)
+                close(source.fd);
+        }
+        close(self->epoll);
+        delete self;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Add the readable descriptor
+
+int cmreactor_socket(cmreactor_t* self, int fd, const cmreactor_pending_fn_t& pending, const cmreactor_fn_t& handler)
+{
+    assert(self);
+    assert(handler);
+
+    cmreactor_source_t source;
+    source.fd      = fd;
+    source.timer   = false;
+    source.clockid = -1;
+    source.pending = pending;
+    source.handler = handler;
+    return s_add(self, source);
+}
+
+//  --------------------------------------------------------------------------
+//  Add the stopped timer
+
+int cmreactor_timer(cmreactor_t* self, int clockid, const cmreactor_fn_t& handler)
+{
+    assert(self);
+    assert(handler);
+
+    cmreactor_source_t source;
+    source.fd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (source.fd == -1) {
+        log_error("cmreactor:\tCannot create timer: %s", strerror(errno));
+        return -1;
+    }
+    source.timer   = true;
+    source.clockid = clockid;
+    source.handler = handler;
+    int id         = s_add(self, source);
+    if (id == -1)
+        close(source.fd);
+    return id;
+}
+
+//  --------------------------------------------------------------------------
+//  Arm the timer
+
+int cmreactor_timer_set(cmreactor_t* self, int timer, uint64_t ms, bool absolute)
+{
+    assert(self);
+    assert(timer >= 0 && size_t(timer) < self->sources.size() && self->sources[size_t(timer)].timer);
+
+    const cmreactor_source_t& source = self->sources[size_t(timer)];
+    struct itimerspec         spec   = {};
+    spec.it_value.tv_sec             = time_t(ms / 1000);
+    spec.it_value.tv_nsec            = long(ms % 1000) * 1000000;
+    // zero value would stop the timer
+    if (!absolute && ms == 0)
+        spec.it_value.tv_nsec = 1;
+
+    int flags = 0;
+    if (absolute) {
+        flags = TFD_TIMER_ABSTIME;
+        if (source.clockid == CLOCK_REALTIME)
+            flags |= TFD_TIMER_CANCEL_ON_SET;
+    }
+    if (timerfd_settime(source.fd, flags, &spec, nullptr) == -1) {
+        log_error("cmreactor:\tCannot arm timer: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Stop the timer
+
+void cmreactor_timer_stop(cmreactor_t* self, int timer)
+{
+    assert(self);
+    assert(timer >= 0 && size_t(timer) < self->sources.size() && self->sources[size_t(timer)].timer);
+
+    struct itimerspec spec = {};
+    timerfd_settime(self->sources[size_t(timer)].fd, 0, &spec, nullptr);
+}
+
+//  --------------------------------------------------------------------------
+//  Wait for the sources and call the handlers of the ready ones
+
+int cmreactor_run_once(cmreactor_t* self, int timeout_ms)
+{
+    assert(self);
+
+    std::vector<int> ready;
+    for (size_t id = 0; id < self->sources.size(); id++) {
+        if (self->sources[id].pending && self->sources[id].pending())
+            ready.push_back(int(id));
+    }
+
+    std::array<struct epoll_event, 16> events;
+    int n = epoll_wait(self->epoll, events.data(), int(events.size()), ready.empty() ? timeout_ms : 0);
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        log_error("cmreactor:\tepoll_wait failed: %s", strerror(errno));
+        return -1;
+    }
+    self->wakeups++;
+    for (int i = 0; i < n; i++)
+        ready.push_back(int(events[size_t(i)].data.u64));
+    std::sort(ready.begin(), ready.end());
+    ready.erase(std::unique(ready.begin(), ready.end()), ready.end());
+
+    for (int id : ready) {
+        const cmreactor_source_t& source = self->sources[size_t(id)];
+        if (source.timer) {
+            // timer stopped or re-armed by previous handler is not ready anymore,
+            // ECANCELED means the clock was set, handler recomputes the deadline
+            uint64_t expirations = 0;
+            if (read(source.fd, &expirations, sizeof(expirations)) == -1 && errno != ECANCELED)
+                continue;
+        }
+        // handler may add sources
+        cmreactor_fn_t handler = source.handler;
+        self->handlers++;
+        if (handler() == -1)
+            return -1;
+    }
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Call cmreactor_run_once until the end
+
+void cmreactor_run(cmreactor_t* self)
+{
+    assert(self);
+    while (!zsys_interrupted) {
+        if (cmreactor_run_once(self, -1) == -1)
+            break;
+    }
+}
@@ -0,0 +1,85 @@
+/*  =========================================================================
+    cmreactor - Event loop on descriptors and timerfd deadlines
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+//  Handler of the source, return -1 to end cmreactor_run
+typedef std::function<int(void)> cmreactor_fn_t;
+
+//  Return true if the source has events waiting even if its descriptor does not signal them
+//  (e.g. zmq sockets, whose descriptor signals only the change of their state)
+typedef std::function<bool(void)> cmreactor_pending_fn_t;
+
+//  One source of events - descriptor or timer
+struct cmreactor_source_t
+{
+    int                    fd;      // watched descriptor, timerfd for timers
+    bool                   timer;   // descriptor is timerfd owned by the reactor
+    int                    clockid; // clock of the timer
+    cmreactor_pending_fn_t pending; // events waiting without the descriptor being readable, may be empty
+    cmreactor_fn_t         handler; // called when the source is ready
+};
+
+//  Structure of our class
+//  Single thread waits for all sources by one epoll_wait. Timers are timerfd descriptors, so the
+//  deadline is never missed while a handler runs - the timer is ready when the handler returns.
+struct cmreactor_t
+{
+    int                             epoll;    // epoll descriptor
+    std::vector<cmreactor_source_t> sources;  // sources indexed by their id
+    uint64_t                        wakeups;  // number of returns from epoll_wait
+    uint64_t                        handlers; // number of called handlers
+};
+
+//  Create a new cmreactor, return NULL if epoll is not available
+cmreactor_t* cmreactor_new(void);
+
+//  Destroy the cmreactor, timers are closed, other descriptors are left open
+void cmreactor_destroy(cmreactor_t** self_p);
+
+//  Add the readable descriptor with handler, pending may be empty
+//  Return the id of the source, -1 if fail
+int cmreactor_socket(cmreactor_t* self, int fd, const cmreactor_pending_fn_t& pending, const cmreactor_fn_t& handler);
+
+//  Add the stopped timer of clockid (CLOCK_MONOTONIC or CLOCK_REALTIME) with handler
+//  The timer is one-shot, the handler re-arms it if needed
+//  Return the id of the source, -1 if fail
+int cmreactor_timer(cmreactor_t* self, int clockid, const cmreactor_fn_t& handler);
+
+//  Arm the timer to expire after ms, or at ms (since the epoch of its clock) if absolute is true
+//  Absolute CLOCK_REALTIME timer expires also when the clock is set, so its deadline can be recomputed
+//  Return -1 if fail
+int cmreactor_timer_set(cmreactor_t* self, int timer, uint64_t ms, bool absolute);
+
+//  Stop the timer
+void cmreactor_timer_stop(cmreactor_t* self, int timer);
+
+//  Wait at most timeout_ms (-1 forever) for the sources and call the handlers of the ready ones
+//  in the order of their ids, sources with pending events are handled without waiting
+//  Return -1 if a handler asked to end or the wait failed, 0 otherwise (also if interrupted by signal)
+int cmreactor_run_once(cmreactor_t* self, int timeout_ms);
+
+//  Call cmreactor_run_once until it returns -1 or the process is interrupted
+void cmreactor_run(cmreactor_t* self);
@@ -0,0 +1,305 @@
+/*  =========================================================================
+    cmreceiver - Thread receiving and decoding the malamute messages
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/// cmreceiver - Thread receiving and decoding the malamute messages
+
+#include "cmreceiver.h"
+#include "cmstats.h"
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fty_log.h>
+#include <fty_proto.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Maximal number of samples pushed before the consumer is signalled
+#define CMRECEIVER_BATCH 64
+
+// wake up the consumer
+static void s_notify(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+        log_error("cannot signal eventfd: %s", strerror(errno));
+}
+
+// retire the series, it is freed once the consumer released the samples pushed until now
+static void s_retire(cmreceiver_t* self, std::unique_ptr<cmqueue_series_t> series)
+{
+    self->retired.emplace_back(self->queue->tail.load(std::memory_order_relaxed), std::move(series));
+}
+
+// free the retired series no sample waiting for the consumer refers to
+static void s_free_retired(cmreceiver_t* self)
+{
+    uint64_t released = self->released.load(std::memory_order_acquire);
+    while (!self->retired.empty() && self->retired.front().first <= released)
+        self->retired.pop_front();
+}
+
+// return the series of the sample, create it if needed
+// series with another unit is retired, the samples already pushed keep their unit
+static cmqueue_series_t* s_series(
+    cmreceiver_t* self, const char* sender, const char* quantity, const char* asset, const char* unit)
+{
+    self->key.assign(sender);
+    self->key.push_back('\0');
+    self->key.append(quantity);
+
+    cmreceiver_t::series_map_t&        series = self->assets[asset];
+    std::unique_ptr<cmqueue_series_t>& found  = series[self->key];
+    if (found && (!unit || found->unit == unit))
+        return found.get();
+    if (found)
+        s_retire(self, std::move(found));
+
+    found.reset(new cmqueue_series_t{sender, quantity, asset, unit ? unit : "", 0, -1, 0, false});
+    return found.get();
+}
+
+// push the sample, which must not be dropped - wait until the consumer makes room for it
+static void s_push_wait(cmreceiver_t* self, const cmqueue_sample_t& sample)
+{
+    struct pollfd fds[2] = {{self->room, POLLIN, 0}, {self->stop, POLLIN, 0}};
+    while (cmqueue_size(self->queue) == cmqueue_capacity(self->queue) && !self->terminate) {
+        self->waiting = true;
+        // the consumer checks the flag after it popped, so either it sees the flag or room is seen here
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (cmqueue_size(self->queue) != cmqueue_capacity(self->queue))
+            break;
+        s_notify(self->event);
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            log_error("%s:\tpoll failed: %s", self->name.c_str(), strerror(errno));
+            break;
+        }
+        uint64_t count;
+        if (read(self->room, &count, sizeof(count)) == -1 && errno != EAGAIN)
+            log_error("%s:\tcannot read eventfd: %s", self->name.c_str(), strerror(errno));
+    }
+    self->waiting = false;
+    cmqueue_push(self->queue, sample);
+}
+
+// push the deletion of the asset, all its series are retired
+static void s_push_delete(cmreceiver_t* self, const char* asset)
+{
+    std::unique_ptr<cmqueue_series_t> deleted(new cmqueue_series_t{"", "", asset, "", 0, -1, 0, false});
+    s_push_wait(self, cmqueue_sample_t{deleted.get(), 0, 0, CMQUEUE_DELETE});
+    s_retire(self, std::move(deleted));
+
+    auto it = self->assets.find(asset);
+    if (it == self->assets.end())
+        return;
+    for (auto& series : it->second)
+        s_retire(self, std::move(series.second));
+    self->assets.erase(it);
+}
+
+// receive and decode one message, return the number of pushed samples
+static size_t s_receive(cmreceiver_t* self)
+{
+    zmsg_t* msg = mlm_client_recv(self->client);
+    if (!msg) {
+        log_error("%s:\tmlm_client_recv() == nullptr", self->name.c_str());
+        return 0;
+    }
+
+    const char*  sender = mlm_client_sender(self->client);
+    fty_proto_t* bmsg   = fty_proto_decode(&msg);
+    size_t       pushed = 0;
+
+    // series of the assets deleted before are not referred to by the consumer anymore
+    s_free_retired(self);
+
+    // If we received an asset message
+    // * "delete", "retire" or non active asset  -> drop all computations on that asset
+    // *  other                -> ignore it, as it doesn't impact this agent
+    if (fty_proto_id(bmsg) == FTY_PROTO_ASSET) {
+        const char* op = fty_proto_operation(bmsg);
+        if (streq(op, "delete") || streq(op, "retire") ||
+            !streq(fty_proto_aux_string(bmsg, FTY_PROTO_ASSET_STATUS, "active"), "active")) {
+            // get rid of messages with empty or null name
+            if (fty_proto_name(bmsg) == nullptr || streq(fty_proto_name(bmsg), ""))
+                log_warning("%s: invalid \'name\' = (%s), \tasset operation=%s, sender=%s", self->name.c_str(),
+                    fty_proto_name(bmsg) ? fty_proto_name(bmsg) : "null", op, sender);
+            else {
+                s_push_delete(self, fty_proto_name(bmsg));
+                pushed++;
+            }
+        }
+    }
+    // If we received a metric message, its statistics are updated by the consumer
+    else if (fty_proto_id(bmsg) == FTY_PROTO_METRIC) {
+        // value is parsed only here, the samples carry the double
+        double value = NAN;
+        bool   valid = cmstats_parse_value(fty_proto_value(bmsg), &value);
+        // get rid of messages with empty or null name
+        if (fty_proto_name(bmsg) == nullptr || streq(fty_proto_name(bmsg), ""))
+            log_warning("%s: invalid \'name\' = (%s), \tsubject=%s, sender=%s", self->name.c_str(),
+                fty_proto_name(bmsg) ? fty_proto_name(bmsg) : "null", mlm_client_subject(self->client), sender);
+        // sometimes we do have nan in values, report if we get something like that on METRICS
+        else if (!valid)
+            log_warning("%s:\tisnan ('%s'), subject='%s', sender='%s'", self->name.c_str(),
+                fty_proto_value(bmsg) ? fty_proto_value(bmsg) : "null", mlm_client_subject(self->client), sender);
+        else {
+            cmqueue_sample_t sample{
+                s_series(self, sender, fty_proto_type(bmsg), fty_proto_name(bmsg), fty_proto_unit(bmsg)), value,
+                fty_proto_time(bmsg), CMQUEUE_METRIC};
+            // metric is dropped when the consumer is late, it is counted by the queue
+            if (self->wait) {
+                s_push_wait(self, sample);
+                pushed++;
+            } else if (cmqueue_push(self->queue, sample))
+                pushed++;
+        }
+    }
+    // We received some unexpected message
+    else
+        log_warning("%s:\tUnexpected message from sender=%s, subject=%s", self->name.c_str(), sender,
+            mlm_client_subject(self->client));
+
+    fty_proto_destroy(&bmsg);
+    return pushed;
+}
+
+// body of the receiving thread
+static void s_receiver(cmreceiver_t* self)
+{
+    // readiness of zmq socket is signalled by the change of its state only, so all waiting
+    // messages are received before the thread waits for the descriptor
+    zsock_t*      msgpipe = mlm_client_msgpipe(self->client);
+    struct pollfd fds[2]  = {{zsock_fd(msgpipe), POLLIN, 0}, {self->stop, POLLIN, 0}};
+    while (!self->terminate) {
+        size_t pushed = 0;
+        while (!self->terminate && (zsock_events(msgpipe) & ZMQ_POLLIN)) {
+            pushed += s_receive(self);
+            if (pushed >= CMRECEIVER_BATCH) {
+                s_notify(self->event);
+                pushed = 0;
+            }
+        }
+        if (pushed != 0)
+            s_notify(self->event);
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            log_error("%s:\tpoll failed: %s", self->name.c_str(), strerror(errno));
+            break;
+        }
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmreceiver
+
+cmreceiver_t* cmreceiver_new(const char* name, mlm_client_t* client, size_t capacity)
+{
+    assert(name);
+    assert(client);
+
+    cmreceiver_t* self = new cmreceiver_t();
+    self->name         = name;
+    self->client       = client;
+    self->queue        = cmqueue_new(capacity);
+    self->event        = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->room         = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->stop         = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->terminate    = false;
+    self->wait         = false;
+    self->waiting      = false;
+    self->released     = 0;
+    if (self->event == -1 || self->room == -1 || self->stop == -1) {
+        log_error("%s:\tcannot create eventfd: %s", name, strerror(errno));
+        cmreceiver_destroy(&self);
+        return nullptr;
+    }
+    self->thread = std::thread(s_receiver, self);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmreceiver
+
+void cmreceiver_destroy(cmreceiver_t** self_p)
+{
+    if (*self_p) {
+        cmreceiver_t* self = *self_p;
+        if (self->thread.joinable()) {
+            self->terminate = true;
+            s_notify(self->stop);
+            self->thread.join();
+        }
+        if (self->event != -1)
+            close(self->event);
+        if (self->room != -1)
+            close(self->room);
+        if (self->stop != -1)
+            close(self->stop);
+        cmqueue_destroy(&self->queue);
+        delete self;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Set whether the metrics wait for room in the full queue
+
+void cmreceiver_set_wait(cmreceiver_t* self, bool wait)
+{
+    assert(self);
+    self->wait = wait;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the descriptor readable when samples were pushed
+
+int cmreceiver_fd(cmreceiver_t* self)
+{
+    assert(self);
+    return self->event;
+}
+
+//  --------------------------------------------------------------------------
+//  Reset the descriptor
+
+void cmreceiver_ack(cmreceiver_t* self)
+{
+    assert(self);
+    uint64_t count;
+    // EAGAIN when it was already reset, samples are popped anyway
+    if (read(self->event, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        log_error("%s:\tcannot read eventfd: %s", self->name.c_str(), strerror(errno));
+}
+
+//  --------------------------------------------------------------------------
+//  Release the popped samples
+
+void cmreceiver_release(cmreceiver_t* self)
+{
+    assert(self);
+    self->released.store(self->queue->head.load(std::memory_order_relaxed), std::memory_order_release);
+    // pairs with the fence of the thread, which checks the room after it set the flag
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (self->waiting && self->waiting.exchange(false))
+        s_notify(self->room);
+}
@@ -0,0 +1,80 @@
+/*  =========================================================================
+    cmreceiver - Thread receiving and decoding the malamute messages
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#pragma once
+#include "cmqueue.h"
+#include <atomic>
+#include <deque>
+#include <malamute.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+//  Structure of our class
+//  Own thread receives and decodes the messages of the malamute client and pushes the samples
+//  to the queue, so bursts of messages do not stall the computation. Series are created by this
+//  thread only, so the samples refer to them by pointer. Series of a deleted asset (or with a changed
+//  unit) are retired and freed once the consumer released all samples pushed before the retirement.
+//  The thread is the only user of mlm_client_recv of the client, its actor is used by the caller.
+struct cmreceiver_t
+{
+    // series of one asset by sender and quantity
+    typedef std::unordered_map<std::string, std::unique_ptr<cmqueue_series_t>> series_map_t;
+
+    std::string                                   name;      // name of the server for the log
+    mlm_client_t*                                 client;    // malamute client, not owned
+    cmqueue_t*                                    queue;     // received samples
+    int                                           event;     // eventfd signalled when samples are pushed
+    int                                           room;      // eventfd signalled when the waiting thread can push
+    int                                           stop;      // eventfd waking the thread to end
+    std::atomic<bool>                             terminate; // thread has to end
+    std::atomic<bool>                             wait;      // metrics wait for room instead of being dropped
+    std::atomic<bool>                             waiting;   // thread waits for room in the full queue
+    alignas(64) std::atomic<uint64_t>             released;  // samples popped and handled by the consumer
+    std::unordered_map<std::string, series_map_t> assets;    // live series by asset, then by sender and quantity
+    std::string                                   key;       // key of series_map_t, reused for every message
+    std::thread                                   thread;    // receiving thread
+    // retired series with the number of samples pushed before their retirement, oldest first
+    std::deque<std::pair<uint64_t, std::unique_ptr<cmqueue_series_t>>> retired;
+};
+
+//  Create a new cmreceiver of the client with queue of capacity samples and start its thread
+//  Return NULL if fail
+cmreceiver_t* cmreceiver_new(const char* name, mlm_client_t* client, size_t capacity);
+
+//  Destroy the cmreceiver, wait for its thread to end
+void cmreceiver_destroy(cmreceiver_t** self_p);
+
+//  Set whether the metrics wait for room in the full queue (backpressure) or they are dropped
+//  Waiting metrics stay in the socket of the client, which is limited by its high water mark
+void cmreceiver_set_wait(cmreceiver_t* self, bool wait);
+
+//  Return the descriptor readable when samples were pushed to the queue
+int cmreceiver_fd(cmreceiver_t* self);
+
+//  Reset the descriptor before the samples are popped
+void cmreceiver_ack(cmreceiver_t* self);
+
+//  Release the popped samples, the caller does not refer to their series anymore
+//  Series retired before them are freed and the thread waiting for room is woken up
+void cmreceiver_release(cmreceiver_t* self);
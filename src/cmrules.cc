@@ -0,0 +1,215 @@
+/*  =========================================================================
+    cmrules - Table of rules restricting statistics computed for the metrics
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// cmrules - Table of rules restricting statistics computed for the metrics
+
+#include "cmrules.h"
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <fnmatch.h>
+
+// versions of all tables, so the version cached in series is never valid for another table
+static std::atomic<uint32_t> s_version(0);
+
+// split the comma separated list, NULL allows all
+static std::vector<std::string> s_split(const char* list)
+{
+    std::vector<std::string> result;
+    if (!list) {
+        result.push_back("*");
+        return result;
+    }
+    for (const char* p = list; *p;) {
+        const char* end = strchr(p, ',');
+        if (!end)
+            end = p + strlen(p);
+        std::string item(p, size_t(end - p));
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if (!item.empty())
+            result.push_back(item);
+        p = *end ? end + 1 : end;
+    }
+    return result;
+}
+
+static bool s_allowed(const std::vector<std::string>& list, const char* item)
+{
+    for (const std::string& allowed : list) {
+        if (allowed == "*" || allowed == item)
+            return true;
+    }
+    return false;
+}
+
+// filter the columns allowed by the rule
+static std::vector<uint32_t> s_filter(const cmrule_t& rule, const cmstats_t* stats, const std::vector<uint32_t>& columns)
+{
+    std::vector<uint32_t> result;
+    for (uint32_t column : columns) {
+        const cmstats_column_t& def = stats->columns[column];
+        if (s_allowed(rule.aggregates, cmstats_aggr_str(def.aggr)) && s_allowed(rule.steps, def.sstep.c_str()))
+            result.push_back(column);
+    }
+    return result;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmrules
+
+cmrules_t* cmrules_new(void)
+{
+    cmrules_t* self = new cmrules_t();
+    self->version   = ++s_version;
+    if (self->version == 0)
+        self->version = ++s_version;
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmrules
+
+void cmrules_destroy(cmrules_t** self_p)
+{
+    if (*self_p) {
+        delete *self_p;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Append the rule
+
+void cmrules_add(cmrules_t* self, const char* quantity, const char* asset, const char* sender, const char* aggregates,
+    const char* steps)
+{
+    assert(self);
+
+    cmrule_t rule;
+    rule.quantity   = quantity ? quantity : "";
+    rule.asset      = asset ? asset : "";
+    rule.sender     = sender ? sender : "";
+    rule.aggregates = s_split(aggregates);
+    rule.steps      = s_split(steps);
+    self->rules.push_back(rule);
+    self->senders.clear();
+}
+
+//  --------------------------------------------------------------------------
+//  Append the default rules
+
+void cmrules_add_defaults(cmrules_t* self)
+{
+    assert(self);
+
+    // PQSWMBT-3723: do not compute/agregate min/max/mean + average metrics for sensor temp. and humidity
+    // as: 'temperature.default@sensor-xxx', 'humidity.default@sensor-xxx'
+    cmrules_add(self, "temperature.default", "sensor-", nullptr, "", nullptr);
+    cmrules_add(self, "humidity.default", "sensor-", nullptr, "", nullptr);
+    // ignore linuxmetrics
+    cmrules_add(self, nullptr, nullptr, "fty_info_linuxmetrics", "", nullptr);
+    // only the short term extremes of voltages are consumed
+    cmrules_add(self, "voltage.*", nullptr, nullptr, "min,max", "15m,1h");
+    // consumption is computed only for realpower, percentiles for realpower and temperature for capacity planning
+    cmrules_add(self, "realpower.default", nullptr, nullptr, nullptr, nullptr);
+    // time weighted mean, variance and standard deviation of the irregularly sampled quantities
+    cmrules_add(self, "*temperature*", nullptr, nullptr,
+        "min,max,arithmetic_mean,p50,p95,p99,time_weighted_mean,variance,standard_deviation", nullptr);
+    cmrules_add(self, nullptr, nullptr, nullptr, "min,max,arithmetic_mean,time_weighted_mean,variance,standard_deviation",
+        nullptr);
+}
+
+//  --------------------------------------------------------------------------
+//  Compute allowed columns of all rules
+
+void cmrules_columns(cmrules_t* self, const cmstats_t* stats, const std::vector<uint32_t>& columns)
+{
+    assert(self);
+    assert(stats);
+
+    for (cmrule_t& rule : self->rules)
+        rule.columns = s_filter(rule, stats, columns);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the index of the rule of the sender
+
+int32_t cmrules_sender(cmrules_t* self, const char* sender)
+{
+    assert(self);
+    if (!sender || !*sender)
+        return -1;
+
+    auto it = self->senders.find(sender);
+    if (it != self->senders.end())
+        return it->second;
+
+    int32_t result = -1;
+    for (size_t i = 0; i < self->rules.size(); i++) {
+        if (self->rules[i].sender == sender) {
+            result = int32_t(i);
+            break;
+        }
+    }
+    self->senders.emplace(sender, result);
+    return result;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the index of the rule of the series
+
+int32_t cmrules_series(cmrules_t* self, cmstats_t* stats, uint32_t series)
+{
+    assert(self);
+    assert(stats);
+    assert(series < stats->series.size());
+
+    cmstats_series_t& entry = stats->series[series];
+    if (entry.rules_version == self->version)
+        return entry.rule;
+
+    entry.rule = -1;
+    for (size_t i = 0; i < self->rules.size(); i++) {
+        const cmrule_t& rule = self->rules[i];
+        if (!rule.sender.empty())
+            continue;
+        if (!rule.quantity.empty() && fnmatch(rule.quantity.c_str(), entry.quantity.c_str(), 0) != 0)
+            continue;
+        if (entry.asset.compare(0, rule.asset.size(), rule.asset) != 0)
+            continue;
+        entry.rule = int32_t(i);
+        break;
+    }
+    entry.rules_version = self->version;
+    return entry.rule;
+}
+
+//  --------------------------------------------------------------------------
+//  Return true if nothing is computed for the metrics of the rule
+
+bool cmrules_drop(cmrules_t* self, int32_t rule)
+{
+    assert(self);
+    if (rule < 0)
+        return false;
+    return self->rules[size_t(rule)].aggregates.empty() || self->rules[size_t(rule)].steps.empty();
+}
@@ -0,0 +1,84 @@
+/*  =========================================================================
+    cmrules - Table of rules restricting statistics computed for the metrics
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+#include "cmstats.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//  One rule, the metric matches it either by its sender (if set) or by its series
+struct cmrule_t
+{
+    std::string              quantity;   // glob pattern of the quantity, empty matches all
+    std::string              asset;      // prefix of the asset name, empty matches all
+    std::string              sender;     // sender of the stream metrics
+    std::vector<std::string> aggregates; // allowed types of computation, "*" allows all
+    std::vector<std::string> steps;      // allowed steps, "*" allows all
+    std::vector<uint32_t>    columns;    // allowed columns, see cmrules_columns
+};
+
+//  Structure of our class
+//  Rules are the policy matrix - statistics computed per quantity (and asset, sender) out of
+//  all configured types and steps. Accumulators are allocated only for the allowed statistics.
+//  The first matching rule applies. The default rules end with a catch-all one, so the types not
+//  listed in it (e.g. consumption) are not computed for the other quantities; all statistics are
+//  computed for the metrics without rule only if the rules replacing the defaults have no catch-all.
+//  Rule of the series is cached in the series itself together with the version of the table,
+//  so it is looked up once per series, rule of the sender is cached per sender.
+struct cmrules_t
+{
+    std::vector<cmrule_t>                    rules;   // rules in order of priority
+    uint32_t                                 version; // unique version of the table, never 0
+    std::unordered_map<std::string, int32_t> senders; // cached rule of the sender
+};
+
+//  Create a new empty cmrules
+cmrules_t* cmrules_new(void);
+
+//  Destroy the cmrules
+void cmrules_destroy(cmrules_t** self_p);
+
+//  Append the rule, aggregates and steps are comma separated lists, NULL allows all
+void cmrules_add(cmrules_t* self, const char* quantity, const char* asset, const char* sender, const char* aggregates,
+    const char* steps);
+
+//  Append the default rules - no statistics for sensor temperature and humidity (PQSWMBT-3723)
+//  and for the metrics of fty_info_linuxmetrics, only 15m and 1h min and max for voltages,
+//  consumption only for realpower.default, percentiles only for realpower.default and temperatures,
+//  the last one is the catch-all rule of all other metrics - min, max, arithmetic and time weighted
+//  mean, variance and standard deviation (also computed for temperatures)
+void cmrules_add_defaults(cmrules_t* self);
+
+//  Compute allowed columns of all rules from all columns of stats
+void cmrules_columns(cmrules_t* self, const cmstats_t* stats, const std::vector<uint32_t>& columns);
+
+//  Return the index of the rule of the sender, -1 if there is none
+//  Not thread safe, the result is cached
+int32_t cmrules_sender(cmrules_t* self, const char* sender);
+
+//  Return the index of the rule of the series of stats, -1 if there is none
+//  The result is cached in the series, the caller must hold the lock of stats
+int32_t cmrules_series(cmrules_t* self, cmstats_t* stats, uint32_t series);
+
+//  Return true if nothing is computed for the metrics of the rule
+bool cmrules_drop(cmrules_t* self, int32_t rule);
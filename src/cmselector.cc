@@ -0,0 +1,175 @@
+/*  =========================================================================
+    cmselector - Selection of the metrics to compute by their quantity
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// cmselector - Selection of the metrics to compute by their quantity
+
+#include "cmselector.h"
+#include <cassert>
+#include <cstring>
+#include <fnmatch.h>
+#include <fty_log.h>
+
+// number of cached decisions, the cache is dropped once it grows over
+#define CMSELECTOR_CACHE_MAX 65536
+
+// split the comma separated list of rules, empty rules are skipped
+static std::vector<std::string> s_split(const char* rules)
+{
+    std::vector<std::string> result;
+    for (const char* p = rules ? rules : ""; *p;) {
+        const char* end = strchr(p, ',');
+        if (!end)
+            end = p + strlen(p);
+        std::string rule(p, size_t(end - p));
+        rule.erase(0, rule.find_first_not_of(" \t"));
+        rule.erase(rule.find_last_not_of(" \t") + 1);
+        // fnmatch of glibc negates the bracket expression by leading ^ too, only ! negates it here
+        for (size_t at = rule.find("[^"); at != std::string::npos; at = rule.find("[^", at + 3))
+            rule.insert(at + 1, 1, '\\');
+        if (!rule.empty())
+            result.push_back(rule);
+        p = *end ? end + 1 : end;
+    }
+    return result;
+}
+
+// translate the glob pattern to regular expression
+// bracket expression negated by leading ! is negated by ^ in regular expression, leading ^ is literal,
+// [ without its closing ] is literal like in fnmatch
+static std::string s_glob_regex(const std::string& glob)
+{
+    std::string result;
+    for (size_t i = 0; i < glob.size(); i++) {
+        char c = glob[i];
+        if (c == '[') {
+            // ] right after the opening [ (or its negation) is the first member of the bracket expression
+            size_t first = i + 1 < glob.size() && glob[i + 1] == '!' ? i + 2 : i + 1;
+            size_t end   = glob.find(']', first < glob.size() && glob[first] == ']' ? first + 1 : first);
+            if (end != std::string::npos) {
+                result += '[';
+                if (first != i + 1)
+                    result += '^';
+                for (size_t j = first; j < end; j++) {
+                    // literal ^ at the beginning and the first member ]
+                    if ((j == first && glob[j] == '^') || glob[j] == ']')
+                        result += '\\';
+                    result += glob[j];
+                }
+                result += ']';
+                i = end;
+                continue;
+            }
+        }
+        if (c == '*')
+            result += ".*";
+        else if (c == '?')
+            result += '.';
+        else {
+            if (strchr(".^$|()+{}[]\\", c))
+                result += '\\';
+            result += c;
+        }
+    }
+    return result;
+}
+
+// join the translated patterns by |
+static std::string s_alternatives(const std::vector<std::string>& globs)
+{
+    std::string result;
+    for (const std::string& glob : globs) {
+        if (!result.empty())
+            result += '|';
+        result += s_glob_regex(glob);
+    }
+    return result;
+}
+
+static bool s_match_any(const std::vector<std::string>& globs, const char* quantity)
+{
+    for (const std::string& glob : globs) {
+        if (fnmatch(glob.c_str(), quantity, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmselector
+
+cmselector_t* cmselector_new(const char* include, const char* exclude)
+{
+    cmselector_t* self = new cmselector_t();
+    self->include      = s_split(include);
+    self->exclude      = s_split(exclude);
+
+    // one lookahead at the beginning instead of per character, nothing matches without include rules
+    if (!self->exclude.empty())
+        self->regex = "(?!(" + s_alternatives(self->exclude) + ")$)";
+    self->regex = "^" + self->regex + "(" + (self->include.empty() ? "(?!)" : s_alternatives(self->include)) + ")$";
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmselector
+
+void cmselector_destroy(cmselector_t** self_p)
+{
+    if (*self_p) {
+        delete *self_p;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return true if metrics of the quantity are computed
+
+bool cmselector_match(cmselector_t* self, const char* quantity)
+{
+    assert(self);
+    if (!quantity)
+        return false;
+
+    std::lock_guard<std::mutex> lock(self->mutex);
+    auto                        it = self->cache.find(quantity);
+    if (it != self->cache.end()) {
+        self->hits++;
+        return it->second;
+    }
+
+    bool match = s_match_any(self->include, quantity) && !s_match_any(self->exclude, quantity);
+    if (self->cache.size() >= CMSELECTOR_CACHE_MAX) {
+        log_debug("cmselector:\tcache of %zu quantities dropped", self->cache.size());
+        self->cache.clear();
+    }
+    self->cache.emplace(quantity, match);
+    self->misses++;
+    return match;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the regular expression equivalent to the rules
+
+const char* cmselector_regex(cmselector_t* self)
+{
+    assert(self);
+    return self->regex.c_str();
+}
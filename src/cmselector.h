@@ -0,0 +1,64 @@
+/*  =========================================================================
+    cmselector - Selection of the metrics to compute by their quantity
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//  Structure of our class
+//  Rules are glob patterns (fnmatch) matched against the whole quantity, bracket expression is negated
+//  by leading ! (leading ^ is literal), the quantity is selected if it matches any include rule and no exclude rule.
+//  Decision is cached per quantity, so recurring quantities cost one hash lookup.
+struct cmselector_t
+{
+    std::vector<std::string>              include; // include rules
+    std::vector<std::string>              exclude; // exclude rules
+    std::string                           regex;   // the same rules as one regular expression
+    std::unordered_map<std::string, bool> cache;   // decision per quantity
+    uint64_t                              hits;    // number of decisions found in cache
+    uint64_t                              misses;  // number of decisions evaluated by rules
+    std::mutex                            mutex;   // protects cache and counters
+};
+
+//  Default include rules, all power, current, voltage, temperature and humidity metrics
+#define CMSELECTOR_INCLUDE                                                                                             \
+    "realpower.default*,power.default*,current.output.L[123]*,current.input.L[123]*,"                                  \
+    "voltage.output.L[123]-N*,voltage.input.L[123]-N*,voltage.input.[12]*,*temperature*,*humidity*"
+
+//  Default exclude rules, statistics computed by fty-metric-compute itself
+#define CMSELECTOR_EXCLUDE                                                                                             \
+    "*_arithmetic_mean*,*_max_*,*_min_*,*_consumption_*,*_p50_*,*_p95_*,*_p99_*,"                                      \
+    "*_time_weighted_mean_*,*_variance_*,*_standard_deviation_*"
+
+//  Create a new cmselector from comma separated lists of include and exclude rules
+cmselector_t* cmselector_new(const char* include, const char* exclude);
+
+//  Destroy the cmselector
+void cmselector_destroy(cmselector_t** self_p);
+
+//  Return true if metrics of the quantity are computed
+bool cmselector_match(cmselector_t* self, const char* quantity);
+
+//  Return the regular expression equivalent to the rules, e.g. for fty::shm::read_metrics
+const char* cmselector_regex(cmselector_t* self);
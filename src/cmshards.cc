@@ -0,0 +1,253 @@
+/*  =========================================================================
+    cmshards - Statistics partitioned to shards with their own locks
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// cmshards - Statistics partitioned to shards with their own locks
+
+#include "cmshards.h"
+#include <algorithm>
+#include <fty_log.h>
+
+// copy all the series of src to the shards of self by their asset
+// all the columns of src are registered first, so the columns have the same ids in all shards
+static void s_copy(cmshards_t* self, const cmstats_t* src)
+{
+    for (cmshard_t* shard : self->shards) {
+        for (const cmstats_column_t& column : src->columns)
+            cmstats_column(shard->stats, cmstats_aggr_str(column.aggr), column.sstep.c_str(), column.step);
+        shard->stats->sequence = std::max(shard->stats->sequence, src->sequence);
+    }
+
+    for (uint32_t id = 0; id < src->series.size(); id++) {
+        if (!src->series[id].used)
+            continue;
+        cmshard_t* shard = self->shards[cmshards_index(self, src->series[id].asset.c_str())];
+        cmstats_copy_series(shard->stats, src, id);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmshards
+
+cmshards_t* cmshards_new(size_t nshards)
+{
+    cmshards_t* self = new cmshards_t();
+    nshards          = std::max(nshards, size_t(1));
+    for (size_t i = 0; i < nshards; i++) {
+        cmshard_t* shard    = new cmshard_t();
+        shard->stats        = cmstats_new();
+        shard->stats->shard = uint32_t(i);
+        self->shards.push_back(shard);
+    }
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmshards
+
+void cmshards_destroy(cmshards_t** self_p)
+{
+    if (*self_p) {
+        cmshards_t* self = *self_p;
+        for (cmshard_t* shard : self->shards) {
+            cmstats_destroy(&shard->stats);
+            delete shard;
+        }
+        delete self;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return the number of shards
+
+size_t cmshards_size(cmshards_t* self)
+{
+    assert(self);
+    return self->shards.size();
+}
+
+//  --------------------------------------------------------------------------
+//  Return the index of the shard containing statistics of the asset
+
+size_t cmshards_index(cmshards_t* self, const char* asset)
+{
+    assert(self);
+
+    // FNV-1a, stable between runs
+    uint64_t hash = 14695981039346656037ull;
+    for (const char* p = asset ? asset : ""; *p; p++) {
+        hash ^= uint8_t(*p);
+        hash *= 1099511628211ull;
+    }
+    return size_t(hash % self->shards.size());
+}
+
+//  --------------------------------------------------------------------------
+//  Register the column in all shards
+
+int cmshards_column(cmshards_t* self, const char* aggr_fun, const char* sstep, uint32_t step)
+{
+    assert(self);
+
+    int column = -1;
+    for (cmshard_t* shard : self->shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        int                         r = cmstats_column(shard->stats, aggr_fun, sstep, step);
+        assert(column == -1 || r == column);
+        column = r;
+    }
+    return column;
+}
+
+//  --------------------------------------------------------------------------
+//  Update the statistics of the series in the shard of the asset
+
+size_t cmshards_update(cmshards_t* self, const char* quantity, const char* asset, const uint32_t* columns,
+    size_t ncolumns, double value, uint64_t metric_time_s, const char* unit, zlist_t* published)
+{
+    assert(self);
+
+    cmshard_t*                  shard = self->shards[cmshards_index(self, asset)];
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    uint32_t                    series = cmstats_series(shard->stats, quantity, asset);
+    return cmstats_series_update(shard->stats, series, columns, ncolumns, value, metric_time_s, unit, published);
+}
+
+//  --------------------------------------------------------------------------
+//  Copy the accumulator of the statistic to acc
+
+bool cmshards_lookup(cmshards_t* self, const char* quantity, const char* aggr_fun, const char* sstep,
+    const char* asset, cmstats_acc_t* acc)
+{
+    assert(self);
+
+    cmshard_t*                  shard = self->shards[cmshards_index(self, asset)];
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    return cmstats_lookup(shard->stats, quantity, aggr_fun, sstep, asset, acc);
+}
+
+//  --------------------------------------------------------------------------
+//  Remove all the entries related to all assets from the list of asset names
+
+void cmshards_delete_assets(cmshards_t* self, zlist_t* asset_names)
+{
+    assert(self);
+    assert(asset_names);
+
+    std::vector<std::vector<const char*>> names(self->shards.size());
+    for (const char* asset_name = reinterpret_cast<const char*>(zlist_first(asset_names)); asset_name != nullptr;
+         asset_name             = reinterpret_cast<const char*>(zlist_next(asset_names))) {
+        names[cmshards_index(self, asset_name)].push_back(asset_name);
+    }
+
+    for (size_t i = 0; i < self->shards.size(); i++) {
+        if (names[i].empty())
+            continue;
+        std::lock_guard<std::mutex> lock(self->shards[i]->mutex);
+        for (const char* asset_name : names[i])
+            cmstats_delete_asset(self->shards[i]->stats, asset_name);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Polling handler - publish && reset the computed values if needed
+
+size_t cmshards_poll(cmshards_t* self, zlist_t* published)
+{
+    assert(self);
+
+    size_t n = 0;
+    for (cmshard_t* shard : self->shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        n += cmstats_poll(shard->stats, published);
+    }
+    return n;
+}
+
+//  --------------------------------------------------------------------------
+//  Append the full state or the changes of all shards to buffer
+
+void cmshards_encode(cmshards_t* self, bool full, std::string& buffer)
+{
+    assert(self);
+
+    for (cmshard_t* shard : self->shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        if (full)
+            cmstats_encode(shard->stats, buffer);
+        else
+            cmstats_encode_delta(shard->stats, buffer);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Save all shards to filename
+
+int cmshards_save(cmshards_t* self, const char* filename)
+{
+    assert(self);
+    assert(filename);
+
+    std::string buffer;
+    cmshards_encode(self, true, buffer);
+    return cmstats_write(filename, buffer, false);
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmshards from the statistics
+
+cmshards_t* cmshards_from(cmstats_t** stats_p, size_t nshards)
+{
+    assert(stats_p && *stats_p);
+
+    cmshards_t* self = cmshards_new(nshards);
+    s_copy(self, *stats_p);
+    cmstats_destroy(stats_p);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the new cmshards with nshards shards containing all the statistics of self
+
+cmshards_t* cmshards_resize(cmshards_t** self_p, size_t nshards)
+{
+    assert(self_p && *self_p);
+
+    cmshards_t* self  = *self_p;
+    cmshards_t* fresh = cmshards_new(nshards);
+    for (cmshard_t* shard : self->shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        s_copy(fresh, shard->stats);
+    }
+    cmshards_destroy(self_p);
+    return fresh;
+}
+
+//  --------------------------------------------------------------------------
+//  Load the cmshards from filename
+
+cmshards_t* cmshards_load(const char* filename, size_t nshards)
+{
+    cmstats_t* stats = cmstats_load(filename);
+    if (!stats)
+        return nullptr;
+    return cmshards_from(&stats, nshards);
+}
@@ -0,0 +1,91 @@
+/*  =========================================================================
+    cmshards - Statistics partitioned to shards with their own locks
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+#include "cmstats.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+//  One partition of the statistics
+struct cmshard_t
+{
+    std::mutex mutex; // protects stats
+    cmstats_t* stats; // statistics of the assets of the shard
+};
+
+//  Structure of our class
+//  All series of one asset are in the same shard, so the asset is deleted in one shard only.
+//  All shards have the same columns with the same ids.
+struct cmshards_t
+{
+    std::vector<cmshard_t*> shards;
+};
+
+//  Create a new cmshards with nshards empty shards (at least one)
+cmshards_t* cmshards_new(size_t nshards);
+
+//  Destroy the cmshards
+void cmshards_destroy(cmshards_t** self_p);
+
+//  Return the number of shards
+size_t cmshards_size(cmshards_t* self);
+
+//  Return the index of the shard containing statistics of the asset
+size_t cmshards_index(cmshards_t* self, const char* asset);
+
+//  Register the column (type of computation, step) in all shards and return its index
+//  Return -1 if the type of computation is not supported
+int cmshards_column(cmshards_t* self, const char* aggr_fun, const char* sstep, uint32_t step);
+
+//  Update the statistics in all given columns of the (quantity, asset) series with the new value
+//  Only the shard of the asset is locked, see cmstats_series_update for the parameters
+size_t cmshards_update(cmshards_t* self, const char* quantity, const char* asset, const uint32_t* columns,
+    size_t ncolumns, double value, uint64_t metric_time_s, const char* unit, zlist_t* published);
+
+//  Copy the accumulator of the statistic to acc (if not NULL), return false if there is no such statistic
+bool cmshards_lookup(cmshards_t* self, const char* quantity, const char* aggr_fun, const char* sstep,
+    const char* asset, cmstats_acc_t* acc);
+
+//  Remove all the entries related to all assets from the list of asset names
+//  Every shard is locked once at most
+void cmshards_delete_assets(cmshards_t* self, zlist_t* asset_names);
+
+//  Polling handler - publish && reset the computed values if needed, shard by shard
+//  Messages of all shards are appended to published, see cmstats_poll
+size_t cmshards_poll(cmshards_t* self, zlist_t* published);
+
+//  Append the full state (full is true) or the changes since the last call of all shards
+//  to buffer, shard by shard
+void cmshards_encode(cmshards_t* self, bool full, std::string& buffer);
+
+//  Save all shards to filename, return -1 if fail
+int cmshards_save(cmshards_t* self, const char* filename);
+
+//  Create a new cmshards with nshards shards from the statistics, stats are destroyed
+cmshards_t* cmshards_from(cmstats_t** stats_p, size_t nshards);
+
+//  Return the new cmshards with nshards shards containing all the statistics of self,
+//  self is destroyed
+cmshards_t* cmshards_resize(cmshards_t** self_p, size_t nshards);
+
+//  Load the cmshards with nshards shards from filename, return NULL if fail
+cmshards_t* cmshards_load(const char* filename, size_t nshards);
@@ -0,0 +1,234 @@
+/*  =========================================================================
+    cmsketch - Mergeable quantile sketch of bounded size
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/// cmsketch - Mergeable quantile sketch of bounded size
+
+#include "cmsketch.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+// base of the logarithmic bins, the middle of the bin is within CMSKETCH_ACCURACY of all its values
+static const double s_gamma    = (1 + CMSKETCH_ACCURACY) / (1 - CMSKETCH_ACCURACY);
+static const double s_ln_gamma = std::log(s_gamma);
+
+// key of the bin of the positive value
+static int32_t s_key(double value)
+{
+    return int32_t(std::ceil(std::log(value) / s_ln_gamma));
+}
+
+// estimate of the values in the bin of the key
+static double s_value(int32_t key)
+{
+    return 2 * std::pow(s_gamma, key) / (1 + s_gamma);
+}
+
+// fold the bins below offset into the bin of offset
+static void s_collapse(cmsketch_store_t& store, int32_t offset)
+{
+    if (offset <= store.offset)
+        return;
+    size_t   n      = size_t(int64_t(offset) - store.offset);
+    uint32_t folded = 0;
+    for (size_t i = 0; i < std::min(n, store.bins.size()); i++)
+        folded += store.bins[i];
+    if (n >= store.bins.size())
+        store.bins.assign(1, folded);
+    else {
+        store.bins.erase(store.bins.begin(), store.bins.begin() + ptrdiff_t(n));
+        store.bins[0] += folded;
+    }
+    store.offset = offset;
+}
+
+// count n values in the bin of the key, the store never grows beyond CMSKETCH_MAX_BINS bins
+static void s_store_add(cmsketch_store_t& store, int32_t key, uint32_t n)
+{
+    if (store.bins.empty()) {
+        store.offset = key;
+        store.bins.assign(1, 0);
+    } else if (key >= store.offset + int32_t(store.bins.size())) {
+        // the highest values are kept, the lowest bins are collapsed
+        s_collapse(store, key - CMSKETCH_MAX_BINS + 1);
+        store.bins.resize(size_t(key - store.offset) + 1, 0);
+    } else if (key < store.offset) {
+        key = std::max(key, store.offset + int32_t(store.bins.size()) - CMSKETCH_MAX_BINS);
+        if (key < store.offset) {
+            store.bins.insert(store.bins.begin(), size_t(store.offset - key), 0);
+            store.offset = key;
+        }
+    }
+    store.bins[size_t(key - store.offset)] += n;
+}
+
+//  --------------------------------------------------------------------------
+//  Remove all the values
+
+void cmsketch_reset(cmsketch_t* self)
+{
+    assert(self);
+    self->positive.offset = 0;
+    self->positive.bins.clear();
+    self->negative.offset = 0;
+    self->negative.bins.clear();
+    self->zeros = 0;
+    self->count = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Add the value
+
+void cmsketch_add(cmsketch_t* self, double value)
+{
+    assert(self);
+    if (std::isnan(value))
+        return;
+
+    if (value > CMSKETCH_MIN_VALUE)
+        s_store_add(self->positive, s_key(value), 1);
+    else if (value < -CMSKETCH_MIN_VALUE)
+        s_store_add(self->negative, -s_key(-value), 1);
+    else
+        self->zeros++;
+    self->count++;
+}
+
+//  --------------------------------------------------------------------------
+//  Add all the values of other to self
+
+void cmsketch_merge(cmsketch_t* self, const cmsketch_t* other)
+{
+    assert(self);
+    assert(other);
+
+    for (size_t i = 0; i < other->positive.bins.size(); i++) {
+        if (other->positive.bins[i] != 0)
+            s_store_add(self->positive, other->positive.offset + int32_t(i), other->positive.bins[i]);
+    }
+    for (size_t i = 0; i < other->negative.bins.size(); i++) {
+        if (other->negative.bins[i] != 0)
+            s_store_add(self->negative, other->negative.offset + int32_t(i), other->negative.bins[i]);
+    }
+    self->zeros += other->zeros;
+    self->count += other->count;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the number of values
+
+uint64_t cmsketch_count(const cmsketch_t* self)
+{
+    assert(self);
+    return self->count;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the estimate of quantile q of the values
+
+double cmsketch_quantile(const cmsketch_t* self, double q)
+{
+    assert(self);
+    if (self->count == 0)
+        return NAN;
+
+    // the values are visited from the lowest one until the rank is reached
+    double   rank = std::min(std::max(q, 0.0), 1.0) * double(self->count - 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < self->negative.bins.size(); i++) {
+        seen += self->negative.bins[i];
+        if (double(seen) > rank)
+            return -s_value(-(self->negative.offset + int32_t(i)));
+    }
+    seen += self->zeros;
+    if (double(seen) > rank)
+        return 0;
+    for (size_t i = 0; i < self->positive.bins.size(); i++) {
+        seen += self->positive.bins[i];
+        if (double(seen) > rank)
+            return s_value(self->positive.offset + int32_t(i));
+    }
+    return s_value(self->positive.offset + int32_t(self->positive.bins.size()) - 1);
+}
+
+// append offset, number of bins and the bins of the store
+static void s_store_encode(const cmsketch_store_t& store, std::string& buffer)
+{
+    uint32_t nbins = uint32_t(store.bins.size());
+    buffer.append(reinterpret_cast<const char*>(&store.offset), sizeof(store.offset));
+    buffer.append(reinterpret_cast<const char*>(&nbins), sizeof(nbins));
+    buffer.append(reinterpret_cast<const char*>(store.bins.data()), nbins * sizeof(uint32_t));
+}
+
+// read the store at pos, return false if the data are too short or the store is too large
+static bool s_store_decode(cmsketch_store_t& store, const char*& pos, const char* end, uint64_t& count)
+{
+    uint32_t nbins;
+    if (size_t(end - pos) < sizeof(store.offset) + sizeof(nbins))
+        return false;
+    memcpy(&store.offset, pos, sizeof(store.offset));
+    memcpy(&nbins, pos + sizeof(store.offset), sizeof(nbins));
+    pos += sizeof(store.offset) + sizeof(nbins);
+    if (nbins > CMSKETCH_MAX_BINS || size_t(end - pos) < nbins * sizeof(uint32_t))
+        return false;
+    store.bins.resize(nbins);
+    memcpy(store.bins.data(), pos, nbins * sizeof(uint32_t));
+    pos += nbins * sizeof(uint32_t);
+    for (uint32_t n : store.bins)
+        count += n;
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  Append the binary representation of the sketch to buffer
+
+void cmsketch_encode(const cmsketch_t* self, std::string& buffer)
+{
+    assert(self);
+    s_store_encode(self->positive, buffer);
+    s_store_encode(self->negative, buffer);
+    buffer.append(reinterpret_cast<const char*>(&self->zeros), sizeof(self->zeros));
+}
+
+//  --------------------------------------------------------------------------
+//  Read the sketch from the binary representation at data
+
+size_t cmsketch_decode(cmsketch_t* self, const char* data, size_t size)
+{
+    assert(self);
+    assert(data || size == 0);
+
+    const char* pos   = data;
+    const char* end   = data + size;
+    uint64_t    count = 0;
+    cmsketch_reset(self);
+    if (!s_store_decode(self->positive, pos, end, count) || !s_store_decode(self->negative, pos, end, count) ||
+        size_t(end - pos) < sizeof(self->zeros)) {
+        cmsketch_reset(self);
+        return 0;
+    }
+    memcpy(&self->zeros, pos, sizeof(self->zeros));
+    pos += sizeof(self->zeros);
+    self->count = count + self->zeros;
+    return size_t(pos - data);
+}
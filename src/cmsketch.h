@@ -0,0 +1,76 @@
+/*  =========================================================================
+    cmsketch - Mergeable quantile sketch of bounded size
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//  Relative accuracy of the estimated quantiles
+#define CMSKETCH_ACCURACY 0.01
+//  Maximal number of bins of one sign, the lowest bins are collapsed beyond it
+#define CMSKETCH_MAX_BINS 512
+//  Values closer to zero are counted as zero
+#define CMSKETCH_MIN_VALUE 1e-9
+
+//  Counts of the values in logarithmic bins, bin k holds the values in (gamma^(k-1), gamma^k]
+struct cmsketch_store_t
+{
+    int32_t               offset; // key of the first bin
+    std::vector<uint32_t> bins;   // number of values in bins of consecutive keys
+};
+
+//  Structure of our class
+//  DDSketch - every value is counted in the bin of its magnitude, so any quantile is estimated
+//  with the relative error CMSKETCH_ACCURACY and sketches of two intervals merge by adding the bins.
+//  The sketch is a plain value embedded in its owner, so there is no new/destroy.
+struct cmsketch_t
+{
+    cmsketch_store_t positive; // bins of the positive values
+    cmsketch_store_t negative; // bins of the negative values, keys are negated, so the lowest value is first
+    uint64_t         zeros;    // number of the values closer to zero than CMSKETCH_MIN_VALUE
+    uint64_t         count;    // number of all the values
+};
+
+//  Remove all the values, the memory of the bins is kept for reuse
+void cmsketch_reset(cmsketch_t* self);
+
+//  Add the value, NaN is ignored
+void cmsketch_add(cmsketch_t* self, double value);
+
+//  Add all the values of other to self
+void cmsketch_merge(cmsketch_t* self, const cmsketch_t* other);
+
+//  Return the number of values
+uint64_t cmsketch_count(const cmsketch_t* self);
+
+//  Return the estimate of quantile q (0 <= q <= 1) of the values, NaN if there are none
+//  The quantile is the value of rank q * (count - 1) rounded down, in the ascending order
+double cmsketch_quantile(const cmsketch_t* self, double q);
+
+//  Append the binary representation of the sketch to buffer
+void cmsketch_encode(const cmsketch_t* self, std::string& buffer);
+
+//  Read the sketch from the binary representation at data
+//  Return the number of bytes read, 0 if the data are not a valid sketch
+size_t cmsketch_decode(cmsketch_t* self, const char* data, size_t size);
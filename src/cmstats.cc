@@ -22,98 +22,390 @@
 /// cmstats - Computing the stats on metrics
 
 #include "cmstats.h"
+#include "cmsweep.h"
 #include "fty_mc_server.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <clocale>
 #include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
 #include <fty_log.h>
 #include <fty_proto.h>
-#include <fty_shm.h>
-#include <ctime>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// fill the key of the index for (quantity, asset)
+// the buffer is reused, so no allocation is needed once it is large enough
+static void s_key(std::string& key, const char* quantity, const char* asset)
+{
+    key.assign(quantity ? quantity : "");
+    key.push_back('@');
+    key.append(asset ? asset : "");
+}
 
-typedef void(compute_fn)(const fty_proto_t* bmsg, fty_proto_t* stat_msg);
+// build the message to be published from the accumulated state
+// \param series - series of the statistic
+// \param column - column of the statistic
+// \param acc - accumulator of the statistic
+// \param value - the value to be published (consumption is completed up to the end of the interval)
+static fty_proto_t* s_encode(
+    const cmstats_series_t& series, const cmstats_column_t& column, const cmstats_acc_t* acc, double value)
+{
+    fty_proto_t* bmsg = fty_proto_new(FTY_PROTO_METRIC);
+    assert(bmsg);
 
-static void s_destructor(void** self_p)
+    fty_proto_set_type(bmsg, "%s_%s_%s", series.quantity.c_str(), cmstats_aggr_str(acc->aggr), column.sstep.c_str());
+    fty_proto_set_name(bmsg, "%s", series.asset.c_str());
+    fty_proto_set_time(bmsg, acc->interval_start);
+    fty_proto_set_ttl(bmsg, 2 * acc->step);
+    if (acc->aggr == CMSTATS_AGGR_CONSUMPTION) {
+        fty_proto_set_unit(bmsg, "Ws");
+        fty_proto_set_value(bmsg, "%.1f", value);
+        // last power received is kept in the sum, sums are published with full precision
+        fty_proto_aux_insert(bmsg, AGENT_CM_SUM, "%.17g", acc->last_value);
+    } else {
+        fty_proto_set_unit(bmsg, "%s", series.unit.c_str());
+        fty_proto_set_value(bmsg, "%.2f", value);
+        fty_proto_aux_insert(bmsg, AGENT_CM_SUM, "%.17g", acc->sum);
+    }
+    fty_proto_aux_insert(bmsg, AGENT_CM_COUNT, "%" PRIu64, acc->count);
+    fty_proto_aux_insert(bmsg, AGENT_CM_TYPE, "%s", cmstats_aggr_str(acc->aggr));
+    fty_proto_aux_insert(bmsg, AGENT_CM_STEP, "%" PRIu32, acc->step);
+    fty_proto_aux_insert(bmsg, AGENT_CM_LASTTS, "%" PRIu64, acc->last_ts);
+    return bmsg;
+}
+
+// remove the series and keep its id for reuse
+static void s_series_delete(cmstats_t* self, uint32_t id)
 {
-    fty_proto_destroy(reinterpret_cast<fty_proto_t**>(self_p));
+    cmstats_series_t& series = self->series[id];
+    s_key(self->key, series.quantity.c_str(), series.asset.c_str());
+    self->index.erase(self->key);
+    series.used = false;
+    series.generation++;
+    series.rules_version = 0;
+    series.quantity.clear();
+    series.asset.clear();
+    series.unit.clear();
+    series.slots.clear();
+    series.stats.clear();
+    series.sketches.clear();
+    self->free_series.push_back(id);
 }
 
-static void* s_duplicator(const void* self)
+// statistic of the series in the column, NULL if the series is not computed in the column
+static cmstats_stat_t* s_stat(cmstats_series_t& series, size_t column)
 {
-    return fty_proto_dup(const_cast<fty_proto_t*>(reinterpret_cast<const fty_proto_t*>(self)));
+    if (column >= series.slots.size() || series.slots[column] == 0)
+        return nullptr;
+    return &series.stats[series.slots[column] - 1];
 }
 
-// find minimum value
-// \param bmsg - input new metric
-// \param stat_msg - output statistic metric
-static bool s_min(const fty_proto_t* bmsg, fty_proto_t* stat_msg)
+static const cmstats_stat_t* s_stat(const cmstats_series_t& series, size_t column)
 {
-    assert(bmsg);
-    assert(stat_msg);
-    double   bmsg_value = atof(fty_proto_value(const_cast<fty_proto_t*>(bmsg)));
-    uint64_t count      = fty_proto_aux_number(stat_msg, AGENT_CM_COUNT, 0);
-    double   stat_value = atof(fty_proto_value(stat_msg));
+    return s_stat(const_cast<cmstats_series_t&>(series), column);
+}
+
+// gather the accumulator of the statistic from the hot state in the arrays of its column and the rest of it
+static void s_gather(const cmstats_column_t& column, const cmstats_stat_t* stat, cmstats_acc_t* acc)
+{
+    uint32_t i          = stat->member;
+    acc->value          = column.value[i];
+    acc->sum            = column.sum[i];
+    acc->min            = stat->min;
+    acc->max            = stat->max;
+    acc->last_value     = stat->last_value;
+    acc->extra          = stat->extra;
+    acc->count          = column.count[i];
+    acc->last_ts        = stat->last_ts;
+    acc->interval_start = column.interval_start[i];
+    acc->step           = stat->step;
+    acc->aggr           = stat->aggr;
+    acc->sketch         = stat->sketch;
+}
+
+// scatter the updated accumulator back to the statistic, the end of its interval is kept for the sweep
+// the sketch is attached to the statistic by s_sketch_attach only
+static void s_scatter(cmstats_column_t& column, cmstats_stat_t* stat, const cmstats_acc_t& acc)
+{
+    uint32_t i               = stat->member;
+    column.value[i]          = acc.value;
+    column.sum[i]            = acc.sum;
+    column.count[i]          = acc.count;
+    column.interval_start[i] = acc.interval_start;
+    column.ends[i]           = acc.step == 0 ? UINT64_MAX : acc.interval_start + acc.step;
+    stat->min                = acc.min;
+    stat->max                = acc.max;
+    stat->last_value         = acc.last_value;
+    stat->extra              = acc.extra;
+    stat->last_ts            = acc.last_ts;
+    stat->step               = acc.step;
+    stat->aggr               = acc.aggr;
+}
+
+// quantile of the values estimated by the sketch for the type of computation, -1 if it is not a percentile
+static constexpr double s_quantile_of(cmstats_aggr_t aggr)
+{
+    return aggr == CMSTATS_AGGR_P50 ? 0.50 : aggr == CMSTATS_AGGR_P95 ? 0.95 : aggr == CMSTATS_AGGR_P99 ? 0.99 : -1;
+}
+
+// true if the type of computation is a percentile estimated by the sketch
+static constexpr bool s_percentile(cmstats_aggr_t aggr)
+{
+    return s_quantile_of(aggr) >= 0;
+}
+
+// statistic of the series in the column, allocated if it does not exist yet, together with its member
+// of the column, which is not started until the statistic is scattered with its step
+// pointers to the other statistics of the series are not valid after the allocation
+static cmstats_stat_t* s_stat_alloc(cmstats_t* self, uint32_t series_id, size_t column_id)
+{
+    cmstats_series_t& series = self->series[series_id];
+    if (column_id >= series.slots.size())
+        series.slots.resize(column_id + 1, 0);
+    if (series.slots[column_id] == 0) {
+        assert(series.stats.size() < UINT16_MAX);
+        cmstats_column_t& column = self->columns[column_id];
+        series.stats.emplace_back();
+        series.stats.back().member = uint32_t(column.members.size());
+        series.slots[column_id]    = uint16_t(series.stats.size());
+        column.members.push_back({series_id, series.generation});
+        column.ends.push_back(UINT64_MAX);
+        column.interval_start.push_back(0);
+        column.count.push_back(0);
+        column.value.push_back(0);
+        column.sum.push_back(0);
+    }
+    return &series.stats[series.slots[column_id] - 1];
+}
+
+// sketch shared by the percentiles of the step, NULL if sketch is 0 (not a percentile)
+static cmstats_sketch_t* s_sketch(cmstats_series_t& series, uint16_t sketch)
+{
+    return sketch == 0 ? nullptr : &series.sketches[sketch - 1];
+}
+
+// add the value to the sketch, unless some other percentile of the step has already added it
+static void s_sketch_add(cmstats_sketch_t* sketch, double value, uint64_t metric_time_s)
+{
+    if (metric_time_s <= sketch->added)
+        return;
+    cmsketch_add(&sketch->values, value);
+    sketch->added = metric_time_s;
+}
+
+// merge the closed interval of the base to the sketch, unless some other percentile of the step has already merged it
+static void s_sketch_merge(cmstats_sketch_t* sketch, const cmsketch_t* closed_values, uint64_t closed_start)
+{
+    if (sketch->merged == closed_start)
+        return;
+    cmsketch_merge(&sketch->values, closed_values);
+    sketch->merged = closed_start;
+}
+
+// move the values of the interval to closed, unless some other percentile of the step has already moved them
+static const cmsketch_t* s_sketch_end(cmstats_sketch_t* sketch, uint64_t interval_start)
+{
+    if (sketch->ended != interval_start) {
+        std::swap(sketch->values, sketch->closed);
+        cmsketch_reset(&sketch->values);
+        sketch->ended = interval_start;
+    }
+    return &sketch->closed;
+}
+
+// remember the series was changed since the last checkpoint
+static void s_touch(cmstats_t* self, uint32_t id)
+{
+    cmstats_series_t& series = self->series[id];
+    if (!series.dirty) {
+        series.dirty = true;
+        self->dirty.push_back(id);
+    }
+}
+
+// make sure the column is scheduled no later than deadline
+static void s_schedule(cmstats_t* self, uint32_t column_id, uint64_t deadline)
+{
+    cmstats_column_t& column = self->columns[column_id];
+    if (column.deadline != 0) {
+        if (column.deadline <= deadline)
+            return;
+        self->schedule.erase({column.deadline, column_id});
+    }
+    column.deadline = deadline;
+    self->schedule.insert({deadline, column_id});
+}
+
+// schedule the statistic started (or overwritten) out of the poll, its interval may end earlier than the column knows
+static void s_reschedule(cmstats_t* self, uint32_t column_id, const cmstats_acc_t* acc)
+{
+    s_schedule(self, column_id, acc->interval_start + acc->step);
+}
+
+// start the computation with the first value
+// \param acc - accumulator
+// \param value - input new value
+// \param metric_time_s - timestamp of the input new value
+static void s_start(cmstats_acc_t* acc, double value, uint64_t metric_time_s)
+{
+    acc->value      = value;
+    acc->sum        = value;
+    acc->min        = value;
+    acc->max        = value;
+    acc->last_value = value;
+    acc->count      = 1;
+    acc->last_ts    = metric_time_s;
+}
+
+// restart the computation for the next interval, the last value is kept for the time weighted mean
+// \param acc - accumulator
+// \param interval_start - left margin of the next interval
+static void s_restart(cmstats_acc_t* acc, uint64_t interval_start)
+{
+    acc->value          = 0;
+    acc->sum            = 0;
+    acc->extra          = 0;
+    acc->count          = 0;
+    acc->interval_start = interval_start;
+}
 
-    if (std::isnan(stat_value) || count == 0 || (bmsg_value < stat_value)) {
-        fty_proto_set_value(stat_msg, "%.2f", bmsg_value);
+// find minimum value
+// \param acc - accumulator
+// \param value - input new value
+static bool s_min(cmstats_acc_t* acc, double value)
+{
+    if (std::isnan(acc->value) || acc->count == 0 || (value < acc->value)) {
+        acc->value = value;
     }
 
     return true;
 }
 
 // find maximum value
-// \param bmsg - input new metric
-// \param stat_msg - output statistic metric
-static bool s_max(const fty_proto_t* bmsg, fty_proto_t* stat_msg)
+// \param acc - accumulator
+// \param value - input new value
+static bool s_max(cmstats_acc_t* acc, double value)
 {
-    assert(bmsg);
-    assert(stat_msg);
-    double   bmsg_value = atof(fty_proto_value(const_cast<fty_proto_t*>(bmsg)));
-    uint64_t count      = fty_proto_aux_number(stat_msg, AGENT_CM_COUNT, 0);
-    double   stat_value = atof(fty_proto_value(stat_msg));
-
-    if (std::isnan(stat_value) || count == 0 || (bmsg_value > stat_value)) {
-        fty_proto_set_value(stat_msg, "%.2f", bmsg_value);
+    if (std::isnan(acc->value) || acc->count == 0 || (value > acc->value)) {
+        acc->value = value;
     }
 
     return true;
 }
 
 // find average value
-// \param bmsg - input new metric
-// \param stat_msg - output statistic metric
-static bool s_arithmetic_mean(const fty_proto_t* bmsg, fty_proto_t* stat_msg)
+// \param acc - accumulator
+// \param value - input new value
+static bool s_arithmetic_mean(cmstats_acc_t* acc, double value)
 {
-    assert(bmsg);
-    assert(stat_msg);
-    double   value = atof(fty_proto_value(const_cast<fty_proto_t*>(bmsg)));
-    uint64_t count = fty_proto_aux_number(stat_msg, AGENT_CM_COUNT, 0);
-    double   sum   = atof(fty_proto_aux_string(stat_msg, AGENT_CM_SUM, "0"));
-
-    if (std::isnan(value) || std::isnan(sum)) {
-        log_warning("s_arithmetic_mean: isnan value(%s) or sum (%s) for %s@%s, skipping",
-            fty_proto_value(const_cast<fty_proto_t*>(bmsg)), fty_proto_aux_string(stat_msg, AGENT_CM_SUM, "0"),
-            fty_proto_type(const_cast<fty_proto_t*>(bmsg)), fty_proto_name(const_cast<fty_proto_t*>(bmsg)));
+    if (std::isnan(value) || std::isnan(acc->sum)) {
+        log_warning("s_arithmetic_mean: isnan value(%f) or sum (%f), skipping", value, acc->sum);
         return false;
     }
 
     // 0 means that we have first value
-    if (count == 0)
-        sum = value;
-    else
-        sum += value;
+    double sum = (acc->count == 0) ? value : acc->sum + value;
 
-    double avg = (sum / double(count + 1));
+    double avg = (sum / double(acc->count + 1));
     if (std::isnan(avg)) {
-        log_error("s_arithmetic_mean: isnan (avg) %f / (%" PRIu64 " + 1), for %s@%s, skipping", sum, count,
-            fty_proto_type(const_cast<fty_proto_t*>(bmsg)), fty_proto_name(const_cast<fty_proto_t*>(bmsg)));
+        log_error("s_arithmetic_mean: isnan (avg) %f / (%" PRIu64 " + 1), skipping", sum, acc->count);
         return false;
     }
 
     // Sample was accepted
-    fty_proto_aux_insert(stat_msg, AGENT_CM_SUM, "%f", sum);
-    fty_proto_set_value(stat_msg, "%.2f", avg);
+    acc->sum   = sum;
+    acc->value = avg;
+    return true;
+}
+
+// hold the last value from its timestamp (or the start of interval) up to time_s in the time weighted mean
+// the mean is updated incrementally, weighted by the time covered so far (extra)
+// \param acc - accumulator
+// \param time_s - end of the time the last value is held
+static void s_hold(cmstats_acc_t* acc, uint64_t time_s)
+{
+    uint64_t from = std::max(acc->last_ts, acc->interval_start);
+    if (acc->last_ts == 0 || time_s <= from)
+        return;
+    acc->extra += double(time_s - from);
+    acc->value += (acc->last_value - acc->value) * double(time_s - from) / acc->extra;
+}
+
+// find the time weighted average value, every value is held until the next one
+// \param acc - accumulator
+// \param value - input new value
+// \param metric_time_s - timestamp of the input new value
+static bool s_time_weighted_mean(cmstats_acc_t* acc, double value, uint64_t metric_time_s)
+{
+    if (std::isnan(value)) {
+        log_warning("s_time_weighted_mean: isnan value(%f), skipping", value);
+        return false;
+    }
+
+    s_hold(acc, metric_time_s);
+    // no time is covered until the second value of the series
+    if (acc->extra == 0)
+        acc->value = value;
     return true;
 }
 
+// compute the sample variance (or standard deviation) of count values from the sum of squared deviations
+// \param acc - accumulator
+// \param count - number of the values
+// \param stddev - standard deviation instead of the variance
+static void s_variance_value(cmstats_acc_t* acc, uint64_t count, bool stddev)
+{
+    double variance = (count > 1) ? acc->extra / double(count - 1) : 0;
+    acc->value      = stddev ? std::sqrt(variance) : variance;
+}
+
+// update the sum of squared deviations from the mean by the value - Welford's online algorithm,
+// the mean of the previous values is their sum / count
+// \param acc - accumulator
+// \param value - input new value
+// \param stddev - standard deviation instead of the variance
+static bool s_variance(cmstats_acc_t* acc, double value, bool stddev)
+{
+    if (std::isnan(value)) {
+        log_warning("s_variance: isnan value(%f), skipping", value);
+        return false;
+    }
+
+    double n     = double(acc->count);
+    double mean  = (acc->count == 0) ? 0 : acc->sum / n;
+    double delta = value - mean;
+    acc->extra += delta * (value - (mean + delta / (n + 1)));
+    s_variance_value(acc, acc->count + 1, stddev);
+    return true;
+}
+
+// merge the sum of squared deviations of the closed interval - Chan's parallel algorithm
+// \param acc - accumulator of the longer step
+// \param closed - state of the closed interval
+// \param stddev - standard deviation instead of the variance
+static void s_variance_merge(cmstats_acc_t* acc, const cmstats_acc_t& closed, bool stddev)
+{
+    if (acc->count == 0)
+        acc->extra = closed.extra;
+    else {
+        double na    = double(acc->count);
+        double nb    = double(closed.count);
+        double delta = closed.sum / nb - acc->sum / na;
+        acc->extra += closed.extra + delta * delta * na * nb / (na + nb);
+    }
+    s_variance_value(acc, acc->count + closed.count, stddev);
+}
+
 // transform timestamp to readable string format
 // \param tm_s - input timestamp in sec
 std::string getTimeStampStr(const uint64_t tm_s) {
@@ -126,38 +418,407 @@ std::string getTimeStampStr(const uint64_t tm_s) {
 }
 
 // compute consumption value
-// \param bmsg - input new metric
-// \param stat_msg - output statistic metric
-static bool s_consumption(const fty_proto_t* bmsg, fty_proto_t* stat_msg)
+// \param acc - accumulator
+// \param value - input new value
+// \param now_s - current time
+static bool s_consumption(cmstats_acc_t* acc, double value, uint64_t now_s)
 {
-    assert(bmsg);
-    assert(stat_msg);
-
-    double value = atof(fty_proto_value(const_cast<fty_proto_t*>(bmsg)));
-
     if (std::isnan(value)) {
-        log_warning("s_consumption: isnan value(%s) for %s@%s, skipping",
-            fty_proto_value(const_cast<fty_proto_t*>(bmsg)), fty_proto_type(const_cast<fty_proto_t*>(bmsg)),
-            fty_proto_name(const_cast<fty_proto_t*>(bmsg)));
+        log_warning("s_consumption: isnan value(%f), skipping", value);
         return false;
     }
 
-    // Compute value for the current interval
-    double consumption = atof(fty_proto_value(stat_msg));
-    uint64_t now_s = uint64_t(zclock_time()/1000);
-    uint64_t last_metric_time_s = fty_proto_aux_number(stat_msg, AGENT_CM_LASTTS, 0);
-    // Get last power received which is saved in the sum aux dictionary
-    double last_metric_value = atof(fty_proto_aux_string(stat_msg, AGENT_CM_SUM, ""));
-    // Save new value in the sum aux dictionary
-    fty_proto_aux_insert(stat_msg, AGENT_CM_SUM, "%s", fty_proto_value(const_cast<fty_proto_t*>(bmsg)));
-    double inc = last_metric_value * static_cast<double>(now_s - last_metric_time_s);
-    if (inc > 0) consumption += inc;
-    log_debug("s_consumption: update consumption %s: %.1f (inc=%.1f) %" PRIu64"(%s)-%" PRIu64"(%s) %" PRIu64,
-        fty_proto_name(const_cast<fty_proto_t*>(bmsg)), consumption, inc, now_s, getTimeStampStr(now_s).c_str(),
-        last_metric_time_s, getTimeStampStr(last_metric_time_s).c_str(), now_s - last_metric_time_s);
+    // Compute value for the current interval with the last power received
+    uint64_t last_metric_time_s = acc->last_ts;
+    double   inc                = acc->last_value * static_cast<double>(now_s - last_metric_time_s);
+    if (inc > 0)
+        acc->value += inc;
+    log_debug("s_consumption: update consumption: %.1f (inc=%.1f) %" PRIu64 "(%s)-%" PRIu64 "(%s) %" PRIu64,
+        acc->value, inc, now_s, getTimeStampStr(now_s).c_str(), last_metric_time_s,
+        getTimeStampStr(last_metric_time_s).c_str(), now_s - last_metric_time_s);
     // Sample was accepted
-    fty_proto_set_value(stat_msg, "%.1f", consumption);
-    fty_proto_aux_insert(stat_msg, AGENT_CM_LASTTS, "%" PRIu64, now_s);
+    acc->last_value = value;
+    acc->last_ts    = now_s;
+    return true;
+}
+
+// compute the consumption missing between last power received and the end of interval
+// \param acc - accumulator
+// \param metric_time_new_s - left margin of the new interval == right margin of the ended one
+static double s_consumption_end(const cmstats_acc_t* acc, uint64_t metric_time_new_s)
+{
+    // Compute time between last measure and end of interval
+    int64_t delta = static_cast<int64_t>(metric_time_new_s - acc->last_ts);
+    // If last measure before the current step, time is equal to the complete interval
+    // (power don't change during the interval period)
+    if (delta > static_cast<int64_t>(acc->step))
+        delta = static_cast<int64_t>(acc->step);
+    else if (delta < 0)
+        delta = 0;
+    return acc->value + acc->last_value * static_cast<double>(delta);
+}
+
+// merge the time weighted mean of the closed interval of the base, weighted by the time it covers
+// \param acc - accumulator of the longer step
+// \param closed - state of the closed interval
+static void s_time_weighted_mean_merge(cmstats_acc_t* acc, const cmstats_acc_t& closed)
+{
+    double covered = acc->extra + closed.extra;
+    if (covered == 0)
+        acc->value = closed.value;
+    else
+        acc->value += (closed.value - acc->value) * closed.extra / covered;
+    acc->extra = covered;
+}
+
+// estimate the percentile of the values of the interval, within the exact extremes of them
+static double s_quantile(const cmstats_acc_t* acc, const cmsketch_t* sketch)
+{
+    if (cmsketch_count(sketch) == 0)
+        return 0;
+    double value = cmsketch_quantile(sketch, s_quantile_of(acc->aggr));
+    return std::min(std::max(value, acc->min), acc->max);
+}
+
+//  Kernels of the types of computation are instantiated per type at compile time, so the update
+//  and the rollover of the accumulator instantiated for the type inline its computation
+
+// update the statistic with the value inside the interval, return false if the value was not accepted
+template <cmstats_aggr_t AGGR>
+static bool s_kernel_put(
+    cmstats_acc_t* acc, cmstats_sketch_t* sketch, double value, uint64_t metric_time_s, uint64_t now_s)
+{
+    if constexpr (AGGR == CMSTATS_AGGR_MIN)
+        return s_min(acc, value);
+    else if constexpr (AGGR == CMSTATS_AGGR_MAX)
+        return s_max(acc, value);
+    else if constexpr (AGGR == CMSTATS_AGGR_ARITHMETIC_MEAN)
+        return s_arithmetic_mean(acc, value);
+    else if constexpr (AGGR == CMSTATS_AGGR_CONSUMPTION)
+        return s_consumption(acc, value, now_s);
+    else if constexpr (s_percentile(AGGR)) {
+        // the percentile is estimated from the sketch when the interval ends
+        s_sketch_add(sketch, value, metric_time_s);
+        return true;
+    } else if constexpr (AGGR == CMSTATS_AGGR_TIME_WEIGHTED_MEAN)
+        return s_time_weighted_mean(acc, value, metric_time_s);
+    else {
+        static_assert(AGGR == CMSTATS_AGGR_VARIANCE || AGGR == CMSTATS_AGGR_STANDARD_DEVIATION);
+        return s_variance(acc, value, AGGR == CMSTATS_AGGR_STANDARD_DEVIATION);
+    }
+}
+
+// merge the closed interval of the base into the statistic of the longer step, first if it is empty yet
+// count and sum are merged by the caller afterwards
+template <cmstats_aggr_t AGGR>
+static void s_kernel_merge(cmstats_acc_t* acc, cmstats_sketch_t* sketch, const cmstats_acc_t& closed,
+    const cmsketch_t* closed_values, bool first)
+{
+    if constexpr (AGGR == CMSTATS_AGGR_MIN)
+        acc->value = (first || closed.value < acc->value) ? closed.value : acc->value;
+    else if constexpr (AGGR == CMSTATS_AGGR_MAX)
+        acc->value = (first || closed.value > acc->value) ? closed.value : acc->value;
+    else if constexpr (AGGR == CMSTATS_AGGR_ARITHMETIC_MEAN)
+        acc->value = (first ? closed.sum : acc->sum + closed.sum) / double(acc->count + closed.count);
+    else if constexpr (AGGR == CMSTATS_AGGR_CONSUMPTION)
+        acc->value += closed.value;
+    else if constexpr (s_percentile(AGGR))
+        s_sketch_merge(sketch, closed_values, closed.interval_start);
+    else if constexpr (AGGR == CMSTATS_AGGR_TIME_WEIGHTED_MEAN)
+        s_time_weighted_mean_merge(acc, closed);
+    else
+        s_variance_merge(acc, closed, AGGR == CMSTATS_AGGR_STANDARD_DEVIATION);
+}
+
+// complete the value of the statistic at the end of its interval (or at end_s for the current value)
+// consumption is completed by its own branch of the rollover
+template <cmstats_aggr_t AGGR>
+static void s_kernel_end(cmstats_acc_t* acc, const cmsketch_t* values, uint64_t end_s)
+{
+    if constexpr (s_percentile(AGGR))
+        acc->value = s_quantile(acc, values);
+    else if constexpr (AGGR == CMSTATS_AGGR_TIME_WEIGHTED_MEAN)
+        s_hold(acc, end_s);
+}
+
+template <cmstats_aggr_t AGGR>
+static fty_proto_t* s_acc_put(cmstats_series_t& series, const cmstats_column_t& column, cmstats_acc_t* acc,
+    double value, uint64_t new_metric_time_s, uint64_t now_ms, cmstats_acc_t* closed);
+
+template <cmstats_aggr_t AGGR>
+static bool s_acc_poll(cmstats_series_t& series, const cmstats_column_t& column, cmstats_acc_t* acc,
+    uint64_t now_ms, zlist_t* published, cmstats_acc_t* closed);
+
+// type of computation - its name and its kernels, the type is resolved to its entry once, when
+// the column is registered, so only one indirect call per accumulator is left in the hot paths
+// all supported types are registered in s_aggrs, in the order of cmstats_aggr_t
+struct cmstats_aggr_def_t
+{
+    cmstats_aggr_t aggr; // type of computation
+    const char*    name; // name of the type in TYPES, rules and published metrics
+    // merge the closed interval of the base into the statistic of the longer step
+    void (*merge)(cmstats_acc_t* acc, cmstats_sketch_t* sketch, const cmstats_acc_t& closed,
+        const cmsketch_t* closed_values, bool first);
+    // complete the value of the statistic at end_s, percentile from the values
+    void (*end)(cmstats_acc_t* acc, const cmsketch_t* values, uint64_t end_s);
+    // update the accumulator with the value, see s_acc_put
+    fty_proto_t* (*acc_put)(cmstats_series_t& series, const cmstats_column_t& column, cmstats_acc_t* acc,
+        double value, uint64_t new_metric_time_s, uint64_t now_ms, cmstats_acc_t* closed);
+    // publish the accumulator if its interval has ended, see s_acc_poll
+    bool (*acc_poll)(cmstats_series_t& series, const cmstats_column_t& column, cmstats_acc_t* acc, uint64_t now_ms,
+        zlist_t* published, cmstats_acc_t* closed);
+};
+
+// entry of the type with the kernels instantiated for it
+template <cmstats_aggr_t AGGR>
+static constexpr cmstats_aggr_def_t s_def(const char* name)
+{
+    return {AGGR, name, s_kernel_merge<AGGR>, s_kernel_end<AGGR>, s_acc_put<AGGR>, s_acc_poll<AGGR>};
+}
+
+static const cmstats_aggr_def_t s_aggrs[] = {
+    {CMSTATS_AGGR_UNKNOWN, "unknown", nullptr, nullptr, nullptr, nullptr},
+    s_def<CMSTATS_AGGR_MIN>("min"),
+    s_def<CMSTATS_AGGR_MAX>("max"),
+    s_def<CMSTATS_AGGR_ARITHMETIC_MEAN>("arithmetic_mean"),
+    s_def<CMSTATS_AGGR_CONSUMPTION>("consumption"),
+    s_def<CMSTATS_AGGR_P50>("p50"),
+    s_def<CMSTATS_AGGR_P95>("p95"),
+    s_def<CMSTATS_AGGR_P99>("p99"),
+    // the value is weighted by the time it was held, the time covered by the values is in extra
+    s_def<CMSTATS_AGGR_TIME_WEIGHTED_MEAN>("time_weighted_mean"),
+    // sum of squared deviations from the mean is in extra
+    s_def<CMSTATS_AGGR_VARIANCE>("variance"),
+    s_def<CMSTATS_AGGR_STANDARD_DEVIATION>("standard_deviation"),
+};
+
+// definition of the type of computation, the one of CMSTATS_AGGR_UNKNOWN for unsupported types
+static const cmstats_aggr_def_t& s_aggr(cmstats_aggr_t aggr)
+{
+    size_t i = size_t(aggr) < std::size(s_aggrs) ? size_t(aggr) : 0;
+    assert(s_aggrs[i].aggr == cmstats_aggr_t(i));
+    return s_aggrs[i];
+}
+
+// find the base of every column - the shortest step of the same type which divides the step
+// the base is never rolled up itself, as its divisor would divide the longer step too
+static void s_rollups(cmstats_t* self)
+{
+    for (cmstats_column_t& column : self->columns) {
+        column.base = -1;
+        column.rollups.clear();
+    }
+    for (size_t i = 0; i < self->columns.size(); i++) {
+        cmstats_column_t& column = self->columns[i];
+        for (size_t j = 0; j < self->columns.size(); j++) {
+            const cmstats_column_t& base = self->columns[j];
+            if (base.aggr != column.aggr || base.step >= column.step || column.step % base.step != 0)
+                continue;
+            if (column.base == -1 || base.step < self->columns[size_t(column.base)].step)
+                column.base = int32_t(j);
+        }
+        if (column.base != -1)
+            self->columns[size_t(column.base)].rollups.push_back(uint32_t(i));
+    }
+}
+
+// true if the statistic of series in column is rolled up from its base
+static bool s_rolled_up(const cmstats_t* self, const cmstats_series_t& series, size_t column)
+{
+    int32_t base = self->columns[column].base;
+    return base != -1 && s_stat(series, size_t(base)) != nullptr;
+}
+
+// attach the percentiles of the series to the sketches of their steps, the percentiles of one step
+// share one sketch, unless only some of them are rolled up from their base
+// pointers to the sketches of the series are not valid after the attachment
+static void s_sketch_attach(const cmstats_t* self, cmstats_series_t& series)
+{
+    for (size_t c = 0; c < series.slots.size(); c++) {
+        cmstats_stat_t* stat = s_stat(series, c);
+        if (!stat || !s_percentile(self->columns[c].aggr))
+            continue;
+        uint32_t step   = self->columns[c].step;
+        bool     rolled = s_rolled_up(self, series, c);
+        if (stat->sketch != 0 && series.sketches[stat->sketch - 1].step == step &&
+            series.sketches[stat->sketch - 1].rolled == rolled)
+            continue;
+        size_t i = 0;
+        while (i < series.sketches.size() && (series.sketches[i].step != step || series.sketches[i].rolled != rolled))
+            i++;
+        if (i == series.sketches.size()) {
+            assert(series.sketches.size() < UINT16_MAX);
+            // the percentile which has just started to be rolled up keeps the values received so far
+            if (stat->sketch != 0)
+                series.sketches.push_back(series.sketches[stat->sketch - 1]);
+            else
+                series.sketches.push_back({step, rolled, 0, UINT64_MAX, UINT64_MAX, {}, {}});
+            series.sketches.back().step   = step;
+            series.sketches.back().rolled = rolled;
+        }
+        stat->sketch = uint16_t(i + 1);
+    }
+}
+
+// merge the closed interval of the base statistic into the statistic of the longer step, apart from
+// its count and sum, return false if there is nothing to merge
+// count and sum of all the closed intervals of the rollup are merged at once afterwards, see cmsweep_merge
+// \param acc - accumulator of the longer step
+// \param sketch - sketch of the longer step, NULL if not a percentile
+// \param closed - state of the closed interval, value is the final one
+// \param closed_values - sketch of the values of the closed interval, NULL if not a percentile
+static bool s_merge(
+    cmstats_acc_t* acc, cmstats_sketch_t* sketch, const cmstats_acc_t& closed, const cmsketch_t* closed_values)
+{
+    // consumption goes on with the last power even if no power was received in the interval,
+    // so does the time weighted mean with the last value (covered time in extra)
+    if (closed.count == 0 && closed.extra == 0 && (acc->aggr != CMSTATS_AGGR_CONSUMPTION || closed.last_ts == 0))
+        return false;
+
+    bool first = (acc->count == 0);
+    s_aggr(acc->aggr).merge(acc, sketch, closed, closed_values, first);
+
+    if (closed.count != 0) {
+        acc->min = (first || closed.min < acc->min) ? closed.min : acc->min;
+        acc->max = (first || closed.max > acc->max) ? closed.max : acc->max;
+    }
+    acc->last_value = closed.last_value;
+    acc->last_ts    = std::max(acc->last_ts, closed.last_ts);
+    return true;
+}
+
+// publish the rolled up statistic whose interval has ended, the caller starts its next interval
+static void s_rollup_end(
+    cmstats_series_t& series, const cmstats_column_t& column, cmstats_acc_t* acc, zlist_t* published)
+{
+    cmstats_sketch_t* sketch = s_sketch(series, acc->sketch);
+    if (sketch)
+        acc->value = s_quantile(acc, s_sketch_end(sketch, acc->interval_start));
+    if (acc->count != 0)
+        zlist_append(published, s_encode(series, column, acc, acc->value));
+}
+
+// restart the statistics of column at self->merged, all of them ended together, the next interval of
+// them starts at interval_start
+// the rest of the restarted state (extra) is scattered by the caller
+static void s_restart_merged(cmstats_t* self, cmstats_column_t& column, uint64_t interval_start)
+{
+    size_t n = self->merged.size();
+    cmsweep_restart(column.value.data(), column.sum.data(), column.count.data(), column.interval_start.data(),
+        column.ends.data(), n == column.members.size() ? nullptr : self->merged.data(), n, interval_start,
+        interval_start + column.step);
+}
+
+// roll the closed intervals of the statistics of series_ids in base column up to the statistics of the
+// longer steps, those which have ended with them are published
+// each closed interval is merged by its type of computation, then the counts and sums of all of them are
+// merged at once and the statistics which have ended are restarted at once, by the kernels of cmsweep
+// the values of the closed interval of percentile are in the closed sketch of the base
+static void s_rollup(cmstats_t* self, uint32_t base, const uint32_t* series_ids, const cmstats_acc_t* closed,
+    size_t n, uint64_t now_ms, zlist_t* published)
+{
+    uint64_t now_s = now_ms / 1000;
+    for (uint32_t column_id : self->columns[base].rollups) {
+        cmstats_column_t& column = self->columns[column_id];
+        self->merged.clear();
+        self->merge_sum.clear();
+        self->merge_count.clear();
+        for (size_t k = 0; k < n; k++) {
+            cmstats_series_t& series = self->series[series_ids[k]];
+            cmstats_stat_t*   stat   = s_stat(series, column_id);
+            if (!stat || stat->step == 0)
+                continue;
+            cmstats_acc_t acc;
+            s_gather(column, stat, &acc);
+            // the longer interval has ended before the closed one, but it was not polled yet
+            if (closed[k].interval_start >= acc.interval_start + acc.step) {
+                s_rollup_end(series, column, &acc, published);
+                s_restart(&acc, closed[k].interval_start - closed[k].interval_start % acc.step);
+            }
+            if (closed[k].interval_start >= acc.interval_start) {
+                const cmstats_sketch_t* base_sketch = s_sketch(series, s_stat(series, base)->sketch);
+                const cmsketch_t*       values      = base_sketch ? &base_sketch->closed : nullptr;
+                if (s_merge(&acc, s_sketch(series, acc.sketch), closed[k], values) && closed[k].count != 0) {
+                    self->merged.push_back(stat->member);
+                    self->merge_sum.push_back(closed[k].sum);
+                    self->merge_count.push_back(closed[k].count);
+                }
+            }
+            s_scatter(column, stat, acc);
+        }
+        cmsweep_merge(column.sum.data(), column.count.data(), self->merged.data(), self->merge_sum.data(),
+            self->merge_count.data(), self->merged.size());
+
+        self->merged.clear();
+        for (size_t k = 0; k < n; k++) {
+            cmstats_series_t& series = self->series[series_ids[k]];
+            cmstats_stat_t*   stat   = s_stat(series, column_id);
+            if (!stat || stat->step == 0 || now_s < column.ends[stat->member])
+                continue;
+            cmstats_acc_t acc;
+            s_gather(column, stat, &acc);
+            s_rollup_end(series, column, &acc, published);
+            acc.extra = 0;
+            s_scatter(column, stat, acc);
+            self->merged.push_back(stat->member);
+        }
+        s_restart_merged(self, column, now_s - now_s % column.step);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Convert the name of computation (min, max, ...) to its type
+
+cmstats_aggr_t cmstats_aggr_from_str(const char* aggr_fun)
+{
+    if (!aggr_fun)
+        return CMSTATS_AGGR_UNKNOWN;
+    for (const cmstats_aggr_def_t& def : s_aggrs) {
+        if (def.aggr != CMSTATS_AGGR_UNKNOWN && streq(aggr_fun, def.name))
+            return def.aggr;
+    }
+    return CMSTATS_AGGR_UNKNOWN;
+}
+
+//  --------------------------------------------------------------------------
+//  Convert the type of computation to its name
+
+const char* cmstats_aggr_str(cmstats_aggr_t aggr)
+{
+    return s_aggr(aggr).name;
+}
+
+//  --------------------------------------------------------------------------
+//  Parse the value of the metric
+
+bool cmstats_parse_value(const char* str, double* value_p)
+{
+    assert(value_p);
+    if (!str)
+        return false;
+
+    // leading spaces and plus sign were accepted by atof, the rest of the string is ignored as well
+    while (isspace(static_cast<unsigned char>(*str)))
+        str++;
+    if (*str == '+')
+        str++;
+
+    double value;
+#if defined(__cpp_lib_to_chars)
+    std::from_chars_result r = std::from_chars(str, str + strlen(str), value);
+    if (r.ec != std::errc() || r.ptr == str)
+        return false;
+#else
+    // decimal point of the C locale, whatever locale the process uses
+    static locale_t c_locale = newlocale(LC_ALL_MASK, "C", locale_t(0));
+    char*           end      = nullptr;
+    value                    = strtod_l(str, &end, c_locale);
+    if (end == str)
+        return false;
+#endif
+    if (std::isnan(value))
+        return false;
+    *value_p = value;
     return true;
 }
 
@@ -166,14 +827,8 @@ static bool s_consumption(const fty_proto_t* bmsg, fty_proto_t* stat_msg)
 
 cmstats_t* cmstats_new(void)
 {
-    cmstats_t* self = reinterpret_cast<cmstats_t*>(zmalloc(sizeof(cmstats_t)));
+    cmstats_t* self = new cmstats_t();
     assert(self);
-    //  Initialize class properties here
-    self->stats = zhashx_new();
-    assert(self->stats);
-    zhashx_set_destructor(self->stats, s_destructor);
-    zhashx_set_duplicator(self->stats, s_duplicator);
-
     return self;
 }
 
@@ -186,10 +841,8 @@ void cmstats_destroy(cmstats_t** self_p)
     assert(self_p);
     if (*self_p) {
         cmstats_t* self = *self_p;
-        //  Free class properties here
-        zhashx_destroy(&self->stats);
         //  Free object itself
-        free(self);
+        delete self;
         *self_p = nullptr;
     }
 }
@@ -200,10 +853,79 @@ void cmstats_destroy(cmstats_t** self_p)
 void cmstats_print(cmstats_t* self)
 {
     assert(self);
-    for (void* it = zhashx_first(self->stats); it != nullptr; it = zhashx_next(self->stats)) {
-        log_debug("%s =>", reinterpret_cast<const char*>(const_cast<void*>(zhashx_cursor(self->stats))));
-        fty_proto_print(reinterpret_cast<fty_proto_t*>(it));
+    for (const cmstats_series_t& series : self->series) {
+        if (!series.used)
+            continue;
+        for (size_t i = 0; i < series.slots.size(); i++) {
+            const cmstats_stat_t* stat = s_stat(series, i);
+            if (!stat || stat->step == 0)
+                continue;
+            cmstats_acc_t acc;
+            s_gather(self->columns[i], stat, &acc);
+            log_debug("%s_%s_%s@%s => value=%f, sum=%f, min=%f, max=%f, count=%" PRIu64 ", last_ts=%" PRIu64
+                      ", interval_start=%" PRIu64 ", step=%" PRIu32,
+                series.quantity.c_str(), cmstats_aggr_str(acc.aggr), self->columns[i].sstep.c_str(),
+                series.asset.c_str(), acc.value, acc.sum, acc.min, acc.max, acc.count, acc.last_ts, acc.interval_start,
+                acc.step);
+        }
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Register the column (type of computation, step) and return its index
+
+int cmstats_column(cmstats_t* self, const char* aggr_fun, const char* sstep, uint32_t step)
+{
+    assert(self);
+    assert(sstep);
+
+    cmstats_aggr_t aggr = cmstats_aggr_from_str(aggr_fun);
+    if (aggr == CMSTATS_AGGR_UNKNOWN || step == 0)
+        return -1;
+
+    for (size_t i = 0; i < self->columns.size(); i++) {
+        const cmstats_column_t& column = self->columns[i];
+        if (column.aggr == aggr && column.step == step && column.sstep == sstep)
+            return int(i);
     }
+    cmstats_column_t column;
+    column.aggr     = aggr;
+    column.step     = step;
+    column.sstep    = sstep;
+    column.deadline = 0;
+    column.base     = -1;
+    self->columns.push_back(column);
+    s_rollups(self);
+    return int(self->columns.size() - 1);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the id of the series for (quantity, asset), create the series if it does not exist
+
+uint32_t cmstats_series(cmstats_t* self, const char* quantity, const char* asset)
+{
+    assert(self);
+
+    s_key(self->key, quantity, asset);
+    auto it = self->index.find(self->key);
+    if (it != self->index.end())
+        return it->second;
+
+    uint32_t id;
+    if (!self->free_series.empty()) {
+        id = self->free_series.back();
+        self->free_series.pop_back();
+    } else {
+        id = uint32_t(self->series.size());
+        self->series.emplace_back();
+    }
+    cmstats_series_t& series = self->series[id];
+    series.used              = true;
+    series.quantity.assign(quantity ? quantity : "");
+    series.asset.assign(asset ? asset : "");
+    self->index.emplace(self->key, id);
+    self->assets[series.asset].push_back(id);
+    return id;
 }
 
 //  --------------------------------------------------------------------------
@@ -215,7 +937,34 @@ fty_proto_t* cmstats_put(cmstats_t* self, const char* addr_fun, const char* sste
     assert(addr_fun);
     assert(bmsg);
 
-    uint64_t now_ms = uint64_t(zclock_time());
+    int column = cmstats_column(self, addr_fun, sstep, step);
+    if (column == -1) {
+        log_warning("cmstats_put:\tunsupported type '%s' or step %" PRIu32 ", ignoring", addr_fun, step);
+        return nullptr;
+    }
+
+    uint32_t series = cmstats_series(self, fty_proto_type(bmsg), fty_proto_name(bmsg));
+    return cmstats_series_put(self, series, uint32_t(column), bmsg);
+}
+
+// update the accumulator of the statistic with the new value
+// \param series - series of the statistic
+// \param column - column of the statistic
+// \param acc - accumulator of the statistic
+// \param value - input new value
+// \param new_metric_time_s - timestamp of the input new value
+// \param now_ms - current time
+// \param closed - state of the interval which has just ended, with its final value
+// \return the message for the interval which has just ended or NULL
+template <cmstats_aggr_t AGGR>
+static fty_proto_t* s_acc_put(cmstats_series_t& series, const cmstats_column_t& column, cmstats_acc_t* acc,
+    double value, uint64_t new_metric_time_s, uint64_t now_ms, cmstats_acc_t* closed)
+{
+    assert(column.aggr == AGGR);
+    cmstats_sketch_t* sketch = s_sketch(series, acc->sketch);
+    uint32_t          step   = column.step;
+    uint64_t          now_s  = now_ms / 1000;
+    fty_proto_t*      ret    = nullptr;
     // round the now to earliest time start
     // ie for 12:16:29 / step 15*60 return 12:15:00
     //    for 12:16:29 / step 60*60 return 12:00:00
@@ -223,130 +972,261 @@ fty_proto_t* cmstats_put(cmstats_t* self, const char* addr_fun, const char* sste
     // works well for any value of step
     uint64_t metric_time_new_s = (now_ms - (now_ms % (step * 1000))) / 1000;
 
-    char* key;
-    int   r = asprintf(&key, "%s_%s_%s@%s", fty_proto_type(bmsg), addr_fun, sstep, fty_proto_name(bmsg));
-    assert(r != -1); // make gcc @ rhel happy
-    std::string skey(key);
-    zstr_free(&key);
-
-    fty_proto_t* stat_msg = reinterpret_cast<fty_proto_t*>(zhashx_lookup(self->stats, skey.c_str()));
-
     // handle the first insert
-    if (!stat_msg) {
-        stat_msg = fty_proto_dup(bmsg);
-        fty_proto_set_type(stat_msg, "%s_%s_%s", fty_proto_type(bmsg), addr_fun, sstep);
-        fty_proto_set_time(stat_msg, metric_time_new_s);
-        fty_proto_aux_insert(stat_msg, AGENT_CM_COUNT, "1");
-        fty_proto_aux_insert(
-            stat_msg, AGENT_CM_SUM, "%s", fty_proto_value(stat_msg)); // insert value as string into string
-        fty_proto_aux_insert(stat_msg, AGENT_CM_TYPE, "%s", addr_fun);
-        fty_proto_aux_insert(stat_msg, AGENT_CM_STEP, "%" PRIu32, step);
-        fty_proto_aux_insert(stat_msg, AGENT_CM_LASTTS, "%" PRIu64, fty_proto_time(bmsg));
-        fty_proto_set_ttl(stat_msg, 2 * step);
+    if (acc->step == 0) {
+        acc->aggr           = AGGR;
+        acc->step           = step;
+        acc->interval_start = metric_time_new_s;
 
         // Power consumption treatment
-        if (streq(addr_fun, "consumption")) {
-            double consumption = 0.0;
-            fty_proto_set_value(stat_msg, "%.1f", consumption);
-            fty_proto_aux_insert(stat_msg, AGENT_CM_LASTTS, "%" PRIu64, now_ms/1000);
-            fty_proto_set_unit(stat_msg, "Ws");
-            log_debug("cmstats_put: Add new %s - %" PRIu64 "(%s)", skey.c_str(), now_ms/1000,
-                getTimeStampStr(now_ms/1000).c_str());
+        if constexpr (AGGR == CMSTATS_AGGR_CONSUMPTION) {
+            s_start(acc, value, new_metric_time_s);
+            acc->value   = 0.0;
+            acc->last_ts = now_s;
+            log_debug("cmstats_put: Add new %s_%s_%s@%s - %" PRIu64 "(%s)", series.quantity.c_str(),
+                cmstats_aggr_str(AGGR), column.sstep.c_str(), series.asset.c_str(), now_s,
+                getTimeStampStr(now_s).c_str());
+            return nullptr;
+        } else {
+            // the other types compute the first value as any other one of the interval
+            s_restart(acc, metric_time_new_s);
         }
-
-        zhashx_insert(self->stats, skey.c_str(), stat_msg);
-        fty_proto_destroy(&stat_msg);
-        return nullptr;
     }
 
     // there is already some value
     // so check if it's not already older than we need
-    uint64_t metric_time_s      = fty_proto_time(stat_msg);
-    uint64_t new_metric_time_s  = fty_proto_time(bmsg);
-    uint64_t last_metric_time_s = fty_proto_aux_number(stat_msg, AGENT_CM_LASTTS, 0);
-    if (new_metric_time_s <= last_metric_time_s) {
-        //log_debug("cmstats_put: Message date too earlier for %s: %" PRIu64 "(%s)", skey.c_str(),
-        //    last_metric_time_s, getTimeStampStr(last_metric_time_s).c_str());
+    if (new_metric_time_s <= acc->last_ts) {
         return nullptr;
     }
     // it is, return the stat value and "restart" the computation
-    if (((now_ms - (metric_time_s * 1000)) >= (step * 1000))) {
-        // duplicate "old" value for the interval, that has just ended
-        fty_proto_t* ret = fty_proto_dup(stat_msg);
-
-        // update statistics: restart it, as from now on we are going
-        // to compute the statistics for the next interval
-        fty_proto_set_time(stat_msg, metric_time_new_s);
-        fty_proto_aux_insert(stat_msg, AGENT_CM_COUNT, "1");
-
+    if ((now_ms - (acc->interval_start * 1000)) >= (step * 1000)) {
         // If it is NOT power consumption data
-        if (!streq(addr_fun, "consumption")) {
-            fty_proto_aux_insert(stat_msg, AGENT_CM_SUM, "%s", fty_proto_value(bmsg));
-            fty_proto_aux_insert(stat_msg, AGENT_CM_LASTTS, "%" PRIu64, new_metric_time_s);
+        if constexpr (AGGR != CMSTATS_AGGR_CONSUMPTION) {
+            // "old" value for the interval, that has just ended
+            s_kernel_end<AGGR>(
+                acc, sketch ? s_sketch_end(sketch, acc->interval_start) : nullptr, acc->interval_start + step);
+            ret     = s_encode(series, column, acc, acc->value);
+            *closed = *acc;
+            // update statistics: restart it, as from now on we are going
+            // to compute the statistics for the next interval, the value is the first one of it
+            s_restart(acc, metric_time_new_s);
         }
         // Else it is power consumption data
         else {
             // If at least one measure of power available
-            if (last_metric_time_s != 0) {
-                // Compute time between last measure and end of interval
-                int64_t delta = static_cast<int64_t>(metric_time_new_s - last_metric_time_s);
-                // If last measure before the current step, time is equal to the complete interval
-                // (power don't change during the interval period)
-                if (delta > static_cast<int64_t>(step)) delta = static_cast<int64_t>(step);
-                else if (delta < 0) delta = 0;
-                // Get last power received which is saved in the sum aux dictionary
-                double last_metric_value = atof(fty_proto_aux_string(stat_msg, AGENT_CM_SUM, ""));
-                // Save new value in the sum aux dictionary
-                fty_proto_aux_insert(stat_msg, AGENT_CM_SUM, "%s", fty_proto_value(bmsg));
+            if (acc->last_ts != 0) {
                 // Compute last value missing for the returned interval
-                double consumption = atof(fty_proto_value(stat_msg));
-                double inc = last_metric_value * static_cast<double>(delta);
-                log_debug("cmstats_put: End consumption for %s: inc=%.1f %" PRIu64 "(%s)-%" PRIu64 "(%s) %" PRIu64, skey.c_str(), inc,
-                    metric_time_new_s, getTimeStampStr(metric_time_new_s).c_str(), last_metric_time_s, getTimeStampStr(last_metric_time_s).c_str(),
-                    metric_time_new_s - last_metric_time_s);
-                consumption += inc;
-                fty_proto_set_value(ret, "%.1f", consumption);
+                double consumption = s_consumption_end(acc, metric_time_new_s);
+                log_debug("cmstats_put: End consumption for %s@%s: %.1f %" PRIu64 "(%s)-%" PRIu64 "(%s) %" PRIu64,
+                    series.quantity.c_str(), series.asset.c_str(), consumption, metric_time_new_s,
+                    getTimeStampStr(metric_time_new_s).c_str(), acc->last_ts, getTimeStampStr(acc->last_ts).c_str(),
+                    metric_time_new_s - acc->last_ts);
+                ret           = s_encode(series, column, acc, consumption);
+                *closed       = *acc;
+                closed->value = consumption;
 
                 // and compute the first value for the new interval
-                double value = atof(fty_proto_value(bmsg));
-                consumption = value * static_cast<double>(now_ms/1000 - metric_time_new_s);
-                if (consumption < 0) consumption = 0;
-                fty_proto_set_value(stat_msg, "%.1f", consumption);
-                fty_proto_aux_insert(stat_msg, AGENT_CM_LASTTS, "%" PRIu64, now_ms/1000);
-                fty_proto_aux_insert(stat_msg, AGENT_CM_COUNT, "1");
-                log_debug("cmstats_put: Update new consumption for %s: %.1f %" PRIu64 "(%s)-%" PRIu64 "(%s) %" PRIu64, skey.c_str(), consumption,
-                    now_ms/1000, getTimeStampStr(now_ms/1000).c_str(), metric_time_new_s, getTimeStampStr(metric_time_new_s).c_str(),
-                    now_ms/1000 - metric_time_new_s);
-
+                consumption = value * static_cast<double>(now_s - metric_time_new_s);
+                if (consumption < 0)
+                    consumption = 0;
+                acc->value      = consumption;
+                acc->last_value = value;
+                acc->last_ts    = now_s;
+                log_debug("cmstats_put: Update new consumption for %s@%s: %.1f %" PRIu64 "(%s)-%" PRIu64
+                          "(%s) %" PRIu64,
+                    series.quantity.c_str(), series.asset.c_str(), consumption, now_s, getTimeStampStr(now_s).c_str(),
+                    metric_time_new_s, getTimeStampStr(metric_time_new_s).c_str(), now_s - metric_time_new_s);
+            } else {
+                ret     = s_encode(series, column, acc, acc->value);
+                *closed = *acc;
             }
+            acc->count          = 1;
+            acc->interval_start = metric_time_new_s;
+            return ret;
         }
-        return ret;
     }
 
-    bool value_accepted = false;
     // if we're inside the interval, simply do the computation
-    if (streq(addr_fun, "min"))
-        value_accepted = s_min(bmsg, stat_msg);
-    else if (streq(addr_fun, "max"))
-        value_accepted = s_max(bmsg, stat_msg);
-    else if (streq(addr_fun, "arithmetic_mean"))
-        value_accepted = s_arithmetic_mean(bmsg, stat_msg);
-    else if (streq(addr_fun, "consumption")) {
-        log_debug("cmstats_put: Update consumption for %s", skey.c_str());
-        value_accepted = s_consumption(bmsg, stat_msg);
-    }
-    // fail otherwise
-    else
-        assert(false);
+    if constexpr (AGGR == CMSTATS_AGGR_CONSUMPTION)
+        log_debug("cmstats_put: Update consumption for %s@%s", series.quantity.c_str(), series.asset.c_str());
+    bool value_accepted = s_kernel_put<AGGR>(acc, sketch, value, new_metric_time_s, now_s);
 
     // increase the counter
     if (value_accepted) {
-        fty_proto_aux_insert(stat_msg, AGENT_CM_COUNT, "%" PRIu64, fty_proto_aux_number(stat_msg, AGENT_CM_COUNT, 0) + 1);
-        if (!streq(addr_fun, "consumption")) {
-            fty_proto_aux_insert(stat_msg, AGENT_CM_LASTTS, "%" PRIu64, new_metric_time_s);
+        bool first = (acc->count == 0);
+        acc->min   = (first || value < acc->min) ? value : acc->min;
+        acc->max   = (first || value > acc->max) ? value : acc->max;
+        // arithmetic_mean computes the sum on its own
+        if constexpr (AGGR != CMSTATS_AGGR_ARITHMETIC_MEAN)
+            acc->sum = first ? value : acc->sum + value;
+        acc->count++;
+        if constexpr (AGGR != CMSTATS_AGGR_CONSUMPTION) {
+            acc->last_value = value;
+            acc->last_ts    = new_metric_time_s;
+        }
+    }
+    return ret;
+}
+
+//  --------------------------------------------------------------------------
+//  Update the statistic in column of series for the incomming message "bmsg"
+
+fty_proto_t* cmstats_series_put(cmstats_t* self, uint32_t series, uint32_t column, fty_proto_t* bmsg)
+{
+    assert(self);
+    assert(bmsg);
+
+    double value;
+    if (!cmstats_parse_value(fty_proto_value(bmsg), &value)) {
+        log_warning("cmstats_series_put:\tinvalid value (%s), ignoring",
+            fty_proto_value(bmsg) ? fty_proto_value(bmsg) : "null");
+        return nullptr;
+    }
+
+    zlist_t* published = zlist_new();
+    cmstats_series_update(self, series, &column, 1, value, fty_proto_time(bmsg), fty_proto_unit(bmsg), published);
+    fty_proto_t* ret = reinterpret_cast<fty_proto_t*>(zlist_pop(published));
+    zlist_destroy(&published);
+    return ret;
+}
+
+//  --------------------------------------------------------------------------
+//  Update the statistics in all given columns of series with the new value
+
+size_t cmstats_series_update(cmstats_t* self, uint32_t series_id, const uint32_t* columns, size_t ncolumns,
+    double value, uint64_t metric_time_s, const char* unit, zlist_t* published)
+{
+    assert(self);
+    assert(columns || ncolumns == 0);
+    assert(published);
+    assert(series_id < self->series.size());
+
+    cmstats_series_t& series = self->series[series_id];
+    if (series.unit.empty() && unit)
+        series.unit.assign(unit);
+    // statistics exist only for the columns the series is computed in,
+    // all of them are allocated before the first one is used
+    size_t nstats = series.stats.size();
+    for (size_t i = 0; i < ncolumns; i++) {
+        assert(columns[i] < self->columns.size());
+        s_stat_alloc(self, series_id, columns[i]);
+    }
+    if (series.stats.size() != nstats)
+        s_sketch_attach(self, series);
+
+    s_touch(self, series_id);
+
+    uint64_t now_ms = uint64_t(zclock_time());
+    size_t   size   = zlist_size(published);
+    for (size_t i = 0; i < ncolumns; i++) {
+        cmstats_column_t& column = self->columns[columns[i]];
+        cmstats_stat_t*   stat   = s_stat(series, columns[i]);
+        cmstats_acc_t     acc;
+        s_gather(column, stat, &acc);
+        bool fresh = (acc.step == 0);
+        // rolled up statistic only starts its first interval, it is updated when the base interval ends
+        if (s_rolled_up(self, series, columns[i])) {
+            if (fresh) {
+                uint64_t now_s     = now_ms / 1000;
+                acc.aggr           = column.aggr;
+                acc.step           = column.step;
+                acc.interval_start = now_s - now_s % column.step;
+                s_scatter(column, stat, acc);
+                s_reschedule(self, columns[i], &acc);
+            }
+            continue;
         }
+
+        uint64_t      interval_start = acc.interval_start;
+        cmstats_acc_t closed;
+        fty_proto_t*  ret = s_aggr(column.aggr).acc_put(series, column, &acc, value, metric_time_s, now_ms, &closed);
+        s_scatter(column, stat, acc);
+        if (fresh)
+            s_reschedule(self, columns[i], &acc);
+        if (ret)
+            zlist_append(published, ret);
+        if (!fresh && acc.interval_start != interval_start && !column.rollups.empty())
+            s_rollup(self, columns[i], &series_id, &closed, 1, now_ms, published);
     }
-    return nullptr;
+    return zlist_size(published) - size;
+}
+
+//  --------------------------------------------------------------------------
+//  Copy the accumulator of the statistic to acc, return false if there is no such statistic
+
+bool cmstats_lookup(cmstats_t* self, const char* quantity, const char* aggr_fun, const char* sstep,
+    const char* asset, cmstats_acc_t* acc)
+{
+    assert(self);
+    assert(sstep);
+
+    cmstats_aggr_t aggr = cmstats_aggr_from_str(aggr_fun);
+
+    s_key(self->key, quantity, asset);
+    auto it = self->index.find(self->key);
+    if (it == self->index.end())
+        return false;
+
+    cmstats_series_t& series = self->series[it->second];
+    for (size_t i = 0; i < series.slots.size(); i++) {
+        const cmstats_column_t& column = self->columns[i];
+        const cmstats_stat_t*   found  = s_stat(series, i);
+        if (found && found->step != 0 && column.aggr == aggr && column.sstep == sstep) {
+            if (acc) {
+                s_gather(column, found, acc);
+                // value of the statistic computed from the values received so far
+                const cmstats_sketch_t* sketch = s_sketch(series, found->sketch);
+                s_aggr(found->aggr).end(acc, sketch ? &sketch->values : nullptr, uint64_t(zclock_time()) / 1000);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+//  --------------------------------------------------------------------------
+//  Copy the series with id from src to self, together with all its statistics
+
+uint32_t cmstats_copy_series(cmstats_t* self, const cmstats_t* src, uint32_t id)
+{
+    assert(self);
+    assert(src);
+    assert(id < src->series.size());
+
+    const cmstats_series_t& from      = src->series[id];
+    uint32_t                series_id = cmstats_series(self, from.quantity.c_str(), from.asset.c_str());
+    self->series[series_id].unit      = from.unit;
+    for (size_t c = 0; c < from.slots.size(); c++) {
+        const cmstats_stat_t* from_stat = s_stat(from, c);
+        if (!from_stat || from_stat->step == 0)
+            continue;
+        const cmstats_column_t& column = src->columns[c];
+        int col = cmstats_column(self, cmstats_aggr_str(column.aggr), column.sstep.c_str(), column.step);
+        assert(col != -1);
+
+        cmstats_acc_t acc;
+        s_gather(column, from_stat, &acc);
+        s_scatter(self->columns[size_t(col)], s_stat_alloc(self, series_id, size_t(col)), acc);
+        s_reschedule(self, uint32_t(col), &acc);
+    }
+
+    // sketches are copied once all the percentiles are attached to them
+    cmstats_series_t& series = self->series[series_id];
+    s_sketch_attach(self, series);
+    for (size_t c = 0; c < from.slots.size(); c++) {
+        const cmstats_stat_t* from_stat = s_stat(from, c);
+        if (!from_stat || from_stat->step == 0 || from_stat->sketch == 0)
+            continue;
+        const cmstats_column_t& column = src->columns[c];
+        int col = cmstats_column(self, cmstats_aggr_str(column.aggr), column.sstep.c_str(), column.step);
+        cmstats_sketch_t* sketch = s_sketch(series, s_stat(series, size_t(col))->sketch);
+        if (sketch) {
+            bool rolled    = sketch->rolled;
+            *sketch        = from.sketches[from_stat->sketch - 1];
+            sketch->rolled = rolled;
+        }
+    }
+    return series_id;
 }
 
 //  --------------------------------------------------------------------------
@@ -357,108 +1237,768 @@ void cmstats_delete_asset(cmstats_t* self, const char* asset_name)
     assert(self);
     assert(asset_name);
 
-    zlist_t* keys = zlist_new();
-    // no autofree here, this list constains only _references_ to keys,
-    // which are owned and cleanded up by self->stats on zhashx_delete
+    auto it = self->assets.find(asset_name);
+    if (it == self->assets.end())
+        return;
+    self->deleted.push_back(it->first);
+
+    for (uint32_t id : it->second)
+        s_series_delete(self, id);
+    self->assets.erase(it);
+}
+
+//  --------------------------------------------------------------------------
+//  Remove from stats all entries related to all assets from the list of asset names
+
+void cmstats_delete_assets(cmstats_t* self, zlist_t* asset_names)
+{
+    assert(self);
+    assert(asset_names);
+
+    for (const char* asset_name = reinterpret_cast<const char*>(zlist_first(asset_names)); asset_name != nullptr;
+         asset_name             = reinterpret_cast<const char*>(zlist_next(asset_names))) {
+        cmstats_delete_asset(self, asset_name);
+    }
+}
+
+// publish the computed value of one statistic if its interval has ended, return true if it has
+// value (but the one of consumption), sum, count and interval start of the next interval are restarted
+// by the caller, see s_poll_restart
+// \param series - series of the statistic
+// \param column - column of the statistic
+// \param acc - accumulator of the statistic
+// \param now_ms - current time
+// \param published - list the message of the ended interval is appended to
+// \param closed - state of the interval which has just ended, with its final value
+template <cmstats_aggr_t AGGR>
+static bool s_acc_poll(cmstats_series_t& series, const cmstats_column_t& column, cmstats_acc_t* acc,
+    uint64_t now_ms, zlist_t* published, cmstats_acc_t* closed)
+{
+    assert(acc->aggr == AGGR);
+    uint64_t now_s = now_ms / 1000;
+    // the key is actually the future subject of the message
+    const char* quantity = series.quantity.c_str();
+    const char* aggr     = cmstats_aggr_str(acc->aggr);
+    const char* sstep    = column.sstep.c_str();
+    const char* asset    = series.asset.c_str();
+
+    // What is an assigned time for the metric ( in our case it is a left margin in the interval)
+    uint64_t metric_time_s = acc->interval_start;
+    uint64_t step          = acc->step;
+    // What SHOULD be an assigned time for the NEW stat metric (in our case it is a left margin in the NEW interval)
+    uint64_t metric_time_new_s = (now_ms - (now_ms % (step * 1000))) / 1000;
+
+    log_debug("cmstats_poll: key=%s_%s_%s@%s\n\tnow_ms=%" PRIu64 ", metric_time_new_s=%" PRIu64
+              ", metric_time_s=%" PRIu64 ", (now_ms - (metric_time_s * 1000))=%" PRIu64 "s, step*1000=%" PRIu64 "ms",
+        quantity, aggr, sstep, asset, now_ms, metric_time_new_s, metric_time_s, (now_ms - metric_time_s * 1000),
+        step * 1000);
+
+    // Should this metic be published and computation restarted?
+    if ((now_ms - (metric_time_s * 1000)) < (step * 1000))
+        return false;
+
+    // Yes, it should!
+    log_debug("cmstats:\tPublishing message wiht subject=%s_%s_%s@%s", quantity, aggr, sstep, asset);
+    double value = acc->value;
+
+    // If consumption data, compute last value missing for the end of interval
+    if constexpr (AGGR == CMSTATS_AGGR_CONSUMPTION) {
+        // If we have receive a least one power measure
+        if (acc->last_ts != 0) {
+            value = s_consumption_end(acc, metric_time_new_s);
+            log_debug("cmstats_poll: End consumption for %s@%s: new=%.1f %" PRIu64 "(%s)-%" PRIu64
+                      "(%s) %" PRIu64,
+                quantity, asset, value, metric_time_new_s, getTimeStampStr(metric_time_new_s).c_str(),
+                acc->last_ts, getTimeStampStr(acc->last_ts).c_str(), metric_time_new_s - acc->last_ts);
+        }
+    }
+
+    cmstats_sketch_t* sketch = s_sketch(series, acc->sketch);
+    if constexpr (AGGR != CMSTATS_AGGR_CONSUMPTION) {
+        s_kernel_end<AGGR>(acc, sketch ? s_sketch_end(sketch, metric_time_s) : nullptr, metric_time_s + step);
+        value = acc->value;
+    }
+
+    *closed       = *acc;
+    closed->value = value;
 
-    for (fty_proto_t* stat_msg = reinterpret_cast<fty_proto_t*>(zhashx_first(self->stats)); stat_msg != nullptr;
-         stat_msg              = reinterpret_cast<fty_proto_t*>(zhashx_next(self->stats))) {
-        const char* key = reinterpret_cast<const char*>(zhashx_cursor(self->stats));
-        if (streq(fty_proto_name(stat_msg), asset_name))
-            zlist_append(keys, const_cast<char*>(key));
+    // Test if receive some data before publishing
+    if (acc->count != 0) {
+        zlist_append(published, s_encode(series, column, acc, value));
+    } else {
+        log_info("No metrics for this step, do not publish");
     }
 
-    for (const char* key = reinterpret_cast<const char*>(zlist_first(keys)); key != nullptr;
-         key             = reinterpret_cast<const char*>(zlist_next(keys))) {
-        zhashx_delete(self->stats, key);
+    if constexpr (AGGR == CMSTATS_AGGR_CONSUMPTION) {
+        if (acc->last_ts != 0) {
+            // and compute the first value for the new interval
+            double consumption = acc->last_value * static_cast<double>(now_s - metric_time_new_s);
+            if (consumption < 0)
+                consumption = 0;
+            acc->value   = consumption;
+            acc->last_ts = now_s;
+            log_debug("cmstats_poll: Update new consumption for %s@%s: %.1f %" PRIu64 "(%s)-%" PRIu64
+                      "(%s) %" PRIu64,
+                quantity, asset, consumption, now_s, getTimeStampStr(now_s).c_str(), metric_time_new_s,
+                getTimeStampStr(metric_time_new_s).c_str(), now_s - metric_time_new_s);
+        }
+    } else {
+        // As we do not receive any message, start from ZERO
+        acc->extra = 0;
     }
-    zlist_destroy(&keys);
+    return true;
+}
+
+// restart the polled statistic computed from the metrics for the interval from interval_start,
+// consumption goes on with its value and sum (see cmsweep_restart for all ended statistics of the column)
+static void s_poll_restart(cmstats_acc_t* acc, uint64_t interval_start)
+{
+    if (acc->aggr != CMSTATS_AGGR_CONSUMPTION) {
+        acc->value = 0;
+        acc->sum   = 0;
+    }
+    acc->count          = 0;
+    acc->interval_start = interval_start;
+}
+
+// publish && reset the statistic of series in column computed from the metrics if its interval has ended,
+// the closed interval is rolled up to the longer steps
+static void s_base_poll(cmstats_t* self, uint32_t series_id, uint32_t column_id, uint64_t now_ms, zlist_t* published)
+{
+    cmstats_series_t& series = self->series[series_id];
+    cmstats_column_t& column = self->columns[column_id];
+    cmstats_stat_t*   stat   = s_stat(series, column_id);
+    uint64_t          now_s  = now_ms / 1000;
+    cmstats_acc_t     acc;
+    cmstats_acc_t     closed;
+    s_gather(column, stat, &acc);
+    if (!s_aggr(column.aggr).acc_poll(series, column, &acc, now_ms, published, &closed))
+        return;
+    s_poll_restart(&acc, now_s - now_s % acc.step);
+    s_scatter(column, stat, acc);
+    s_touch(self, series_id);
+    if (!column.rollups.empty())
+        s_rollup(self, column_id, &series_id, &closed, 1, now_ms, published);
+}
+
+// statistic of the i-th member of column, NULL if its series was deleted
+static cmstats_stat_t* s_member(cmstats_t* self, uint32_t column_id, uint32_t i)
+{
+    const std::pair<uint32_t, uint32_t>& member = self->columns[column_id].members[i];
+    cmstats_series_t&                    series = self->series[member.first];
+    cmstats_stat_t*                      stat   = s_stat(series, column_id);
+    if (!series.used || series.generation != member.second || !stat || stat->member != i)
+        return nullptr;
+    return stat;
+}
+
+// visit the statistics of the column whose interval has ended, publish them and schedule the column again
+// the ended ones are found by the vectorized sweep of the dense array of the interval ends, they are
+// published one by one, then restarted at once in the arrays of the column and their closed intervals
+// rolled up to the longer steps at once
+static void s_column_poll(cmstats_t* self, uint32_t column_id, uint64_t now_ms, zlist_t* published)
+{
+    cmstats_column_t& column   = self->columns[column_id];
+    uint64_t          now_s    = now_ms / 1000;
+    bool              dropped  = false;
+    size_t            nrestart = 0;
+
+    column.deadline = 0;
+    self->closed_ids.clear();
+    self->closed.clear();
+    self->ended.resize(column.members.size());
+    size_t nended = cmsweep_ended(column.ends.data(), column.ends.size(), now_s, self->ended.data());
+    for (size_t k = 0; k < nended; k++) {
+        uint32_t        i    = self->ended[k];
+        cmstats_stat_t* stat = s_member(self, column_id, i);
+        // drop the statistics of deleted series
+        if (!stat) {
+            dropped = true;
+            continue;
+        }
+        uint32_t          series_id = column.members[i].first;
+        cmstats_series_t& series    = self->series[series_id];
+        cmstats_acc_t     acc;
+
+        if (s_rolled_up(self, series, column_id)) {
+            // base interval ending together with this one is rolled up first, it may restart this one
+            if (s_stat(series, size_t(column.base))->step != 0)
+                s_base_poll(self, series_id, uint32_t(column.base), now_ms, published);
+            s_gather(column, stat, &acc);
+            if (now_s < acc.interval_start + acc.step)
+                continue;
+            s_rollup_end(series, column, &acc, published);
+            // rolled up consumption starts from zero, unlike the one computed from the metrics
+            acc.value = 0;
+            acc.sum   = 0;
+            acc.extra = 0;
+        } else {
+            cmstats_acc_t closed;
+            s_gather(column, stat, &acc);
+            if (!s_aggr(column.aggr).acc_poll(series, column, &acc, now_ms, published, &closed))
+                continue;
+            if (!column.rollups.empty()) {
+                self->closed_ids.push_back(series_id);
+                self->closed.push_back(closed);
+            }
+        }
+        s_scatter(column, stat, acc);
+        s_touch(self, series_id);
+        self->ended[nrestart++] = i;
+    }
+
+    // the ended statistics start the next interval at once, see s_poll_restart
+    uint64_t interval_start = now_s - now_s % column.step;
+    bool     consumption    = (column.aggr == CMSTATS_AGGR_CONSUMPTION);
+    cmsweep_restart(consumption ? nullptr : column.value.data(), consumption ? nullptr : column.sum.data(),
+        column.count.data(), column.interval_start.data(), column.ends.data(),
+        nrestart == column.members.size() ? nullptr : self->ended.data(), nrestart, interval_start,
+        interval_start + column.step);
+    if (!self->closed.empty())
+        s_rollup(self, column_id, self->closed_ids.data(), self->closed.data(), self->closed.size(), now_ms, published);
+
+    if (dropped) {
+        size_t n = 0;
+        for (size_t i = 0; i < column.members.size(); i++) {
+            cmstats_stat_t* stat = s_member(self, column_id, uint32_t(i));
+            if (!stat)
+                continue;
+            stat->member             = uint32_t(n);
+            column.members[n]        = column.members[i];
+            column.ends[n]           = column.ends[i];
+            column.interval_start[n] = column.interval_start[i];
+            column.count[n]          = column.count[i];
+            column.value[n]          = column.value[i];
+            column.sum[n++]          = column.sum[i];
+        }
+        column.members.resize(n);
+        column.ends.resize(n);
+        column.interval_start.resize(n);
+        column.count.resize(n);
+        column.value.resize(n);
+        column.sum.resize(n);
+    }
+
+    uint64_t deadline = cmsweep_min(column.ends.data(), column.ends.size());
+    if (deadline != UINT64_MAX)
+        s_schedule(self, column_id, deadline);
 }
 
 //  --------------------------------------------------------------------------
 //  Polling handler - publish && reset the computed values
 
-void cmstats_poll(cmstats_t* self)
+size_t cmstats_poll(cmstats_t* self, zlist_t* published)
 {
     assert(self);
+    assert(published);
 
     // What is it time now? [ms]
     uint64_t now_ms = uint64_t(zclock_time());
+    size_t   size   = zlist_size(published);
+
+    // visit only the columns whose earliest interval has already ended
+    while (!self->schedule.empty()) {
+        auto it = self->schedule.begin();
+        if (it->first * 1000 > now_ms)
+            break;
+        uint32_t column_id = it->second;
+        self->schedule.erase(it);
+        s_column_poll(self, column_id, now_ms, published);
+    }
+    return zlist_size(published) - size;
+}
 
-    for (fty_proto_t* stat_msg = reinterpret_cast<fty_proto_t*>(zhashx_first(self->stats)); stat_msg != nullptr;
-         stat_msg              = reinterpret_cast<fty_proto_t*>(zhashx_next(self->stats))) {
-        // take a key, actually it is the future subject of the message
-        const char* key = reinterpret_cast<const char*>(zhashx_cursor(self->stats));
-
-        // What is an assigned time for the metric ( in our case it is a left margin in the interval)
-        uint64_t metric_time_s = fty_proto_time(stat_msg);
-        uint64_t step          = fty_proto_aux_number(stat_msg, AGENT_CM_STEP, 0);
-        // What SHOULD be an assigned time for the NEW stat metric (in our case it is a left margin in the NEW interval)
-        uint64_t metric_time_new_s = (now_ms - (now_ms % (step * 1000))) / 1000;
-
-        log_debug("cmstats_poll: key=%s\n\tnow_ms=%" PRIu64 ", metric_time_new_s=%" PRIu64 ", metric_time_s=%" PRIu64
-                  ", (now_ms - (metric_time_s * 1000))=%" PRIu64 "s, step*1000=%" PRIu32 "ms",
-            key, now_ms, metric_time_new_s, metric_time_s, (now_ms - metric_time_s * 1000), step * 1000);
-
-        // Should this metic be published and computation restarted?
-        if ((now_ms - (metric_time_s * 1000)) >= (step * 1000)) {
-            // Yes, it should!
-            fty_proto_t* ret = fty_proto_dup(stat_msg);
-            log_debug("cmstats:\tPublishing message wiht subject=%s", key);
-
-            // If consumption data, compute last value missing for the end of interval
-            if (streq(fty_proto_aux_string(stat_msg, AGENT_CM_TYPE, ""), "consumption")) {
-                uint64_t last_metric_time_s = fty_proto_aux_number(stat_msg, AGENT_CM_LASTTS, 0);
-                // If we have receive a least one power measure
-                if (last_metric_time_s != 0) {
-                    // Compute time between last measure and end of interval
-                    int64_t delta = static_cast<int64_t>(metric_time_new_s - last_metric_time_s);
-                    // If last measure before the current step, time is equal to the complete interval
-                    // (power don't change during the interval period)
-                    if (delta > static_cast<int64_t>(step)) delta = static_cast<int64_t>(step);
-                    else if (delta < 0) delta = 0;
-                    // Get last power received which is saved in the sum aux dictionary
-                    double last_metric_value = atof(fty_proto_aux_string(stat_msg, AGENT_CM_SUM, ""));
-                    // Compute last value missing for the end interval
-                    double consumption = atof(fty_proto_value(stat_msg));
-                    double inc = last_metric_value * static_cast<double>(delta);
-                    consumption += inc;
-                    fty_proto_set_value(ret, "%.1f", consumption);
-                    log_debug("cmstats_poll: End consumption for %s: new=%.1f inc=%.1f %" PRIu64"(%s)-%" PRIu64 "(%s) %" PRIu64, key, consumption, inc,
-                        metric_time_new_s, getTimeStampStr(metric_time_new_s).c_str(), last_metric_time_s, getTimeStampStr(last_metric_time_s).c_str(),
-                        metric_time_new_s - last_metric_time_s);
-
-                    // and compute the first value for the new interval
-                    consumption = last_metric_value * static_cast<double>(now_ms/1000 - metric_time_new_s);
-                    if (consumption < 0) consumption = 0;
-                    fty_proto_set_value(stat_msg, "%.1f", consumption);
-                    fty_proto_aux_insert(stat_msg, AGENT_CM_LASTTS, "%" PRIu64, now_ms/1000);
-                    log_debug("cmstats_poll: Update new consumption for %s: %.1f %" PRIu64 "(%s)-%" PRIu64 "(%s) %" PRIu64, key, consumption,
-                        now_ms/1000, getTimeStampStr(now_ms/1000).c_str(), metric_time_new_s, getTimeStampStr(metric_time_new_s).c_str(),
-                        now_ms/1000 - metric_time_new_s);
-                }
-            }
-            else {
-                // As we do not receive any message, start from ZERO
-                fty_proto_aux_insert(stat_msg, AGENT_CM_SUM, "0");
-                fty_proto_set_value(stat_msg, "0");
-            }
-            fty_proto_set_time(stat_msg, metric_time_new_s);
-            fty_proto_aux_insert(stat_msg, AGENT_CM_COUNT, "0");
-            fty_proto_print(ret);
-            // Test if receive some data before publishing
-            if (fty_proto_aux_number(ret, AGENT_CM_COUNT, 0) != 0) {
-                int r = fty::shm::write_metric(ret);
-                if (r == -1) {
-                    log_error("cmstats:\tCannot publish statistics");
-                }
-            }
-            else {
-              log_info("No metrics for this step, do not publish");
-            }
-            fty_proto_destroy(&ret);
+//  --------------------------------------------------------------------------
+//  Binary state file
+//
+//  The state is a sequence of frames in host byte order (the file never leaves the box):
+//    header   magic "CMST", version, kind, number of strings, columns, records, deleted assets and sketches,
+//             index of the shard which wrote the frame and sequence number of the frame
+//    strings  length + characters of every distinct quantity, asset, unit and sstep
+//    columns  aggr, step, index of sstep in strings
+//    deleted  indexes of names of the assets deleted since the previous frame (delta frame only)
+//    records  one fixed size record per statistic, names are indexes in strings (extra since version 4)
+//    sketches index of the record + bins of the sketch of every percentile (since version 3)
+//    crc      CRC-32 of all the bytes above
+//  State file contains one full frame per shard, delta log "<state file>.delta" contains delta
+//  frames with the series changed since the previous frame, appended one after another. Delta
+//  frames with sequence number not greater than the one of the full frame of the same shard
+//  are already included in it.
+//  Files which do not start with the magic are loaded as the legacy zpl state.
+
+static const char     s_state_magic[4]   = {'C', 'M', 'S', 'T'};
+static const uint32_t s_state_version    = 4;
+static const uint32_t s_state_kind_full  = 0; // frame with the full state
+static const uint32_t s_state_kind_delta = 1; // frame with the changes since the previous frame
+
+struct state_header_t
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t nstrings;
+    uint32_t ncolumns;
+    uint32_t nrecords;
+    // since version 2
+    uint32_t ndeleted;
+    uint32_t shard;
+    uint64_t sequence;
+    // since version 3
+    uint32_t nsketches;
+    uint32_t reserved;
+};
+static const size_t s_state_header_v1_size = offsetof(state_header_t, ndeleted);
+static const size_t s_state_header_v2_size = offsetof(state_header_t, nsketches);
+
+struct state_column_t
+{
+    uint32_t aggr;
+    uint32_t step;
+    uint32_t sstep;
+};
+
+struct state_record_t
+{
+    uint32_t quantity;
+    uint32_t asset;
+    uint32_t unit;
+    uint32_t column;
+    double   value;
+    double   sum;
+    double   min;
+    double   max;
+    double   last_value;
+    uint64_t count;
+    uint64_t last_ts;
+    uint64_t interval_start;
+    // since version 4
+    double extra;
+};
+static_assert(sizeof(state_record_t) == 88, "state record must not contain padding");
+static const size_t s_state_record_v3_size = offsetof(state_record_t, extra);
+
+// size of the record in the frame of the version
+static size_t s_state_record_size(uint32_t version)
+{
+    return (version < 4) ? s_state_record_v3_size : sizeof(state_record_t);
+}
+
+// CRC-32 (IEEE 802.3) of the data
+static uint32_t s_crc32(const void* data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    uint32_t       crc = 0xFFFFFFFFu;
+    const uint8_t* p   = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// distinct strings of the state file, each one is stored only once
+struct state_strings_t
+{
+    std::vector<const std::string*>           list;
+    std::unordered_map<std::string, uint32_t> index;
+
+    uint32_t add(const std::string& str)
+    {
+        auto it = index.emplace(str, uint32_t(list.size()));
+        if (it.second)
+            list.push_back(&it.first->first);
+        return it.first->second;
+    }
+};
+
+// bounded reader of the mapped state file
+struct state_reader_t
+{
+    const char* pos;
+    const char* end;
+
+    bool get(void* dest, size_t size)
+    {
+        if (size_t(end - pos) < size)
+            return false;
+        memcpy(dest, pos, size);
+        pos += size;
+        return true;
+    }
+
+    bool skip(size_t size)
+    {
+        if (size_t(end - pos) < size)
+            return false;
+        pos += size;
+        return true;
+    }
+};
+
+// append the records of all the statistics of the series and the sketches of its percentiles,
+// the sketch shared by the percentiles of one step is written once, with the first of them
+static void s_state_series(const cmstats_t* self, const cmstats_series_t& series, state_strings_t& strings,
+    std::vector<state_record_t>& records, std::string& sketches, uint32_t& nsketches)
+{
+    uint32_t          quantity = strings.add(series.quantity);
+    uint32_t          asset    = strings.add(series.asset);
+    uint32_t          unit     = strings.add(series.unit);
+    std::vector<bool> written(series.sketches.size(), false);
+    for (size_t c = 0; c < series.slots.size(); c++) {
+        const cmstats_stat_t* stat = s_stat(series, c);
+        if (!stat || stat->step == 0)
+            continue;
+        if (stat->sketch != 0 && !written[stat->sketch - 1]) {
+            uint32_t record = uint32_t(records.size());
+            sketches.append(reinterpret_cast<const char*>(&record), sizeof(record));
+            cmsketch_encode(&series.sketches[stat->sketch - 1].values, sketches);
+            written[stat->sketch - 1] = true;
+            nsketches++;
+        }
+        cmstats_acc_t acc;
+        s_gather(self->columns[c], stat, &acc);
+        records.push_back({quantity, asset, unit, uint32_t(c), acc.value, acc.sum, acc.min, acc.max, acc.last_value,
+            acc.count, acc.last_ts, acc.interval_start, acc.extra});
+    }
+}
+
+// append the frame of the given kind to the buffer, all the changes are included in it afterwards
+static void s_state_encode(cmstats_t* self, uint32_t kind, std::string& buffer)
+{
+    state_strings_t             strings;
+    std::vector<state_column_t> columns;
+    std::vector<uint32_t>       deleted;
+    std::vector<state_record_t> records;
+    std::string                 sketches;
+    uint32_t                    nsketches = 0;
+
+    for (const cmstats_column_t& column : self->columns)
+        columns.push_back({uint32_t(column.aggr), column.step, strings.add(column.sstep)});
+
+    if (kind == s_state_kind_full) {
+        for (const cmstats_series_t& series : self->series) {
+            if (series.used)
+                s_state_series(self, series, strings, records, sketches, nsketches);
+        }
+        for (cmstats_series_t& series : self->series)
+            series.dirty = false;
+    } else {
+        for (const std::string& asset : self->deleted)
+            deleted.push_back(strings.add(asset));
+        for (uint32_t id : self->dirty) {
+            cmstats_series_t& series = self->series[id];
+            series.dirty             = false;
+            if (series.used)
+                s_state_series(self, series, strings, records, sketches, nsketches);
+        }
+    }
+    self->dirty.clear();
+    self->deleted.clear();
+
+    state_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_state_magic, sizeof(header.magic));
+    header.version   = s_state_version;
+    header.kind      = kind;
+    header.nstrings  = uint32_t(strings.list.size());
+    header.ncolumns  = uint32_t(columns.size());
+    header.nrecords  = uint32_t(records.size());
+    header.ndeleted  = uint32_t(deleted.size());
+    header.shard     = self->shard;
+    header.sequence  = ++self->sequence;
+    header.nsketches = nsketches;
+
+    size_t start = buffer.size();
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const std::string* str : strings.list) {
+        uint32_t len = uint32_t(str->size());
+        buffer.append(reinterpret_cast<const char*>(&len), sizeof(len));
+        buffer.append(*str);
+    }
+    buffer.append(reinterpret_cast<const char*>(columns.data()), columns.size() * sizeof(state_column_t));
+    buffer.append(reinterpret_cast<const char*>(deleted.data()), deleted.size() * sizeof(uint32_t));
+    buffer.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(state_record_t));
+    buffer.append(sketches);
+    uint32_t crc = s_crc32(buffer.data() + start, buffer.size() - start);
+    buffer.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+}
+
+//  --------------------------------------------------------------------------
+//  Append the full state of self to the buffer
+
+void cmstats_encode(cmstats_t* self, std::string& buffer)
+{
+    assert(self);
+
+    s_state_encode(self, s_state_kind_full, buffer);
+}
+
+//  --------------------------------------------------------------------------
+//  Append the changes since the last encoded frame to the buffer
+
+void cmstats_encode_delta(cmstats_t* self, std::string& buffer)
+{
+    assert(self);
+
+    s_state_encode(self, s_state_kind_delta, buffer);
+}
+
+// read the header of the frame, return false if the data do not start with a valid header
+static bool s_state_header(state_reader_t& reader, state_header_t& header)
+{
+    memset(&header, 0, sizeof(header));
+    if (!reader.get(&header, s_state_header_v1_size) || memcmp(header.magic, s_state_magic, sizeof(header.magic)) != 0)
+        return false;
+    if (header.version == 1)
+        return header.kind == s_state_kind_full;
+    if (header.version > s_state_version || (header.kind != s_state_kind_full && header.kind != s_state_kind_delta))
+        return false;
+    size_t size = (header.version == 2) ? s_state_header_v2_size : sizeof(header);
+    return reader.get(&header.ndeleted, size - s_state_header_v1_size);
+}
+
+// return the size of the valid frame at the beginning of data, 0 if the frame is not valid
+static size_t s_state_frame_size(const char* data, size_t size)
+{
+    state_reader_t reader = {data, data + size};
+    state_header_t header;
+    if (!s_state_header(reader, header))
+        return 0;
+
+    for (uint32_t i = 0; i < header.nstrings; i++) {
+        uint32_t len;
+        if (!reader.get(&len, sizeof(len)) || !reader.skip(len))
+            return 0;
+    }
+    uint32_t crc;
+    if (!reader.skip(size_t(header.ncolumns) * sizeof(state_column_t)) ||
+        !reader.skip(size_t(header.ndeleted) * sizeof(uint32_t)) ||
+        !reader.skip(size_t(header.nrecords) * s_state_record_size(header.version)))
+        return 0;
+    cmsketch_t sketch = {};
+    for (uint32_t i = 0; i < header.nsketches; i++) {
+        if (!reader.skip(sizeof(uint32_t)))
+            return 0;
+        size_t len = cmsketch_decode(&sketch, reader.pos, size_t(reader.end - reader.pos));
+        if (len == 0 || !reader.skip(len))
+            return 0;
+    }
+    size_t frame_size = size_t(reader.pos - data);
+    if (!reader.get(&crc, sizeof(crc)) || crc != s_crc32(data, frame_size))
+        return 0;
+    return frame_size + sizeof(crc);
+}
+
+// apply the valid frame to self
+static void s_state_apply(cmstats_t* self, const char* data, size_t size)
+{
+    state_reader_t reader = {data, data + size};
+    state_header_t header;
+    s_state_header(reader, header);
+
+    std::vector<std::string> strings(header.nstrings);
+    for (std::string& str : strings) {
+        uint32_t len;
+        reader.get(&len, sizeof(len));
+        str.assign(reader.pos, len);
+        reader.skip(len);
+    }
+
+    // columns of the frame -> columns of self
+    std::vector<int> columns(header.ncolumns);
+    for (int& column : columns) {
+        state_column_t c;
+        reader.get(&c, sizeof(c));
+        column = -1;
+        if (c.sstep < strings.size())
+            column = cmstats_column(self, cmstats_aggr_str(cmstats_aggr_t(c.aggr)), strings[c.sstep].c_str(), c.step);
+    }
+
+    for (uint32_t i = 0; i < header.ndeleted; i++) {
+        uint32_t asset;
+        reader.get(&asset, sizeof(asset));
+        if (asset < strings.size())
+            cmstats_delete_asset(self, strings[asset].c_str());
+    }
+
+    // (series id, column) of the records, the sketches refer to them
+    std::vector<std::pair<uint32_t, size_t>> targets(header.nrecords, {UINT32_MAX, 0});
+    for (uint32_t i = 0; i < header.nrecords; i++) {
+        state_record_t r = {};
+        reader.get(&r, s_state_record_size(header.version));
+        if (r.quantity >= strings.size() || r.asset >= strings.size() || r.unit >= strings.size() ||
+            r.column >= columns.size() || columns[r.column] == -1) {
+            log_warning("cmstats_load:\tinvalid record %" PRIu32 ", ignoring", i);
+            continue;
+        }
+        size_t column = size_t(columns[r.column]);
+
+        uint32_t          id     = cmstats_series(self, strings[r.quantity].c_str(), strings[r.asset].c_str());
+        cmstats_series_t& series = self->series[id];
+        series.unit              = strings[r.unit];
+
+        cmstats_acc_t acc;
+        acc.aggr           = self->columns[column].aggr;
+        acc.step           = self->columns[column].step;
+        acc.value          = r.value;
+        acc.sum            = r.sum;
+        acc.min            = r.min;
+        acc.max            = r.max;
+        acc.last_value     = r.last_value;
+        acc.count          = r.count;
+        acc.last_ts        = r.last_ts;
+        acc.interval_start = r.interval_start;
+        acc.extra          = r.extra;
+        s_scatter(self->columns[column], s_stat_alloc(self, id, column), acc);
+        s_reschedule(self, uint32_t(column), &acc);
+        targets[i] = {id, column};
+    }
+
+    // sketches of the loaded percentiles start empty, the shared one is attached to those which are new
+    for (const std::pair<uint32_t, size_t>& target : targets) {
+        if (target.first == UINT32_MAX)
+            continue;
+        cmstats_series_t& series = self->series[target.first];
+        s_sketch_attach(self, series);
+        cmstats_sketch_t* sketch = s_sketch(series, s_stat(series, target.second)->sketch);
+        if (sketch)
+            *sketch = {sketch->step, sketch->rolled, 0, UINT64_MAX, UINT64_MAX, {}, {}};
+    }
+
+    for (uint32_t i = 0; i < header.nsketches; i++) {
+        uint32_t   record;
+        cmsketch_t sketch = {};
+        reader.get(&record, sizeof(record));
+        reader.skip(cmsketch_decode(&sketch, reader.pos, size_t(reader.end - reader.pos)));
+        if (record >= targets.size() || targets[record].first == UINT32_MAX)
+            continue;
+        cmstats_series_t& series = self->series[targets[record].first];
+        cmstats_sketch_t* shared = s_sketch(series, s_stat(series, targets[record].second)->sketch);
+        if (shared)
+            std::swap(shared->values, sketch);
+    }
+    // loaded state is not a change to be checkpointed again
+    self->deleted.clear();
+    self->sequence = std::max(self->sequence, header.sequence);
+}
+
+// apply all the frames of data of the given kind, return false if some frame is not valid
+// base contains the sequence number of full frame of each shard, only newer delta frames are applied
+static bool s_state_replay(cmstats_t* self, const char* data, size_t size, uint32_t kind, std::vector<uint64_t>& base)
+{
+    size_t applied = 0;
+    size_t pos     = 0;
+    while (pos < size) {
+        size_t frame_size = s_state_frame_size(data + pos, size - pos);
+        if (frame_size == 0) {
+            log_warning("cmstats_load:\tinvalid frame at offset %zu", pos);
+            return false;
+        }
+        state_reader_t reader = {data + pos, data + pos + frame_size};
+        state_header_t header;
+        s_state_header(reader, header);
+        if (header.kind != kind) {
+            log_warning("cmstats_load:\tunexpected kind %" PRIu32 " of frame at offset %zu", header.kind, pos);
+            return false;
+        }
+        if (base.size() <= header.shard)
+            base.resize(header.shard + 1, 0);
+        if (kind == s_state_kind_full || header.sequence > base[header.shard]) {
+            s_state_apply(self, data + pos, frame_size);
+            applied++;
         }
+        if (kind == s_state_kind_full)
+            base[header.shard] = header.sequence;
+        pos += frame_size;
     }
+    log_debug("cmstats_load:\t%zu frames applied", applied);
+    return true;
+}
+
+// return the name of the delta log of the state file
+static std::string s_delta_filename(const char* filename)
+{
+    std::string delta(filename);
+    delta.append(".delta");
+    return delta;
+}
+
+//  --------------------------------------------------------------------------
+//  Write the serialized state to filename atomically, return -1 if fail
+//  The data are written to temporary file which replaces filename once complete
+
+int cmstats_write(const char* filename, const std::string& buffer, bool sync)
+{
+    assert(filename);
+
+    std::string tmp(filename);
+    tmp.append(".tmp");
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    const char* data = buffer.data();
+    size_t      left = buffer.size();
+    while (left > 0) {
+        ssize_t r = write(fd, data, left);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            close(fd);
+            unlink(tmp.c_str());
+            return -1;
+        }
+        data += r;
+        left -= size_t(r);
+    }
+
+    if ((sync && fsync(fd) == -1) || close(fd) == -1 || rename(tmp.c_str(), filename) == -1) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+
+    // all the deltas are included in the full state now
+    unlink(s_delta_filename(filename).c_str());
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Append the delta frames to the delta log of filename, return -1 if fail
+
+int cmstats_append(const char* filename, const std::string& buffer, bool sync)
+{
+    assert(filename);
+
+    int fd = open(s_delta_filename(filename).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    const char* data = buffer.data();
+    size_t      left = buffer.size();
+    while (left > 0) {
+        ssize_t r = write(fd, data, left);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            close(fd);
+            return -1;
+        }
+        data += r;
+        left -= size_t(r);
+    }
+
+    if ((sync && fsync(fd) == -1) || close(fd) == -1)
+        return -1;
+    return 0;
 }
 
 //  --------------------------------------------------------------------------
@@ -467,51 +2007,17 @@ void cmstats_poll(cmstats_t* self)
 int cmstats_save(cmstats_t* self, const char* filename)
 {
     assert(self);
+    assert(filename);
 
-    zconfig_t* root = zconfig_new("cmstats", nullptr);
-    int        i    = 1;
-    for (fty_proto_t* bmsg = reinterpret_cast<fty_proto_t*>(zhashx_first(self->stats)); bmsg != nullptr;
-         bmsg              = reinterpret_cast<fty_proto_t*>(zhashx_next(self->stats))) {
-        // ZCONFIG doesn't allow spaces in keys! -> metric topic cannot be key
-        // because it has an asset name inside!
-        char* asset_key = nullptr;
-        int   r         = asprintf(&asset_key, "%d", i);
-        assert(r != -1); // make gcc @ rhel happy
-        i++;
-        const char* metric_topic = reinterpret_cast<const char*>(zhashx_cursor(self->stats));
-
-        zconfig_t* item = zconfig_new(asset_key, root);
-        zconfig_put(item, "metric_topic", metric_topic);
-        zconfig_put(item, "type", fty_proto_type(bmsg));
-        zconfig_put(item, "element_src", fty_proto_name(bmsg));
-        zconfig_put(item, "value", fty_proto_value(bmsg));
-        zconfig_put(item, "unit", fty_proto_unit(bmsg));
-        zconfig_putf(item, "ttl", "%" PRIu32, fty_proto_ttl(bmsg));
-
-        zhash_t* aux = fty_proto_aux(bmsg);
-        for (const char* aux_value = reinterpret_cast<const char*>(zhash_first(aux)); aux_value != nullptr;
-             aux_value             = reinterpret_cast<const char*>(zhash_next(aux))) {
-            const char* aux_key = zhash_cursor(aux);
-            char*       item_key;
-
-            [[maybe_unused]] int r1 = asprintf(&item_key, "aux.%s", aux_key);
-            assert(r1 != -1); // make gcc @ rhel happy
-
-            zconfig_put(item, item_key, aux_value);
-            zstr_free(&item_key);
-        }
-        zstr_free(&asset_key);
-    }
-
-    int r = zconfig_save(root, filename);
-    zconfig_destroy(&root);
-    return r;
+    std::string buffer;
+    cmstats_encode(self, buffer);
+    return cmstats_write(filename, buffer, false);
 }
 
 //  --------------------------------------------------------------------------
-//  Load the cmstats from filename
+//  Load the legacy zpl state (written by the older versions)
 
-cmstats_t* cmstats_load(const char* filename)
+static cmstats_t* s_load_zpl(const char* filename)
 {
     zconfig_t* root = zconfig_load(filename);
 
@@ -525,42 +2031,118 @@ cmstats_t* cmstats_load(const char* filename)
     }
     zconfig_t* key_config = zconfig_child(root);
     for (; key_config != nullptr; key_config = zconfig_next(key_config)) {
-        // 1. create bmsg
-        const char*  metric_topic = zconfig_get(key_config, "metric_topic", "");
-        fty_proto_t* bmsg         = fty_proto_new(FTY_PROTO_METRIC);
-        fty_proto_set_type(bmsg, "%s", zconfig_get(key_config, "type", ""));
-        fty_proto_set_name(bmsg, "%s", zconfig_get(key_config, "element_src", ""));
-        fty_proto_set_value(bmsg, "%s", zconfig_get(key_config, "value", ""));
-        fty_proto_set_unit(bmsg, "%s", zconfig_get(key_config, "unit", ""));
-        fty_proto_set_ttl(bmsg, uint32_t(atoi(zconfig_get(key_config, "ttl", "0"))));
-
-        double value = atof(fty_proto_value(bmsg));
-        if (std::isnan(value)) {
-            log_warning("cmstats_load:\tisnan (%s) for %s@%s, ignoring", fty_proto_value(bmsg), fty_proto_type(bmsg),
-                fty_proto_name(bmsg));
-            fty_proto_destroy(&bmsg);
+        const char* metric_topic = zconfig_get(key_config, "metric_topic", "");
+        const char* type         = zconfig_get(key_config, "type", "");
+        const char* aggr_fun     = zconfig_get(key_config, "aux." AGENT_CM_TYPE, "");
+        uint32_t    step         = uint32_t(atol(zconfig_get(key_config, "aux." AGENT_CM_STEP, "0")));
+
+        double value;
+        if (!cmstats_parse_value(zconfig_get(key_config, "value", ""), &value)) {
+            log_warning("cmstats_load:\tisnan (%s) for %s@%s, ignoring", zconfig_get(key_config, "value", ""), type,
+                zconfig_get(key_config, "element_src", ""));
             continue;
         }
 
-        // 2. put aux things
-        zconfig_t* bmsg_config = zconfig_child(key_config);
-        for (; bmsg_config != nullptr; bmsg_config = zconfig_next(bmsg_config)) {
-            const char* bmsg_key = zconfig_name(bmsg_config);
-            if (strncmp(bmsg_key, "aux.", 4) != 0)
-                continue;
-
-            fty_proto_aux_insert(bmsg, (bmsg_key + 4), "%s", zconfig_value(bmsg_config));
+        // type is "<quantity>_<aggr>_<sstep>"
+        std::string quantity(type);
+        std::string sstep;
+        size_t      pos = quantity.rfind('_');
+        if (pos != std::string::npos) {
+            sstep = quantity.substr(pos + 1);
+            quantity.erase(pos);
         }
+        pos = quantity.rfind(std::string("_") + aggr_fun);
+        if (pos != std::string::npos)
+            quantity.erase(pos);
 
-        value = atof(fty_proto_aux_string(bmsg, AGENT_CM_SUM, "0"));
-        if (std::isnan(value)) {
-            fty_proto_aux_insert(bmsg, AGENT_CM_SUM, "0");
+        int column = cmstats_column(self, aggr_fun, sstep.c_str(), step);
+        if (column == -1) {
+            log_warning("cmstats_load:\tunsupported type or step for %s, ignoring", metric_topic);
+            continue;
         }
-
-        zhashx_update(self->stats, metric_topic, bmsg);
-        fty_proto_destroy(&bmsg);
+        uint32_t        id   = cmstats_series(self, quantity.c_str(), zconfig_get(key_config, "element_src", ""));
+        cmstats_stat_t* stat = s_stat_alloc(self, id, size_t(column));
+        cmstats_acc_t   acc;
+        s_gather(self->columns[size_t(column)], stat, &acc);
+        acc.aggr    = self->columns[size_t(column)].aggr;
+        acc.step    = step;
+        acc.value   = value;
+        acc.min     = value;
+        acc.max     = value;
+        acc.count   = uint64_t(atoll(zconfig_get(key_config, "aux." AGENT_CM_COUNT, "0")));
+        acc.last_ts = uint64_t(atoll(zconfig_get(key_config, "aux." AGENT_CM_LASTTS, "0")));
+
+        double sum;
+        if (!cmstats_parse_value(zconfig_get(key_config, "aux." AGENT_CM_SUM, "0"), &sum))
+            sum = 0;
+        if (acc.aggr == CMSTATS_AGGR_CONSUMPTION) {
+            acc.last_value = sum;
+        } else {
+            acc.sum = sum;
+            self->series[id].unit.assign(zconfig_get(key_config, "unit", ""));
+        }
+        s_scatter(self->columns[size_t(column)], stat, acc);
+        s_sketch_attach(self, self->series[id]);
+        s_reschedule(self, uint32_t(column), &acc);
     }
 
     zconfig_destroy(&root);
     return self;
 }
+
+// map the whole file to memory, return nullptr if fail or if the file is empty
+static const char* s_map(const char* filename, size_t* size)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    *size      = size_t(st.st_size);
+    void* data = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? nullptr : reinterpret_cast<const char*>(data);
+}
+
+//  --------------------------------------------------------------------------
+//  Load the cmstats from filename
+
+cmstats_t* cmstats_load(const char* filename)
+{
+    assert(filename);
+
+    size_t      size = 0;
+    const char* data = s_map(filename, &size);
+    if (!data)
+        return s_load_zpl(filename);
+
+    if (size < sizeof(s_state_magic) || memcmp(data, s_state_magic, sizeof(s_state_magic)) != 0) {
+        munmap(const_cast<char*>(data), size);
+        log_info("cmstats_load:\t'%s' is not a binary state, loading it as legacy zpl", filename);
+        return s_load_zpl(filename);
+    }
+
+    std::vector<uint64_t> base;
+    cmstats_t*            self = cmstats_new();
+    if (self && !s_state_replay(self, data, size, s_state_kind_full, base)) {
+        log_error("cmstats_load:\t'%s' is not a valid state file", filename);
+        cmstats_destroy(&self);
+    }
+    munmap(const_cast<char*>(data), size);
+
+    if (self) {
+        std::string delta = s_delta_filename(filename);
+        data              = s_map(delta.c_str(), &size);
+        if (data) {
+            // the last frame may be incomplete if the agent was stopped during the write
+            if (!s_state_replay(self, data, size, s_state_kind_delta, base))
+                log_warning("cmstats_load:\tignoring the rest of '%s'", delta.c_str());
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+    return self;
+}
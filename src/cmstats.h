@@ -21,14 +21,153 @@
 */
 
 #pragma once
+#include "cmsketch.h"
 #include <fty_proto.h>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//  Type of computation
+enum cmstats_aggr_t
+{
+    CMSTATS_AGGR_UNKNOWN = 0,
+    CMSTATS_AGGR_MIN,
+    CMSTATS_AGGR_MAX,
+    CMSTATS_AGGR_ARITHMETIC_MEAN,
+    CMSTATS_AGGR_CONSUMPTION,
+    CMSTATS_AGGR_P50,
+    CMSTATS_AGGR_P95,
+    CMSTATS_AGGR_P99,
+    CMSTATS_AGGR_TIME_WEIGHTED_MEAN,
+    CMSTATS_AGGR_VARIANCE,
+    CMSTATS_AGGR_STANDARD_DEVIATION
+};
+
+//  Accumulated state of one statistic (quantity, type, step, asset)
+//  fty_proto_t message is built only when the statistic is published
+//  Percentiles are estimated from the sketch of the series, their value is computed when the interval ends
+//  The accumulator is gathered from the hot state in the arrays of its column and the rest in its series,
+//  it is scattered back when it is updated
+struct cmstats_acc_t
+{
+    double         value;          // computed value for the current interval
+    double         sum;            // sum of the values
+    double         min;            // minimum of the values
+    double         max;            // maximum of the values
+    double         last_value;     // last accepted value (power for consumption)
+    double         extra;          // covered time [s] for time weighted mean, sum of squared deviations for variance
+    uint64_t       count;          // how many measurements are there
+    uint64_t       last_ts;        // timestamp of last metric [s]
+    uint64_t       interval_start; // left margin of the current interval [s]
+    uint32_t       step;           // computation step [s], 0 means the accumulator is not used
+    cmstats_aggr_t aggr;           // type of computation
+    uint16_t       sketch;         // index + 1 of the sketch of the series shared by its percentiles of the step,
+                                   // 0 if not a percentile
+};
+
+//  Statistic of the series in one column, apart from its hot state (value, sum, count and interval start)
+//  kept in the arrays of the column at index member, so the rollover of the column is done on the arrays
+struct cmstats_stat_t
+{
+    double         min;        // minimum of the values
+    double         max;        // maximum of the values
+    double         last_value; // last accepted value (power for consumption)
+    double         extra;      // covered time [s] for time weighted mean, sum of squared deviations for variance
+    uint64_t       last_ts;    // timestamp of last metric [s]
+    uint32_t       member;     // index of the statistic in the arrays of its column
+    uint32_t       step;       // computation step [s], 0 means the statistic is not started yet
+    cmstats_aggr_t aggr;       // type of computation
+    uint16_t       sketch;     // index + 1 of the shared sketch of the percentiles of the step, 0 if not a percentile
+};
+
+//  Sketch of the values of one step of the series, shared by all its percentiles (p50, p95, p99) of the step
+//  Values are added (or the closed intervals of the base merged) once, whichever percentile gets them first.
+//  The first percentile ending its interval moves the values to closed, all of them read their quantile from it.
+struct cmstats_sketch_t
+{
+    uint32_t   step;   // step of the percentiles sharing the sketch [s]
+    bool       rolled; // the percentiles are rolled up from the base, values are merged from its closed intervals
+    uint64_t   added;  // timestamp of the last value added to values [s]
+    uint64_t   merged; // start of the last closed interval of the base merged to values [s]
+    uint64_t   ended;  // start of the interval whose values were moved to closed [s], UINT64_MAX if none
+    cmsketch_t values; // values of the current interval
+    cmsketch_t closed; // values of the interval which has just ended
+};
+
+//  Column of the statistics - one type of computation for one step
+//  All intervals of one step are aligned, so the column is also the bucket of statistics
+//  which have to be published at the same time
+//  Intervals of the step which divides the longer one end together with it, so the statistics of
+//  the longer step are rolled up from the closed intervals of the base column - only the shortest
+//  step of each type is updated by the metrics, when the series is computed in it
+struct cmstats_column_t
+{
+    cmstats_aggr_t aggr;     // type of computation
+    uint32_t       step;     // computation step [s]
+    std::string    sstep;    // string representation of the step used in topic creation
+    uint64_t       deadline; // end of the earliest interval in column [s], 0 if nothing is scheduled
+    int32_t        base;     // column of the same type with the shortest step dividing this one, -1 if none
+    std::vector<uint32_t>                      rollups; // columns whose base is this one
+    std::vector<std::pair<uint32_t, uint32_t>> members; // (series id, generation) with statistic in column
+    // hot state of the statistics, one element per member
+    std::vector<uint64_t> ends;           // end of the interval [s], UINT64_MAX if not started or dropped
+    std::vector<uint64_t> interval_start; // left margin of the current interval [s]
+    std::vector<uint64_t> count;          // how many measurements are there
+    std::vector<double>   value;          // computed value for the current interval
+    std::vector<double>   sum;            // sum of the values
+};
+
+//  All statistics computed for one (quantity, asset)
+struct cmstats_series_t
+{
+    bool                          used;          // false if the series was deleted and its id can be reused
+    bool                          dirty;         // changed since the last checkpoint
+    uint32_t                      generation;    // incremented when the series is deleted
+    uint32_t                      rules_version; // version of cmrules the rule was found in, 0 if not yet
+    int32_t                       rule;          // cached index of the rule of cmrules, -1 if none
+    std::string                   quantity;      // type of the incoming metric
+    std::string                   asset;         // name of the asset (element_src)
+    std::string                   unit;          // unit of the incoming metric
+    std::vector<uint16_t>         slots;         // index + 1 of the statistic of the column, 0 if not computed
+    std::vector<cmstats_stat_t>   stats;         // statistics of the columns the series is computed in
+    std::vector<cmstats_sketch_t> sketches;      // sketches of the values, one per step of the percentiles
+};
 
 //  Structure of our class
 struct cmstats_t
 {
-    zhashx_t* stats; // a hash of FTY_PROTO metrics for "AVG/MIN/MAX" ready to be published
+    std::vector<cmstats_column_t>                          columns;     // registered (type, step) pairs
+    std::vector<cmstats_series_t>                          series;      // series indexed by dense series id
+    std::vector<uint32_t>                                  free_series; // ids of deleted series to be reused
+    std::unordered_map<std::string, uint32_t>              index;       // "quantity@asset" -> series id
+    std::unordered_map<std::string, std::vector<uint32_t>> assets;      // asset name -> ids of its series
+    std::string                                            key;         // buffer reused for index lookups
+    std::set<std::pair<uint64_t, uint32_t>>                schedule;    // (deadline, column) ordered by end of interval
+    std::vector<uint32_t>                                  dirty;       // ids of series changed since the last checkpoint
+    std::vector<std::string>                               deleted;     // assets deleted since the last checkpoint
+    uint64_t                                               sequence;    // sequence number of the last checkpoint
+    uint32_t                                               shard;       // index of the shard, written to checkpoints
+    std::vector<uint32_t>                                  ended;       // members found by the sweep, reused buffer
+    std::vector<uint32_t>                                  closed_ids;  // series of the closed intervals, reused buffer
+    std::vector<cmstats_acc_t>                             closed;      // closed intervals to roll up, reused buffer
+    std::vector<uint32_t>                                  merged;      // members they are merged to, reused buffer
+    std::vector<double>                                    merge_sum;   // their merged sums, reused buffer
+    std::vector<uint64_t>                                  merge_count; // their merged counts, reused buffer
 };
 
+//  Convert the name of computation (min, max, ...) to its type
+//  Return CMSTATS_AGGR_UNKNOWN for unsupported names, which are not registered in the table of computations
+cmstats_aggr_t cmstats_aggr_from_str(const char* aggr_fun);
+
+//  Convert the type of computation to its name
+const char* cmstats_aggr_str(cmstats_aggr_t aggr);
+
+//  Parse the value of the metric once, independently of the locale, to value_p
+//  Return false if str is not a number or it is NaN
+bool cmstats_parse_value(const char* str, double* value_p);
+
 //  Create a new cmstats
 cmstats_t* cmstats_new(void);
 
@@ -45,6 +184,10 @@ void cmstats_print(cmstats_t* self);
 // * min - to find a minimum value inside the given interval
 // * max - to find a maximum value inside the given interval
 // * arithmetic_mean - to compute an arithmetic mean inside the given interval
+// * consumption - to compute an energy consumption [Ws] inside the given interval
+// * p50, p95, p99 - to estimate the percentile of the values inside the given interval
+// * time_weighted_mean - to compute a mean of the values weighted by the time they were held
+// * variance, standard_deviation - to compute a sample variance or standard deviation inside the given interval
 //
 // \param self - statistics object
 // \param aggr_fun - a type of aggregation ( min, max, avg )
@@ -57,17 +200,80 @@ void cmstats_print(cmstats_t* self);
 //                  * if we are in the middle of computation (inside the interval)
 //         ret  - if we have just completed the computation for the interval and
 //                started new one. ( The old one is returned)
+//         NULL - if "aggr_fun" is not supported
 //
 fty_proto_t* cmstats_put(cmstats_t* self, const char* aggr_fun, const char* sstep, uint32_t step, fty_proto_t* bmsg);
 
+//  Register the column (type of computation, step) and return its index
+//  Return -1 if the type of computation is not supported
+int cmstats_column(cmstats_t* self, const char* aggr_fun, const char* sstep, uint32_t step);
+
+//  Return the id of the series for (quantity, asset), create the series if it does not exist
+uint32_t cmstats_series(cmstats_t* self, const char* quantity, const char* asset);
+
+//  Update the statistic in column of series for the incomming message "bmsg"
+//  Same as cmstats_put, with the series and column already resolved
+fty_proto_t* cmstats_series_put(cmstats_t* self, uint32_t series, uint32_t column, fty_proto_t* bmsg);
+
+//  Update the statistics in all given columns of series with the new value at once
+//  Messages for the intervals which have just ended are appended to published,
+//  caller is responsible for destroying them.
+//  Statistics of the columns with base, in which the series is computed too, are not updated
+//  by the value, they are rolled up from the base when its interval ends.
+//
+// \param self - statistics object
+// \param series - id of the series returned by cmstats_series
+// \param columns - ids of the columns returned by cmstats_column, ordered for sequential access
+// \param ncolumns - number of columns
+// \param value - received new RAW value
+// \param metric_time_s - timestamp of the received value
+// \param unit - unit of the received value
+// \param published - list of fty_proto_t messages to be published
+//
+// \return number of messages appended to published
+size_t cmstats_series_update(cmstats_t* self, uint32_t series, const uint32_t* columns, size_t ncolumns,
+    double value, uint64_t metric_time_s, const char* unit, zlist_t* published);
+
+//  Copy the accumulator of the statistic to acc (if not NULL), return false if there is no such statistic
+bool cmstats_lookup(cmstats_t* self, const char* quantity, const char* aggr_fun, const char* sstep,
+    const char* asset, cmstats_acc_t* acc);
+
+//  Copy the series with id from src to self, together with all its statistics
+//  The columns are registered in self if needed, return the id of the series in self
+uint32_t cmstats_copy_series(cmstats_t* self, const cmstats_t* src, uint32_t id);
+
 //  Remove all the entries related to the asset wiht asset_name from stats
 void cmstats_delete_asset(cmstats_t* self, const char* asset_name);
 
+//  Remove all the entries related to all assets from the list of asset names
+void cmstats_delete_assets(cmstats_t* self, zlist_t* asset_names);
+
 //  Polling handler - publish && reset the computed values if needed
-void cmstats_poll(cmstats_t* self);
+//  Only the columns whose interval has ended are visited. Messages for the ended intervals
+//  are appended to published, caller is responsible for destroying them.
+//  Return number of messages appended to published
+size_t cmstats_poll(cmstats_t* self, zlist_t* published);
+
+//  Append the full state of the cmstats to buffer (binary snapshot)
+void cmstats_encode(cmstats_t* self, std::string& buffer);
+
+//  Append the changes since the last serialization (delta frame) to buffer
+//  Only the series changed since then and the deleted assets are included
+void cmstats_encode_delta(cmstats_t* self, std::string& buffer);
+
+//  Write the serialized state to filename atomically (temporary file + rename)
+//  and drop the delta log of filename, which is included in the state now
+//  If sync is true, data are flushed to the disk before the rename, return -1 if fail
+int cmstats_write(const char* filename, const std::string& buffer, bool sync);
+
+//  Append the serialized delta frames to the delta log of filename ("<filename>.delta")
+//  If sync is true, data are flushed to the disk, return -1 if fail
+int cmstats_append(const char* filename, const std::string& buffer, bool sync);
 
-//  Save the cmstats to filename, return -1 if fail
+//  Save the cmstats to filename as binary snapshot, return -1 if fail
 int cmstats_save(cmstats_t* self, const char* filename);
 
 //  Load the cmstats from filename, return NULL if fail
+//  Both binary snapshot and legacy zpl state files are accepted, the newer changes
+//  from the delta log of binary snapshot are replayed
 cmstats_t* cmstats_load(const char* filename);
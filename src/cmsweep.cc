@@ -0,0 +1,333 @@
+/*  =========================================================================
+    cmsweep - Vectorized sweep of the interval ends of a column
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/// cmsweep - Vectorized sweep of the interval ends of a column
+
+#include "cmsweep.h"
+#include <cassert>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CMSWEEP_X86 1
+#include <immintrin.h>
+#endif
+
+// append the indexes of the ends not later than now from index i on, return the new number of indexes
+static size_t s_ended_tail(const uint64_t* ends, size_t i, size_t n, uint64_t now, uint32_t* ended, size_t k)
+{
+    for (; i < n; i++) {
+        if (ends[i] <= now)
+            ended[k++] = uint32_t(i);
+    }
+    return k;
+}
+
+// earliest of the ends from index i on, not later than min
+static uint64_t s_min_tail(const uint64_t* ends, size_t i, size_t n, uint64_t min)
+{
+    for (; i < n; i++)
+        min = ends[i] < min ? ends[i] : min;
+    return min;
+}
+
+// restart the statistics from the k-th of index (from the k-th one if index is NULL) on
+static void s_restart_tail(double* value, double* sum, uint64_t* count, uint64_t* interval_start, uint64_t* ends,
+    const uint32_t* index, size_t k, size_t n, uint64_t start, uint64_t end)
+{
+    for (; k < n; k++) {
+        size_t i = index ? index[k] : k;
+        if (value)
+            value[i] = 0;
+        if (sum)
+            sum[i] = 0;
+        count[i]          = 0;
+        interval_start[i] = start;
+        ends[i]           = end;
+    }
+}
+
+// merge the closed intervals from the k-th one on
+static void s_merge_tail(double* sum, uint64_t* count, const uint32_t* index, const double* closed_sum,
+    const uint64_t* closed_count, size_t k, size_t n)
+{
+    for (; k < n; k++) {
+        if (closed_count[k] == 0)
+            continue;
+        uint32_t i = index[k];
+        sum[i]     = count[i] == 0 ? closed_sum[k] : sum[i] + closed_sum[k];
+        count[i] += closed_count[k];
+    }
+}
+
+// append the indexes of the lanes whose bit is set in mask, lane 0 is the index i
+static size_t s_append_lanes(unsigned mask, size_t i, uint32_t* ended, size_t k)
+{
+    while (mask != 0) {
+        ended[k++] = uint32_t(i + unsigned(__builtin_ctz(mask)));
+        mask &= mask - 1;
+    }
+    return k;
+}
+
+#ifdef CMSWEEP_X86
+// the ends are compared as signed numbers with the highest bit flipped, which keeps the unsigned order
+
+__attribute__((target("avx2"))) static size_t s_ended_avx2(
+    const uint64_t* ends, size_t n, uint64_t now, uint32_t* ended)
+{
+    const __m256i bias  = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i limit = _mm256_xor_si256(_mm256_set1_epi64x(int64_t(now)), bias);
+    size_t        i     = 0;
+    size_t        k     = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x     = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ends + i)), bias);
+        int     later = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, limit)));
+        k             = s_append_lanes(~unsigned(later) & 0xF, i, ended, k);
+    }
+    return s_ended_tail(ends, i, n, now, ended, k);
+}
+
+__attribute__((target("avx2"))) static uint64_t s_min_avx2(const uint64_t* ends, size_t n)
+{
+    const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+    __m256i       min  = _mm256_set1_epi64x(INT64_MAX);
+    size_t        i    = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ends + i)), bias);
+        min       = _mm256_blendv_epi8(min, x, _mm256_cmpgt_epi64(min, x));
+    }
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), _mm256_xor_si256(min, bias));
+    return s_min_tail(ends, i, n, s_min_tail(lanes, 0, 4, UINT64_MAX));
+}
+
+// only the dense restart is vectorized, the indexed one is a scatter, which AVX2 does not have
+__attribute__((target("avx2"))) static void s_restart_avx2(double* value, double* sum, uint64_t* count,
+    uint64_t* interval_start, uint64_t* ends, const uint32_t* index, size_t n, uint64_t start, uint64_t end)
+{
+    size_t k = 0;
+    if (!index) {
+        const __m256d zero   = _mm256_setzero_pd();
+        const __m256i none   = _mm256_setzero_si256();
+        const __m256i vstart = _mm256_set1_epi64x(int64_t(start));
+        const __m256i vend   = _mm256_set1_epi64x(int64_t(end));
+        for (; k + 4 <= n; k += 4) {
+            if (value)
+                _mm256_storeu_pd(value + k, zero);
+            if (sum)
+                _mm256_storeu_pd(sum + k, zero);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(count + k), none);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(interval_start + k), vstart);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(ends + k), vend);
+        }
+    }
+    s_restart_tail(value, sum, count, interval_start, ends, index, k, n, start, end);
+}
+
+// the statistics are gathered and merged by lanes, the lanes are stored one by one (there is no scatter)
+__attribute__((target("avx2"))) static void s_merge_avx2(double* sum, uint64_t* count, const uint32_t* index,
+    const double* closed_sum, const uint64_t* closed_count, size_t n)
+{
+    const __m256i none = _mm256_setzero_si256();
+    const __m256i all  = _mm256_set1_epi64x(-1);
+    size_t        k    = 0;
+    for (; k + 4 <= n; k += 4) {
+        // masked gathers with all the lanes set, so no lane of the result is left undefined
+        __m128i vindex = _mm_loadu_si128(reinterpret_cast<const __m128i*>(index + k));
+        __m256i c      = _mm256_mask_i32gather_epi64(none, reinterpret_cast<const long long*>(count), vindex, all, 8);
+        __m256d s      = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), sum, vindex, _mm256_castsi256_pd(all), 8);
+        __m256i cc     = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(closed_count + k));
+        __m256d cs     = _mm256_loadu_pd(closed_sum + k);
+        __m256d first  = _mm256_castsi256_pd(_mm256_cmpeq_epi64(c, none));
+        __m256d skip   = _mm256_castsi256_pd(_mm256_cmpeq_epi64(cc, none));
+        s              = _mm256_blendv_pd(_mm256_blendv_pd(_mm256_add_pd(s, cs), cs, first), s, skip);
+        c              = _mm256_add_epi64(c, cc);
+
+        alignas(32) double   sums[4];
+        alignas(32) uint64_t counts[4];
+        _mm256_store_pd(sums, s);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(counts), c);
+        for (size_t j = 0; j < 4; j++) {
+            sum[index[k + j]]   = sums[j];
+            count[index[k + j]] = counts[j];
+        }
+    }
+    s_merge_tail(sum, count, index, closed_sum, closed_count, k, n);
+}
+
+__attribute__((target("sse4.2"))) static size_t s_ended_sse42(
+    const uint64_t* ends, size_t n, uint64_t now, uint32_t* ended)
+{
+    const __m128i bias  = _mm_set1_epi64x(INT64_MIN);
+    const __m128i limit = _mm_xor_si128(_mm_set1_epi64x(int64_t(now)), bias);
+    size_t        i     = 0;
+    size_t        k     = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x     = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ends + i)), bias);
+        int     later = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(x, limit)));
+        k             = s_append_lanes(~unsigned(later) & 0x3, i, ended, k);
+    }
+    return s_ended_tail(ends, i, n, now, ended, k);
+}
+
+__attribute__((target("sse4.2"))) static uint64_t s_min_sse42(const uint64_t* ends, size_t n)
+{
+    const __m128i bias = _mm_set1_epi64x(INT64_MIN);
+    __m128i       min  = _mm_set1_epi64x(INT64_MAX);
+    size_t        i    = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ends + i)), bias);
+        min       = _mm_blendv_epi8(min, x, _mm_cmpgt_epi64(min, x));
+    }
+    alignas(16) uint64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), _mm_xor_si128(min, bias));
+    return s_min_tail(ends, i, n, s_min_tail(lanes, 0, 2, UINT64_MAX));
+}
+
+__attribute__((target("sse4.2"))) static void s_restart_sse42(double* value, double* sum, uint64_t* count,
+    uint64_t* interval_start, uint64_t* ends, const uint32_t* index, size_t n, uint64_t start, uint64_t end)
+{
+    size_t k = 0;
+    if (!index) {
+        const __m128d zero   = _mm_setzero_pd();
+        const __m128i none   = _mm_setzero_si128();
+        const __m128i vstart = _mm_set1_epi64x(int64_t(start));
+        const __m128i vend   = _mm_set1_epi64x(int64_t(end));
+        for (; k + 2 <= n; k += 2) {
+            if (value)
+                _mm_storeu_pd(value + k, zero);
+            if (sum)
+                _mm_storeu_pd(sum + k, zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(count + k), none);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(interval_start + k), vstart);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(ends + k), vend);
+        }
+    }
+    s_restart_tail(value, sum, count, interval_start, ends, index, k, n, start, end);
+}
+#endif
+
+// kernels for the instruction set of the CPU
+struct sweep_kernels_t
+{
+    const char* isa;
+    size_t (*ended)(const uint64_t* ends, size_t n, uint64_t now, uint32_t* ended);
+    uint64_t (*min)(const uint64_t* ends, size_t n);
+    void (*restart)(double* value, double* sum, uint64_t* count, uint64_t* interval_start, uint64_t* ends,
+        const uint32_t* index, size_t n, uint64_t start, uint64_t end);
+    // SSE4.2 has no gather, its merge is the scalar one
+    void (*merge)(double* sum, uint64_t* count, const uint32_t* index, const double* closed_sum,
+        const uint64_t* closed_count, size_t n);
+};
+
+// the kernels are chosen once, at the first sweep
+static const sweep_kernels_t& s_kernels()
+{
+    static const sweep_kernels_t kernels = [] {
+#ifdef CMSWEEP_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return sweep_kernels_t{"avx2", s_ended_avx2, s_min_avx2, s_restart_avx2, s_merge_avx2};
+        if (__builtin_cpu_supports("sse4.2"))
+            return sweep_kernels_t{"sse4.2", s_ended_sse42, s_min_sse42, s_restart_sse42, cmsweep_merge_scalar};
+#endif
+        return sweep_kernels_t{
+            "scalar", cmsweep_ended_scalar, cmsweep_min_scalar, cmsweep_restart_scalar, cmsweep_merge_scalar};
+    }();
+    return kernels;
+}
+
+//  --------------------------------------------------------------------------
+//  Write the indexes of the ends not later than now to ended
+
+size_t cmsweep_ended(const uint64_t* ends, size_t n, uint64_t now, uint32_t* ended)
+{
+    assert(ends || n == 0);
+    assert(ended || n == 0);
+    return s_kernels().ended(ends, n, now, ended);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the earliest of the ends
+
+uint64_t cmsweep_min(const uint64_t* ends, size_t n)
+{
+    assert(ends || n == 0);
+    return s_kernels().min(ends, n);
+}
+
+//  --------------------------------------------------------------------------
+//  Restart the statistics at index (all n of them if index is NULL) for the next interval
+
+void cmsweep_restart(double* value, double* sum, uint64_t* count, uint64_t* interval_start, uint64_t* ends,
+    const uint32_t* index, size_t n, uint64_t start, uint64_t end)
+{
+    assert((count && interval_start && ends) || n == 0);
+    s_kernels().restart(value, sum, count, interval_start, ends, index, n, start, end);
+}
+
+//  --------------------------------------------------------------------------
+//  Merge count and sum of n closed intervals to the statistics at index
+
+void cmsweep_merge(double* sum, uint64_t* count, const uint32_t* index, const double* closed_sum,
+    const uint64_t* closed_count, size_t n)
+{
+    assert((sum && count && index && closed_sum && closed_count) || n == 0);
+    s_kernels().merge(sum, count, index, closed_sum, closed_count, n);
+}
+
+//  --------------------------------------------------------------------------
+//  Scalar kernels
+
+size_t cmsweep_ended_scalar(const uint64_t* ends, size_t n, uint64_t now, uint32_t* ended)
+{
+    assert(ends || n == 0);
+    assert(ended || n == 0);
+    return s_ended_tail(ends, 0, n, now, ended, 0);
+}
+
+uint64_t cmsweep_min_scalar(const uint64_t* ends, size_t n)
+{
+    assert(ends || n == 0);
+    return s_min_tail(ends, 0, n, UINT64_MAX);
+}
+
+void cmsweep_restart_scalar(double* value, double* sum, uint64_t* count, uint64_t* interval_start, uint64_t* ends,
+    const uint32_t* index, size_t n, uint64_t start, uint64_t end)
+{
+    assert((count && interval_start && ends) || n == 0);
+    s_restart_tail(value, sum, count, interval_start, ends, index, 0, n, start, end);
+}
+
+void cmsweep_merge_scalar(double* sum, uint64_t* count, const uint32_t* index, const double* closed_sum,
+    const uint64_t* closed_count, size_t n)
+{
+    assert((sum && count && index && closed_sum && closed_count) || n == 0);
+    s_merge_tail(sum, count, index, closed_sum, closed_count, 0, n);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the name of the instruction set of the kernels in use
+
+const char* cmsweep_isa(void)
+{
+    return s_kernels().isa;
+}
@@ -0,0 +1,59 @@
+/*  =========================================================================
+    cmsweep - Vectorized sweep of the interval ends of a column
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+//  Kernels over the dense arrays of the hot state of all statistics of one column (structure of arrays,
+//  one element per member). The rollover visits only the statistics found by the sweep of the interval
+//  ends [s], restarts them and merges the closed intervals to the longer steps at once.
+//  AVX2 or SSE4.2 kernel is chosen once by the CPU the agent runs on, the scalar one is the fallback.
+
+//  Write the indexes of the ends not later than now to ended (room for n indexes)
+//  Return the number of the indexes written, they are in the ascending order
+size_t cmsweep_ended(const uint64_t* ends, size_t n, uint64_t now, uint32_t* ended);
+
+//  Return the earliest of the ends, UINT64_MAX if n is 0
+uint64_t cmsweep_min(const uint64_t* ends, size_t n);
+
+//  Restart the statistics at index (all n of them if index is NULL) for the next interval
+//  Value, sum and count are zeroed, interval starts are set to start and interval ends to end
+//  Value and sum may be NULL, they are kept then
+void cmsweep_restart(double* value, double* sum, uint64_t* count, uint64_t* interval_start, uint64_t* ends,
+    const uint32_t* index, size_t n, uint64_t start, uint64_t end);
+
+//  Merge count and sum of n closed intervals to the statistics at (distinct) index
+//  Sum of the statistic with count 0 is replaced, the closed intervals with count 0 are skipped
+void cmsweep_merge(double* sum, uint64_t* count, const uint32_t* index, const double* closed_sum,
+    const uint64_t* closed_count, size_t n);
+
+//  Scalar kernels, the reference of the vectorized ones
+size_t   cmsweep_ended_scalar(const uint64_t* ends, size_t n, uint64_t now, uint32_t* ended);
+uint64_t cmsweep_min_scalar(const uint64_t* ends, size_t n);
+void     cmsweep_restart_scalar(double* value, double* sum, uint64_t* count, uint64_t* interval_start,
+    uint64_t* ends, const uint32_t* index, size_t n, uint64_t start, uint64_t end);
+void     cmsweep_merge_scalar(double* sum, uint64_t* count, const uint32_t* index, const double* closed_sum,
+    const uint64_t* closed_count, size_t n);
+
+//  Return the name of the instruction set of the kernels in use (avx2, sse4.2, scalar)
+const char* cmsweep_isa(void);
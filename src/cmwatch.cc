@@ -0,0 +1,165 @@
+/*  =========================================================================
+    cmwatch - Changes of the metric files in the shared memory directory
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// cmwatch - Changes of the metric files in the shared memory directory
+
+#include "cmwatch.h"
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dirent.h>
+#include <fty_log.h>
+#include <set>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// compare all the files of the directory with the previous scan
+static int s_scan(cmwatch_t* self, std::set<std::string>& changed)
+{
+    DIR* dir = opendir(self->dir.c_str());
+    if (!dir) {
+        log_error("cmwatch:\tCan't open '%s': %s", self->dir.c_str(), strerror(errno));
+        return -1;
+    }
+
+    std::map<std::string, cmwatch_file_t> files;
+    for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+        if (entry->d_name[0] == '.')
+            continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+            continue;
+
+        cmwatch_file_t file;
+        file.ino      = st.st_ino;
+        file.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        file.size     = st.st_size;
+
+        auto it = self->files.find(entry->d_name);
+        if (it == self->files.end() || it->second.ino != file.ino || it->second.mtime_ns != file.mtime_ns ||
+            it->second.size != file.size)
+            changed.insert(entry->d_name);
+        files.emplace(entry->d_name, file);
+    }
+    closedir(dir);
+
+    // deleted files are forgotten
+    self->files.swap(files);
+    self->scans++;
+    return 0;
+}
+
+// read all pending inotify events, return -1 if the queue overflowed
+static int s_events(cmwatch_t* self, std::set<std::string>& changed)
+{
+    for (;;) {
+        ssize_t r = read(self->fd, &self->buffer[0], self->buffer.size());
+        if (r <= 0)
+            break;
+        for (ssize_t i = 0; i < r;) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(&self->buffer[size_t(i)]);
+            if (event->mask & IN_Q_OVERFLOW)
+                return -1;
+            if (event->len && event->name[0] != '.') {
+                changed.insert(event->name);
+                self->events++;
+            }
+            i += ssize_t(sizeof(struct inotify_event) + event->len);
+        }
+    }
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new cmwatch
+
+cmwatch_t* cmwatch_new(const char* dir, bool inotify)
+{
+    assert(dir);
+
+    struct stat st;
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        log_error("cmwatch:\t'%s' is not a directory", dir);
+        return nullptr;
+    }
+
+    cmwatch_t* self = new cmwatch_t();
+    self->dir       = dir;
+    self->fd        = -1;
+    self->rescan    = true;
+    if (inotify) {
+        self->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (self->fd != -1 && inotify_add_watch(self->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+            close(self->fd);
+            self->fd = -1;
+        }
+        if (self->fd == -1)
+            log_warning("cmwatch:\tinotify not available for '%s' (%s), directory is rescanned", dir, strerror(errno));
+        else
+            self->buffer.resize(64 * (sizeof(struct inotify_event) + NAME_MAX + 1));
+    }
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the cmwatch
+
+void cmwatch_destroy(cmwatch_t** self_p)
+{
+    if (*self_p) {
+        cmwatch_t* self = *self_p;
+        if (self->fd != -1)
+            close(self->fd);
+        delete self;
+        *self_p = nullptr;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Append names of the files changed since the last call to names
+
+int cmwatch_changed(cmwatch_t* self, std::vector<std::string>& names)
+{
+    assert(self);
+
+    std::set<std::string> changed;
+    if (self->fd != -1 && !self->rescan) {
+        if (s_events(self, changed) == -1) {
+            log_warning("cmwatch:\tinotify queue overflow on '%s', directory is rescanned", self->dir.c_str());
+            changed.clear();
+            self->rescan = true;
+        }
+    }
+
+    if (self->fd == -1 || self->rescan) {
+        // events queued up to now are covered by the scan
+        if (self->fd != -1)
+            s_events(self, changed);
+        if (s_scan(self, changed) == -1)
+            return -1;
+        self->rescan = false;
+    }
+
+    names.insert(names.end(), changed.begin(), changed.end());
+    return 0;
+}
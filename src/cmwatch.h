@@ -0,0 +1,61 @@
+/*  =========================================================================
+    cmwatch - Changes of the metric files in the shared memory directory
+
+    Copyright (C) 2016 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+//  Identity of the content of one file
+struct cmwatch_file_t
+{
+    ino_t   ino;      // inode, changed when the file is replaced
+    int64_t mtime_ns; // modification time [ns]
+    off_t   size;     // size [B]
+};
+
+//  Structure of our class
+//  Changes are taken from inotify, the directory is rescanned and the files are compared
+//  with the previous scan only when inotify is not available or its queue overflowed
+struct cmwatch_t
+{
+    std::string                           dir;    // watched directory
+    int                                   fd;     // inotify descriptor, -1 if not available
+    bool                                  rescan; // next call has to scan the whole directory
+    std::map<std::string, cmwatch_file_t> files;  // files of the last scan
+    std::string                           buffer; // buffer for inotify events
+    uint64_t                              scans;  // number of full scans of the directory
+    uint64_t                              events; // number of files reported by inotify
+};
+
+//  Create a new cmwatch of the directory, inotify is used if it is true and available
+//  Return NULL if the directory does not exist
+cmwatch_t* cmwatch_new(const char* dir, bool inotify);
+
+//  Destroy the cmwatch
+void cmwatch_destroy(cmwatch_t** self_p);
+
+//  Append names of the files created or modified since the last call to names,
+//  every name is appended once, the first call returns all files of the directory
+//  Return -1 if the directory can't be read
+int cmwatch_changed(cmwatch_t* self, std::vector<std::string>& names);
@@ -22,26 +22,78 @@
 /// fty_mc_server - Computation server implementation
 
 #include "fty_mc_server.h"
+#include "cmcheckpoint.h"
+#include "cmpool.h"
+#include "cmpublish.h"
+#include "cmreactor.h"
+#include "cmreceiver.h"
+#include "cmrules.h"
+#include "cmselector.h"
+#include "cmshards.h"
 #include "cmstats.h"
 #include "cmsteps.h"
+#include "cmwatch.h"
+#include <algorithm>
 #include <cmath>
+#include <ctime>
 #include <fty_log.h>
 #include <fty_shm.h>
 #include <malamute.h>
-#include <mutex>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
-std::mutex g_cm_mutex;
+// Default number of delta checkpoints between full ones
+#define CM_CHECKPOINT_COMPACT 96
+
+// Number of received samples waiting for the computation, newer metrics are dropped above it
+#define CM_QUEUE_CAPACITY 65536
 
 // TODO: move to class sometime
 // It is a "CM" entity
 typedef struct _cm_t
 {
     char*         name;     // server name
-    cmstats_t*    stats;    // computed statictics for all types and steps
+    cmshards_t*   stats;    // computed statictics for all types and steps
+    size_t        nshards;  // number of shards of stats
+    size_t        nworkers; // number of workers handling the shm pull, 0 means one per shard
     cmsteps_t*    steps;    // info about supported steps
     zlist_t*      types;    // info about supported statistic types (min, max, avg)
     mlm_client_t* client;   // malamute client
+    cmreceiver_t* receiver; // thread receiving and decoding the messages of client
+    uint64_t      dropped;  // number of dropped samples already reported
     char*         filename; // state file name
+    zlist_t*      published;        // statistics ready to be published, reused for every metric
+    zlist_t*      deleted;          // names of deleted assets waiting to be dropped from stats at once
+    std::string   shm_dir;          // shm directory watched for changed metrics, empty means all metrics are read
+    cmselector_t* selector;         // quantities of the metrics to compute
+    uint32_t      selector_version; // incremented with every new selector, never 0
+    cmrules_t*    rules;            // statistics allowed per sender or series
+
+    cmpublish_t* publish;      // statistics of ended intervals written to shm in batches
+    uint64_t     smoothing_ms; // window the statistics of one batch are written over, 0 means at once
+
+    // all events are handled by the reactor of the actor thread, so the configuration is never
+    // changed while it is used, statistics are protected by the locks of their shards
+    cmreactor_t* reactor;         // event loop of the actor
+    int          rollover_timer;  // end of the interval of the shortest step (gcd of steps)
+    int          pull_timer;      // next pull of the metrics from shm
+    int          smoothing_timer; // next write of the statistics spread over the smoothing window
+    cmpool_t*    pool;            // workers handling the shm pull, created by the first pull
+    cmwatch_t*   watch;           // changes of the watched shm directory, NULL if not watched
+    std::string  watch_dir;       // directory of watch
+    std::thread  puller;          // thread of the running shm pull, not joinable if none
+    int          pulled;          // eventfd signalled by puller when the pull ended
+
+    cmcheckpoint_t* checkpoint;         // writer of the state, created with the first save
+    bool            checkpoint_async;   // do not wait until the state is written
+    bool            checkpoint_fsync;   // fsync the state file before it replaces the previous one
+    uint32_t        checkpoint_compact; // number of delta checkpoints between full ones
+
+    std::vector<uint32_t> columns; // columns of stats for all steps and types, restricted by rules
+
+    std::vector<std::pair<size_t, cmqueue_sample_t>> samples; // received metrics with their shard, reused
 } cm_t;
 
 /// Destroy the "CM" entity
@@ -51,15 +103,29 @@ void cm_destroy(cm_t** self_p)
         cm_t* self = *self_p;
 
         // free structure items
+        cmcheckpoint_destroy(&self->checkpoint);
+        if (self->puller.joinable())
+            self->puller.join();
+        if (self->pulled != -1)
+            close(self->pulled);
+        cmwatch_destroy(&self->watch);
+        cmpool_destroy(&self->pool);
+        cmreactor_destroy(&self->reactor);
+        cmreceiver_destroy(&self->receiver);
         mlm_client_destroy(&self->client);
         zlist_destroy(&self->types);
+        zlist_destroy(&self->published);
+        cmpublish_destroy(&self->publish);
+        zlist_destroy(&self->deleted);
+        cmselector_destroy(&self->selector);
+        cmrules_destroy(&self->rules);
         cmsteps_destroy(&self->steps);
-        cmstats_destroy(&self->stats);
+        cmshards_destroy(&self->stats);
         zstr_free(&self->name);
         zstr_free(&self->filename);
 
         // free structure itself
-        free(self);
+        delete self;
         *self_p = nullptr;
     }
 }
@@ -68,372 +134,731 @@ void cm_destroy(cm_t** self_p)
 cm_t* cm_new(const char* name)
 {
     assert(name);
-    cm_t* self = reinterpret_cast<cm_t*>(zmalloc(sizeof(cm_t)));
+    cm_t* self = new cm_t();
     if (self) {
-        self->name = strdup(name);
-        if (self->name)
-            self->stats = cmstats_new();
+        self->checkpoint_compact = CM_CHECKPOINT_COMPACT;
+        self->pulled  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        self->name    = strdup(name);
+        self->nshards = std::max(std::thread::hardware_concurrency(), 1u);
+        if (self->name && self->pulled != -1)
+            self->stats = cmshards_new(self->nshards);
         if (self->stats)
             self->steps = cmsteps_new();
         if (self->steps)
             self->types = zlist_new();
         if (self->types)
+            self->published = zlist_new();
+        if (self->published)
+            self->publish = cmpublish_new(0);
+        if (self->publish)
+            self->deleted = zlist_new();
+        if (self->deleted)
+            self->selector = cmselector_new(CMSELECTOR_INCLUDE, CMSELECTOR_EXCLUDE);
+        if (self->selector) {
+            self->selector_version = 1;
+            self->rules            = cmrules_new();
+        }
+        if (self->rules) {
+            cmrules_add_defaults(self->rules);
+            self->reactor = cmreactor_new();
+        }
+        if (self->reactor)
             self->client = mlm_client_new();
         if (self->client)
+            self->receiver = cmreceiver_new(name, self->client, CM_QUEUE_CAPACITY);
+        if (self->receiver) {
             zlist_autofree(self->types);
-        else
+            zlist_comparefn(self->types, reinterpret_cast<zlist_compare_fn*>(strcmp));
+            zlist_autofree(self->deleted);
+        } else
             cm_destroy(&self);
     }
     return self;
 }
 
-void s_handle_metric(fty_proto_t* bmsg, cm_t* self, bool shm)
+/// Save the state - snapshot is taken here and written by background writer,
+/// in sync mode we wait until it is written
+static void s_save(cm_t* self)
+{
+    if (!self->filename)
+        return;
+
+    if (!self->checkpoint)
+        self->checkpoint = cmcheckpoint_new(self->filename, self->checkpoint_fsync, self->checkpoint_compact);
+    cmcheckpoint_request(self->checkpoint, self->stats);
+    log_debug("%s:\tsnapshot of state taken in %" PRIu64 "us", self->name, cmcheckpoint_info(self->checkpoint).encode_us);
+    if (!self->checkpoint_async)
+        cmcheckpoint_wait(self->checkpoint);
+}
+
+// Maximal number of deleted assets collected before they are dropped from stats
+#define CM_DELETED_BATCH 1024
+
+/// Drop all computations on the collected deleted assets
+static void s_flush_deleted(cm_t* self)
+{
+    if (zlist_size(self->deleted) == 0)
+        return;
+    log_debug("%s:\tdropping computations on %zu deleted assets", self->name, zlist_size(self->deleted));
+    cmshards_delete_assets(self->stats, self->deleted);
+    zlist_purge(self->deleted);
+}
+
+/// Return the value of the metric from shm in value_p, false if the metric is invalid
+static bool s_metric_value(cm_t* self, fty_proto_t* bmsg, double* value_p)
 {
     // get rid of messages with empty or null name
     if (fty_proto_name(bmsg) == nullptr || streq(fty_proto_name(bmsg), "")) {
-        if (shm) {
-            log_warning("%s: invalid \'name\' = (%s), \tfrom shm", self->name,
-                fty_proto_name(bmsg) ? fty_proto_name(bmsg) : "null");
-        } else {
-            log_warning("%s: invalid \'name\' = (%s), \tsubject=%s, sender=%s", self->name,
-                fty_proto_name(bmsg) ? fty_proto_name(bmsg) : "null", mlm_client_subject(self->client),
-                mlm_client_sender(self->client));
-        }
+        log_warning("%s: invalid \'name\' = (%s), \tfrom shm", self->name,
+            fty_proto_name(bmsg) ? fty_proto_name(bmsg) : "null");
+        return false;
+    }
+
+    // value is parsed only here, statistics get the double
+    // sometimes we do have nan in values, report if we get something like that
+    if (!cmstats_parse_value(fty_proto_value(bmsg), value_p)) {
+        log_warning("%s:\tisnan ('%s') from shm", self->name, fty_proto_value(bmsg) ? fty_proto_value(bmsg) : "null");
+        return false;
+    }
+    return true;
+}
+
+/// Update statistics of the series of the metric in stats, the caller holds the lock of stats
+/// rule is the rule of the sender of the metric, -1 if none, then the rule of the series applies
+static void s_update_series(cm_t* self, cmstats_t* stats, const char* quantity, const char* asset, const char* unit,
+    uint64_t time, double value, int32_t rule, zlist_t* published)
+{
+    uint32_t series = cmstats_series(stats, quantity, asset);
+    if (rule == -1)
+        rule = cmrules_series(self->rules, stats, series);
+
+    // policy of the quantity, e.g. consumption is computed only for realpower
+    const std::vector<uint32_t>* columns = rule == -1 ? &self->columns : &self->rules->rules[size_t(rule)].columns;
+    if (columns->empty()) {
+        log_trace("%s: %s@%s metric excluded from computation", self->name, quantity, asset);
         return;
     }
 
-    // PQSWMBT-3723: do not compute/agregate min/max/mean + average metrics for sensor temp. and humidity
-    // as: 'temperature.default@sensor-xxx', 'humidity.default@sensor-xxx'
-    {
-        const char* name = fty_proto_name(bmsg);
-        const char* type = fty_proto_type(bmsg);              // aka quantity
-        if (name && type && (strstr(name, "sensor-") == name) // starts with
-            && (streq(type, "temperature.default") || streq(type, "humidity.default"))) {
-            log_trace("%s: %s@%s metric excluded from computation", self->name, type, name);
-            return;
-        }
+    // series is resolved only once and all its statistics are updated in one pass
+    cmstats_series_update(stats, series, columns->data(), columns->size(), value, time, unit, published);
+}
+
+/// Publish the statistics of ended intervals collected in the batch at once
+/// what names the origin of the batch in the log
+static void s_publish(cm_t* self, const char* what)
+{
+    cmpublish_info_t info;
+    size_t           size = cmpublish_flush(self->publish, &info);
+
+    // the rest of the batch spread over the smoothing window is written later
+    int64_t next_ms = cmpublish_next(self->publish);
+    if (next_ms == -1)
+        cmreactor_timer_stop(self->reactor, self->smoothing_timer);
+    else
+        cmreactor_timer_set(self->reactor, self->smoothing_timer, uint64_t(next_ms), false);
+
+    if (size == 0)
+        return;
+    // batch spread over the smoothing window is reported once it is written completely
+    if (info.backlog != 0) {
+        log_debug("%s:\t%s published=%" PRIu64 " statistics, backlog=%" PRIu64, self->name, what, info.size,
+            info.backlog);
+        return;
     }
-    // end PQSWMBT-3723
+    log_info("%s:\t%s published=%" PRIu64 " statistics, total errors=%" PRIu64 ", writers=%zu, latency=%" PRIu64
+             "ms, largest burst=%" PRIu64,
+        self->name, what, info.size, info.errors, cmpublish_writers(self->publish), info.duration_ms,
+        info.max_size);
+}
 
-    // sometimes we do have nan in values, report if we get something like that on METRICS
-    double value = atof(fty_proto_value(bmsg));
-    if (std::isnan(value)) {
-        if (shm) {
-            log_warning("%s:\tisnan ('%s') from shm", self->name, fty_proto_value(bmsg));
-        } else {
-            log_warning("%s:\tisnan ('%lf'), subject='%s', sender='%s'", self->name, value,
-                mlm_client_subject(self->client), mlm_client_sender(self->client));
+/// Return true if statistics of the received metric are computed, the decision is cached in its series
+static bool s_sample_selected(cm_t* self, cmqueue_series_t* series)
+{
+    // rule of the sender is cached in the series until the rules change
+    if (series->rules_version != self->rules->version) {
+        series->rule          = cmrules_sender(self->rules, series->sender.c_str());
+        series->rules_version = self->rules->version;
+    }
+    if (series->selector_version != self->selector_version) {
+        series->selected         = cmselector_match(self->selector, series->quantity.c_str());
+        series->selector_version = self->selector_version;
+    }
+    // metrics of senders without statistics (e.g. linuxmetrics) are ignored
+    return series->selected && !cmrules_drop(self->rules, series->rule);
+}
+
+/// Update statistics with the batch of received metrics, statistics of ended intervals are collected in published
+/// Batch is sorted by shards (metrics of one series keep their order), every shard is locked once
+static void s_handle_stream(cm_t* self, std::vector<std::pair<size_t, cmqueue_sample_t>>& batch, zlist_t* published)
+{
+    std::stable_sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    for (size_t i = 0; i < batch.size();) {
+        size_t                      index = batch[i].first;
+        cmshard_t*                  shard = self->stats->shards[index];
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        for (; i < batch.size() && batch[i].first == index; i++) {
+            const cmqueue_sample_t& sample = batch[i].second;
+            cmqueue_series_t*       series = sample.series;
+            s_update_series(self, shard->stats, series->quantity.c_str(), series->asset.c_str(),
+                series->unit.c_str(), sample.time, sample.value, series->rule, published);
         }
-        return;
     }
+    batch.clear();
+}
 
-    const char *quantity = fty_proto_type(bmsg);
+/// Update statistics with the batch of metrics from shm, statistics of ended intervals are appended to publish
+/// Batch is partitioned by shards, each worker handles its own shards, every shard is locked once
+static void s_handle_batch(cm_t* self, cmpool_t* pool, std::vector<fty_proto_t*>& batch)
+{
+    int64_t start_ms = zclock_mono();
+
+    std::vector<std::vector<fty_proto_t*>> parts(cmshards_size(self->stats));
+    for (fty_proto_t* bmsg : batch)
+        parts[cmshards_index(self->stats, fty_proto_name(bmsg))].push_back(bmsg);
+
+    size_t nworkers = cmpool_size(pool);
+    cmpool_run(pool, [self, &parts, nworkers](size_t worker) {
+        zlist_t* published = zlist_new();
+        for (size_t i = worker; i < parts.size(); i += nworkers) {
+            if (parts[i].empty())
+                continue;
+            cmshard_t*                  shard = self->stats->shards[i];
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            for (fty_proto_t* bmsg : parts[i]) {
+                double value;
+                if (s_metric_value(self, bmsg, &value))
+                    s_update_series(self, shard->stats, fty_proto_type(bmsg), fty_proto_name(bmsg),
+                        fty_proto_unit(bmsg), fty_proto_time(bmsg), value, -1, published);
+            }
+        }
+        // published out of the lock of the shard
+        cmpublish_append(self->publish, published);
+        zlist_destroy(&published);
+    });
+
+    log_info("%s:\tshm pull batch=%zu metrics, shards=%zu, workers=%zu, latency=%" PRIi64 "ms", self->name,
+        batch.size(), parts.size(), nworkers, zclock_mono() - start_ms);
+}
+
+// (re)compute the columns of stats for all configured steps and types
+static void s_update_columns(cm_t* self)
+{
+    self->columns.clear();
     for (uint32_t* step_p = cmsteps_first(self->steps); step_p != nullptr; step_p = cmsteps_next(self->steps)) {
+        const char* step = reinterpret_cast<const char*>(cmsteps_cursor(self->steps));
         for (const char* type = reinterpret_cast<const char*>(zlist_first(self->types)); type != nullptr;
-                         type = reinterpret_cast<const char*>(zlist_next(self->types))) {
-            // If consumption calculation, filter data which is not realpower
-            if (type && quantity && streq(type, "consumption") && !streq(quantity, "realpower.default")) {
+             type             = reinterpret_cast<const char*>(zlist_next(self->types))) {
+            int column = cmshards_column(self->stats, type, step, *step_p);
+            if (column == -1) {
+                log_warning("%s:\tUnsupported type '%s' for step '%s', ignoring", self->name, type, step);
                 continue;
             }
-            const char* step = reinterpret_cast<const char*>(cmsteps_cursor(self->steps));
-            fty_proto_t* stat_msg = cmstats_put(self->stats, type, step, *step_p, bmsg);
-            if (stat_msg) {
-                char* subject = zsys_sprintf("%s@%s", fty_proto_type(stat_msg), fty_proto_name(stat_msg));
-                assert(subject);
-
-                int r = fty::shm::write_metric(stat_msg);
-                if (r == -1) {
-                    log_error("%s:\tCannot publish statistics", self->name);
-                }
-                fty_proto_destroy(&stat_msg);
-                zstr_free(&subject);
-            }
+            self->columns.push_back(uint32_t(column));
         }
     }
+    // keep the columns ordered, so the accumulators are updated sequentially
+    std::sort(self->columns.begin(), self->columns.end());
+    // all shards have the same columns
+    cmrules_columns(self->rules, self->stats->shards[0]->stats, self->columns);
 }
 
 
-void fty_metric_compute_metric_pull(zsock_t* pipe, void* args)
+/// Read the metrics changed since the last pull into batch, metrics are owned by the caller
+/// fty-shm stores every metric in its own file named <asset>@<quantity>
+/// Return -1 if the changes are not known, all metrics must be read then
+static int s_read_changed(cmwatch_t* watch, cmselector_t* selector, std::vector<fty_proto_t*>& batch)
 {
-    zpoller_t* poller = zpoller_new(pipe, nullptr);
-    zsock_signal(pipe, 0);
+    std::vector<std::string> names;
+    if (cmwatch_changed(watch, names) == -1)
+        return -1;
 
-    cm_t*    self    = reinterpret_cast<cm_t*>(args);
-    uint64_t timeout = uint64_t(fty_get_polling_interval() * 1000);
-    while (!zsys_interrupted) {
-        void* which = zpoller_wait(poller, int(timeout));
-        if (which == nullptr) {
-            if (zpoller_terminated(poller) || zsys_interrupted) {
-                break;
-            }
-            if (zpoller_expired(poller)) {
-                fty::shm::shmMetrics result;
-                // All metrics realpower.default or temperature, or humidity who are not already produce by metric
-                // compute
-                const std::string pattern =
-                    "(^realpower\\.default"
-                    "|^power\\.default"
-                    "|current\\.(output|input)\\.L(1|2|3)"
-                    "|voltage\\.(output|input)\\.L(1|2|3)-N"
-                    "|voltage\\.input\\.(1|2)"  // For ATS only
-                    "|.*temperature|.*humidity)"
-                    "((?!_arithmetic_mean|_max_|_min_|_consumption_).)*";
-                fty::shm::read_metrics(".*", pattern, result);
-                log_debug("number of metrics reads : %d", result.size());
-                for (auto& element : result) {
-                    g_cm_mutex.lock();
-                    s_handle_metric(element, self, true);
-                    g_cm_mutex.unlock();
-                }
-            }
-        } else if (which == pipe) {
-            zmsg_t* message = zmsg_recv(pipe);
-            if (message) {
-                char* cmd = zmsg_popstr(message);
-                if (cmd) {
-                    if (streq(cmd, "$TERM")) {
-                        zstr_free(&cmd);
-                        zmsg_destroy(&message);
-                        break;
-                    }
-                    zstr_free(&cmd);
-                }
-                zmsg_destroy(&message);
-            }
-        }
-        timeout = uint64_t(fty_get_polling_interval() * 1000);
+    for (const std::string& name : names) {
+        size_t at = name.find('@');
+        if (at == std::string::npos || !cmselector_match(selector, name.c_str() + at + 1))
+            continue;
+        // expired metrics are not read
+        fty_proto_t* metric = nullptr;
+        if (fty::shm::read_metric(name.substr(0, at), name.substr(at + 1), &metric) == 0 && metric)
+            batch.push_back(metric);
     }
-    zpoller_destroy(&poller);
+    log_debug("number of changed metrics : %zu of %zu files", batch.size(), names.size());
+    return 0;
 }
 
-//  --------------------------------------------------------------------------
-//  fty_mc_server actor
-
-void fty_mc_server(zsock_t* pipe, void* args)
+/// Pull the metrics from shm and update statistics with them, body of puller
+/// The reactor handles the commands only when no pull runs, so the configuration is not changed meanwhile
+static void s_pull(cm_t* self)
 {
+    if (self->shm_dir != self->watch_dir) {
+        // the first call of the new watch returns all metrics
+        cmwatch_destroy(&self->watch);
+        self->watch_dir = self->shm_dir;
+        if (!self->watch_dir.empty())
+            self->watch = cmwatch_new(self->watch_dir.c_str(), true);
+    }
 
-    cm_t* self = cm_new(reinterpret_cast<const char*>(args));
+    // only changed metrics are read if they are known, all metrics otherwise
+    fty::shm::shmMetrics      result;
+    std::vector<fty_proto_t*> batch;
+    bool changed = self->watch && s_read_changed(self->watch, self->selector, batch) == 0;
+    if (!changed) {
+        // the shm directory is not known without the watch, so the files are selected by fty-shm by the regex
+        // of the selector - it is left as is, reading all files to decide them by cmselector_match costs more
+        fty::shm::read_metrics(".*", cmselector_regex(self->selector), result);
+        log_debug("number of metrics reads : %zu", result.size());
+        batch.assign(result.begin(), result.end());
+    }
 
-    zpoller_t* poller = zpoller_new(pipe, mlm_client_msgpipe(self->client), nullptr);
+    size_t nworkers = self->nworkers ? self->nworkers : cmshards_size(self->stats);
+    if (!self->pool || cmpool_size(self->pool) != nworkers) {
+        cmpool_destroy(&self->pool);
+        self->pool = cmpool_new(nworkers);
+    }
+    s_handle_batch(self, self->pool, batch);
+    if (changed) {
+        for (fty_proto_t* metric : batch)
+            fty_proto_destroy(&metric);
+    }
 
-    // do not forget to send a signal to actor :)
-    zsock_signal(pipe, 0);
+    uint64_t one = 1;
+    if (write(self->pulled, &one, sizeof(one)) != sizeof(one))
+        log_error("%s:\tcannot signal eventfd: %s", self->name, strerror(errno));
+}
 
-    zactor_t* metric_pull;
-    // Time in [ms] when last cmstats_poll was called
-    // -1 means it was never called yet
-    int64_t last_poll_ms = -1;
-    while (!zsys_interrupted) {
-        // What time left before publishing?
-        // If steps where not defined ( cmsteps_gcd == 0 ) then nothing to publish,
-        // so, we can wait forever (-1) for first message to come
-        // in [ms]
-        g_cm_mutex.lock();
-        int interval_ms = -1;
-        if (cmsteps_gcd(self->steps) != 0) {
-            // So, some steps where defined
-
-            // What is the "now" time in [s]
-            int64_t now_s = zclock_time() / 1000;
-
-            // Compute the left border of the interval:
-            // length_of_the_minimal_interval - part_of_interval_already_passed
-            interval_ms = int(cmsteps_gcd(self->steps) - (now_s % cmsteps_gcd(self->steps))) * 1000;
-
-            log_debug("%s:\tnow=%" PRIu64 "s, cmsteps_gcd=%" PRIu32 "s, interval=%dms", self->name, now_s,
-                cmsteps_gcd(self->steps), interval_ms);
-        }
-        g_cm_mutex.unlock();
-
-        // wait for interval left
-        void* which = zpoller_wait(poller, interval_ms);
-
-        if (!which && zpoller_terminated(poller))
-            break;
-
-        // poll when zpoller expired
-        // the second condition necessary
-        //
-        //  X2 is an expected moment when some metrics should be published
-        //  in t=X1 message comes, its processing takes time and cycle will begin from the beginning
-        //  at moment X4, but in X3 some message had already come -> so zpoller_expired(poller) == false
-        //
-        // -NOW----X1------X2---X3--X4-----
-        g_cm_mutex.lock();
-        if ((!which && zpoller_expired(poller)) ||
-            (last_poll_ms > 0 && ((zclock_time() - last_poll_ms) > cmsteps_gcd(self->steps) * 1000))) {
-
-
-            if (zpoller_expired(poller))
-                log_debug("%s:\tzpoller_expired, calling cmstats_poll", self->name);
-            else
-                log_debug("%s:\ttime (not zpoller) expired, calling cmstats_poll", self->name);
-
-            // Publish metrics and reset the computation where needed
-            cmstats_poll(self->stats);
-            // State is saved every time, when something is published
-            // Something is published every "steps_gcd" interval
-            // In the most of the cases (steps_gcd = "minimal_interval")
-            if (self->filename) {
-                int r = cmstats_save(self->stats, self->filename);
-                if (r == -1)
-                    log_error("%s:\tFailed to save %s: %s", self->name, self->filename, strerror(errno));
-                else
-                    log_info("%s:\t'%s' saved succesfully", self->name, self->filename);
-            }
-            // Record the time, when something was published last time
-            last_poll_ms = zclock_time();
-            // if poller expired, we can continue in order to wait for new message
-            if (!which && zpoller_expired(poller)) {
-                g_cm_mutex.unlock();
-                continue;
-            }
-            // else if poller not expired, we need to process the message!!
-        }
+/// Finish the pull - wait for puller, publish the statistics of all workers together and arm the next pull
+/// Nothing is done if no pull runs
+static void s_pull_end(cm_t* self)
+{
+    if (!self->puller.joinable())
+        return;
+    self->puller.join();
+    uint64_t count;
+    if (read(self->pulled, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        log_error("%s:\tcannot read eventfd: %s", self->name, strerror(errno));
+    s_publish(self, "shm pull");
+    cmreactor_timer_set(self->reactor, self->pull_timer, uint64_t(fty_get_polling_interval() * 1000), false);
+}
 
-        if (which == pipe) {
-            zmsg_t* msg     = zmsg_recv(pipe);
-            char*   command = zmsg_popstr(msg);
+/// Arm the rollover timer to the end of the current interval of the shortest step,
+/// intervals of all steps are aligned, so it is the next multiple of the gcd of steps
+/// Nothing is published if steps were not defined (cmsteps_gcd == 0)
+static void s_arm_rollover(cm_t* self)
+{
+    uint64_t gcd = cmsteps_gcd(self->steps);
+    if (gcd == 0) {
+        cmreactor_timer_stop(self->reactor, self->rollover_timer);
+        return;
+    }
+    uint64_t now_s = uint64_t(zclock_time()) / 1000;
+    uint64_t end_s = (now_s / gcd + 1) * gcd;
+    log_debug("%s:\tnow=%" PRIu64 "s, cmsteps_gcd=%" PRIu64 "s, next rollover=%" PRIu64 "s", self->name, now_s, gcd,
+        end_s);
+    cmreactor_timer_set(self->reactor, self->rollover_timer, end_s * 1000, true);
+}
 
-            log_debug("%s:\tAPI command=%s", self->name, command);
+/// Publish statistics and reset the computation where needed
+/// Rollover timer is ready at the end of the interval even if a message was being handled,
+/// so no poll is missed
+static int s_on_rollover(cm_t* self)
+{
+    s_flush_deleted(self);
+    cmshards_poll(self->stats, self->published);
+    // all statistics closed at once (e.g. at the top of the hour) are written together
+    cmpublish_append(self->publish, self->published);
+    s_publish(self, "poll");
+    // samples are dropped only when the computation is late, so it is reported
+    cmqueue_info_t queue = cmqueue_info(self->receiver->queue);
+    if (queue.dropped != self->dropped)
+        log_warning("%s:\treceived samples=%" PRIu64 ", dropped=%" PRIu64 ", queue depth=%" PRIu64
+                    ", max depth=%" PRIu64,
+            self->name, queue.pushed, queue.dropped - self->dropped, queue.depth, queue.max_depth);
+    else
+        log_debug("%s:\treceived samples=%" PRIu64 ", queue depth=%" PRIu64 ", max depth=%" PRIu64, self->name,
+            queue.pushed, queue.depth, queue.max_depth);
+    self->dropped = queue.dropped;
+    // State is saved every time, when something is published
+    // Something is published every "steps_gcd" interval
+    // In async mode only the snapshot is taken here, it is written by background writer
+    s_save(self);
+    // the deadline is recomputed also when the clock was set
+    s_arm_rollover(self);
+    return 0;
+}
 
-            if (streq(command, "$TERM")) {
-                g_cm_mutex.unlock();
-                log_info("Got $TERM");
-                zstr_free(&command);
-                zmsg_destroy(&msg);
-                break;
-            } else if (streq(command, "DIR")) {
-                char*    dir   = zmsg_popstr(msg);
-                zfile_t* f     = zfile_new(dir, "state.zpl");
-                self->filename = strdup(zfile_filename(f, nullptr));
-
-                if (zfile_exists(self->filename)) {
-                    cmstats_t* foo = cmstats_load(self->filename);
-                    if (!foo)
-                        log_error("%s:\tFailed to load '%s'", self->name, self->filename);
-                    else {
-                        log_info("%s:\tLoaded '%s'", self->name, self->filename);
-                        cmstats_destroy(&self->stats);
-                        self->stats = foo;
-                    }
-                } else {
-                    log_info("%s:\tState file '%s' doesn't exists", self->name, self->filename);
-                }
+/// Start the pull of the metrics from shm by puller, so the reactor keeps handling the rollover and
+/// the received samples meanwhile, the next pull is after the polling interval since the end of this one
+static int s_on_pull(cm_t* self)
+{
+    if (!self->puller.joinable())
+        self->puller = std::thread(s_pull, self);
+    return 0;
+}
 
-                zfile_destroy(&f);
-                zstr_free(&dir);
-            } else if (streq(command, "PRODUCER")) {
-                char* stream = zmsg_popstr(msg);
-                int   r      = mlm_client_set_producer(self->client, stream);
-                if (r == -1)
-                    log_error("%s:\tCan't set producer on stream '%s'", self->name, stream);
-                zstr_free(&stream);
-            } else if (streq(command, "CONSUMER")) {
-                char* stream  = zmsg_popstr(msg);
-                char* pattern = zmsg_popstr(msg);
-                int   rv      = mlm_client_set_consumer(self->client, stream, pattern);
-                if (rv == -1)
-                    log_error("%s:\tCan't set consumer on stream '%s', '%s'", self->name, stream, pattern);
-                zstr_free(&pattern);
-                zstr_free(&stream);
-            } else if (streq(command, "CREATE_PULL")) {
-                metric_pull = zactor_new(fty_metric_compute_metric_pull, self);
-            } else if (streq(command, "CONNECT")) {
-                char* endpoint = zmsg_popstr(msg);
-                if (!endpoint)
-                    log_error("%s:\tMissing endpoint", self->name);
-                else {
-                    int r = mlm_client_connect(self->client, endpoint, 5000, self->name);
-                    if (r == -1)
-                        log_error("%s:\tConnection to endpoint '%s' failed", self->name, endpoint);
-                }
-                zstr_free(&endpoint);
-            } else if (streq(command, "STEPS")) {
-                for (;;) {
-                    char* foo = zmsg_popstr(msg);
-                    if (!foo)
-                        break;
-                    int r = cmsteps_put(self->steps, foo);
-                    if (r == -1)
-                        log_info("%s:\tIgnoring unrecognized step='%s'", self->name, foo);
-                    zstr_free(&foo);
-                }
-            } else if (streq(command, "TYPES")) {
-                for (;;) {
-                    char* foo = zmsg_popstr(msg);
-                    // TODO: may be we need some check here for supported types
-                    if (!foo)
-                        break;
-                    zlist_append(self->types, foo);
-                    zstr_free(&foo);
-                }
-            } else
-                log_warning("%s:\tUnkown API command=%s, ignoring", self->name, command);
+/// Clamp the smoothing window below the shortest step (gcd of steps), so every statistic is written
+/// before the next one of its series is closed
+static void s_clamp_smoothing(cm_t* self)
+{
+    uint64_t gcd_ms = uint64_t(cmsteps_gcd(self->steps)) * 1000;
+    if (gcd_ms == 0 || self->smoothing_ms < gcd_ms)
+        return;
+    log_warning("%s:\tsmoothing window %" PRIu64 "ms clamped to half of the shortest step %" PRIu64 "ms",
+        self->name, self->smoothing_ms, gcd_ms);
+    self->smoothing_ms = gcd_ms / 2;
+    cmpublish_set_window(self->publish, self->smoothing_ms);
+}
 
-            zstr_free(&command);
-            zmsg_destroy(&msg);
-            g_cm_mutex.unlock();
-            continue;
-        } // end of comand pipe processing
+/// Handle the command of the actor pipe, msg is destroyed
+/// Return -1 if the actor has to end
+static int s_handle_command(cm_t* self, zmsg_t* msg)
+{
+    char* command = zmsg_popstr(msg);
+    if (!command) {
+        zmsg_destroy(&msg);
+        return 0;
+    }
 
-        zmsg_t* msg = mlm_client_recv(self->client);
-        if (!msg) {
-            log_error("%s:\tmlm_client_recv() == nullptr", self->name);
-            g_cm_mutex.unlock();
-            continue;
+    log_debug("%s:\tAPI command=%s", self->name, command);
+    // the running pull uses the configuration
+    s_pull_end(self);
+
+    if (streq(command, "$TERM")) {
+        log_info("Got $TERM");
+        zstr_free(&command);
+        zmsg_destroy(&msg);
+        return -1;
+    } else if (streq(command, "DIR")) {
+        char*    dir    = zmsg_popstr(msg);
+        zfile_t* f      = zfile_new(dir, "state.bin");
+        zfile_t* legacy = zfile_new(dir, "state.zpl");
+        // checkpoints of the previous state file are finished first
+        cmcheckpoint_destroy(&self->checkpoint);
+        zstr_free(&self->filename);
+        self->filename = strdup(zfile_filename(f, nullptr));
+
+        // legacy zpl state is read only once, then it is replaced by the binary one
+        const char* filename = self->filename;
+        if (!zfile_exists(filename) && zfile_exists(zfile_filename(legacy, nullptr)))
+            filename = zfile_filename(legacy, nullptr);
+
+        if (zfile_exists(filename)) {
+            cmshards_t* foo = cmshards_load(filename, self->nshards);
+            if (!foo)
+                log_error("%s:\tFailed to load '%s'", self->name, filename);
+            else {
+                log_info("%s:\tLoaded '%s'", self->name, filename);
+                cmshards_destroy(&self->stats);
+                self->stats = foo;
+                s_update_columns(self);
+
+                if (filename != self->filename) {
+                    if (cmshards_save(self->stats, self->filename) == 0) {
+                        log_info("%s:\tMigrated '%s' to '%s'", self->name, filename, self->filename);
+                        zfile_remove(legacy);
+                    } else
+                        log_error("%s:\tFailed to save %s: %s", self->name, self->filename, strerror(errno));
+                }
+            }
+        } else {
+            log_info("%s:\tState file '%s' doesn't exists", self->name, self->filename);
         }
 
-        // ignore linuxmetrics
-        if (streq(mlm_client_sender(self->client), "fty_info_linuxmetrics")) {
-            g_cm_mutex.unlock();
-            continue;
+        zfile_destroy(&legacy);
+        zfile_destroy(&f);
+        zstr_free(&dir);
+    } else if (streq(command, "SHARDS")) {
+        // SHARDS/<number of shards>, 0 means number of CPU cores
+        char* foo     = zmsg_popstr(msg);
+        long  nshards = foo ? atol(foo) : 0;
+        if (nshards <= 0)
+            nshards = long(std::max(std::thread::hardware_concurrency(), 1u));
+        if (size_t(nshards) != self->nshards) {
+            // frames of the checkpoints are written per shard, next one must be full
+            cmcheckpoint_destroy(&self->checkpoint);
+            self->nshards = size_t(nshards);
+            self->stats   = cmshards_resize(&self->stats, self->nshards);
+        }
+        log_info("%s:\tstats partitioned to %zu shards", self->name, self->nshards);
+        zstr_free(&foo);
+    } else if (streq(command, "WORKERS")) {
+        // WORKERS/<number of workers handling the shm pull>, 0 means one per shard
+        char* foo      = zmsg_popstr(msg);
+        long  nworkers = foo ? atol(foo) : 0;
+        self->nworkers = nworkers > 0 ? size_t(nworkers) : 0;
+        log_info("%s:\tshm pull handled by %zu workers (0 = one per shard)", self->name, self->nworkers);
+        zstr_free(&foo);
+    } else if (streq(command, "WRITERS")) {
+        // WRITERS/<number of threads writing the published statistics>, 0 means the caller writes them
+        char* foo      = zmsg_popstr(msg);
+        long  nwriters = foo ? atol(foo) : 0;
+        if (size_t(std::max(nwriters, 0L)) != cmpublish_writers(self->publish)) {
+            // statistics waiting for the smoothing window are written by the old writers
+            cmpublish_set_window(self->publish, 0);
+            cmpublish_flush(self->publish, nullptr);
+            cmpublish_destroy(&self->publish);
+            self->publish = cmpublish_new(size_t(std::max(nwriters, 0L)));
+            cmpublish_set_window(self->publish, self->smoothing_ms);
+        }
+        log_info("%s:\tstatistics published by %zu writers (0 = by the computing thread)", self->name,
+            cmpublish_writers(self->publish));
+        zstr_free(&foo);
+    } else if (streq(command, "SMOOTHING")) {
+        // SMOOTHING/<window [s]> - statistics closed at once are written over the window,
+        // shortest steps first, 0 means they are written at once
+        // the window must be shorter than the shortest step (gcd of steps), longer one is rejected
+        char*    foo       = zmsg_popstr(msg);
+        long     window    = foo ? atol(foo) : 0;
+        uint64_t window_ms = window > 0 ? uint64_t(window) * 1000 : 0;
+        uint64_t gcd       = cmsteps_gcd(self->steps);
+        if (gcd != 0 && window_ms >= gcd * 1000)
+            log_error("%s:\tsmoothing window %lds is not shorter than the shortest step %" PRIu64 "s, ignoring",
+                self->name, window, gcd);
+        else {
+            self->smoothing_ms = window_ms;
+            cmpublish_set_window(self->publish, self->smoothing_ms);
+            log_info("%s:\tstatistics published over %" PRIu64 "ms window", self->name, self->smoothing_ms);
+        }
+        zstr_free(&foo);
+    } else if (streq(command, "SHMWATCH")) {
+        // SHMWATCH/<shm directory> - read only metrics changed since the last pull,
+        // no directory means all metrics are read at every pull
+        char* foo     = zmsg_popstr(msg);
+        self->shm_dir = foo ? foo : "";
+        if (self->shm_dir.empty())
+            log_info("%s:\tall shm metrics are read at every pull", self->name);
+        else
+            log_info("%s:\tonly changed shm metrics from '%s' are read", self->name, self->shm_dir.c_str());
+        zstr_free(&foo);
+    } else if (streq(command, "SELECTOR")) {
+        // SELECTOR/<include rules>/<exclude rules> - quantities of the metrics to compute,
+        // rules are comma separated glob patterns
+        char* include = zmsg_popstr(msg);
+        char* exclude = zmsg_popstr(msg);
+        cmselector_destroy(&self->selector);
+        self->selector = cmselector_new(include, exclude);
+        self->selector_version++;
+        log_info("%s:\tmetrics selected by '%s'", self->name, cmselector_regex(self->selector));
+        zstr_free(&include);
+        zstr_free(&exclude);
+    } else if (streq(command, "RULES")) {
+        // RULES/<quantity>/<asset prefix>/<sender>/<aggregates>/<steps>/... - replaces the rules,
+        // aggregates and steps are comma separated, "*" allows all
+        cmrules_t* rules = cmrules_new();
+        while (zmsg_size(msg) >= 5) {
+            char* quantity   = zmsg_popstr(msg);
+            char* asset      = zmsg_popstr(msg);
+            char* sender     = zmsg_popstr(msg);
+            char* aggregates = zmsg_popstr(msg);
+            char* steps      = zmsg_popstr(msg);
+            cmrules_add(rules, quantity, asset, sender, aggregates, steps);
+            log_info("%s:\trule quantity='%s' asset='%s*' sender='%s' aggregates='%s' steps='%s'", self->name,
+                quantity, asset, sender, aggregates, steps);
+            zstr_free(&quantity);
+            zstr_free(&asset);
+            zstr_free(&sender);
+            zstr_free(&aggregates);
+            zstr_free(&steps);
+        }
+        cmrules_destroy(&self->rules);
+        self->rules = rules;
+        cmrules_columns(self->rules, self->stats->shards[0]->stats, self->columns);
+    } else if (streq(command, "CHECKPOINT")) {
+        // CHECKPOINT/async|sync[/fsync|nofsync[/compact]]
+        char* mode    = zmsg_popstr(msg);
+        char* policy  = zmsg_popstr(msg);
+        char* compact = zmsg_popstr(msg);
+        if (mode && (streq(mode, "async") || streq(mode, "sync"))) {
+            // pending snapshot is written with the old settings
+            cmcheckpoint_destroy(&self->checkpoint);
+            self->checkpoint_async   = streq(mode, "async");
+            self->checkpoint_fsync   = policy && streq(policy, "fsync");
+            self->checkpoint_compact = compact ? uint32_t(atol(compact)) : CM_CHECKPOINT_COMPACT;
+            log_info("%s:\tcheckpoint mode=%s, fsync=%s, compact=%" PRIu32, self->name, mode,
+                self->checkpoint_fsync ? "true" : "false", self->checkpoint_compact);
+        } else
+            log_error("%s:\tUnsupported checkpoint mode '%s'", self->name, mode ? mode : "(null)");
+        zstr_free(&compact);
+        zstr_free(&policy);
+        zstr_free(&mode);
+    } else if (streq(command, "PRODUCER")) {
+        char* stream = zmsg_popstr(msg);
+        int   r      = mlm_client_set_producer(self->client, stream);
+        if (r == -1)
+            log_error("%s:\tCan't set producer on stream '%s'", self->name, stream);
+        zstr_free(&stream);
+    } else if (streq(command, "CONSUMER")) {
+        char* stream  = zmsg_popstr(msg);
+        char* pattern = zmsg_popstr(msg);
+        int   rv      = mlm_client_set_consumer(self->client, stream, pattern);
+        if (rv == -1)
+            log_error("%s:\tCan't set consumer on stream '%s', '%s'", self->name, stream, pattern);
+        zstr_free(&pattern);
+        zstr_free(&stream);
+    } else if (streq(command, "INGEST")) {
+        // INGEST/<shm|stream|both> - metrics are pulled from shm periodically, consumed from the METRICS
+        // stream as they arrive or both, the stream is consumed with backpressure - the receiver waits for
+        // the computation instead of dropping metrics
+        char* mode   = zmsg_popstr(msg);
+        bool  shm    = mode && (streq(mode, "shm") || streq(mode, "both"));
+        bool  stream = mode && (streq(mode, "stream") || streq(mode, "both"));
+        if (!shm && !stream)
+            log_error("%s:\tUnknown ingestion mode '%s'", self->name, mode ? mode : "null");
+        if (stream) {
+            cmreceiver_set_wait(self->receiver, true);
+            if (mlm_client_set_consumer(self->client, FTY_PROTO_STREAM_METRICS, ".*") == -1)
+                log_error("%s:\tCan't set consumer on stream '%s'", self->name, FTY_PROTO_STREAM_METRICS);
         }
+        if (shm)
+            cmreactor_timer_set(self->reactor, self->pull_timer, uint64_t(fty_get_polling_interval() * 1000), false);
+        else
+            cmreactor_timer_stop(self->reactor, self->pull_timer);
+        log_info("%s:\tmetrics ingested from %s", self->name, mode ? mode : "null");
+        zstr_free(&mode);
+    } else if (streq(command, "CREATE_PULL")) {
+        // the first pull is done after the polling interval
+        cmreactor_timer_set(self->reactor, self->pull_timer, uint64_t(fty_get_polling_interval() * 1000), false);
+    } else if (streq(command, "CONNECT")) {
+        char* endpoint = zmsg_popstr(msg);
+        if (!endpoint)
+            log_error("%s:\tMissing endpoint", self->name);
+        else {
+            int r = mlm_client_connect(self->client, endpoint, 5000, self->name);
+            if (r == -1)
+                log_error("%s:\tConnection to endpoint '%s' failed", self->name, endpoint);
+        }
+        zstr_free(&endpoint);
+    } else if (streq(command, "STEPS")) {
+        for (;;) {
+            char* foo = zmsg_popstr(msg);
+            if (!foo)
+                break;
+            int r = cmsteps_put(self->steps, foo);
+            if (r == -1)
+                log_info("%s:\tIgnoring unrecognized step='%s'", self->name, foo);
+            zstr_free(&foo);
+        }
+        s_update_columns(self);
+        s_arm_rollover(self);
+        s_clamp_smoothing(self);
+    } else if (streq(command, "TYPES")) {
+        for (;;) {
+            char* foo = zmsg_popstr(msg);
+            if (!foo)
+                break;
+            // only the types of the table of computations are accepted, each of them once
+            if (cmstats_aggr_from_str(foo) == CMSTATS_AGGR_UNKNOWN)
+                log_warning("%s:\tIgnoring unsupported type='%s'", self->name, foo);
+            else if (!zlist_exists(self->types, foo))
+                zlist_append(self->types, foo);
+            zstr_free(&foo);
+        }
+        s_update_columns(self);
+    } else
+        log_warning("%s:\tUnkown API command=%s, ignoring", self->name, command);
 
-        fty_proto_t* bmsg = fty_proto_decode(&msg);
+    zstr_free(&command);
+    zmsg_destroy(&msg);
+    return 0;
+}
 
-        // If we received an asset message
-        // * "delete", "retire" or non active asset  -> drop all computations on that asset
-        // *  other                -> ignore it, as it doesn't impact this agent
-        if (fty_proto_id(bmsg) == FTY_PROTO_ASSET) {
-            const char* op = fty_proto_operation(bmsg);
-            if (streq(op, "delete") || streq(op, "retire") ||
-                !streq(fty_proto_aux_string(bmsg, FTY_PROTO_ASSET_STATUS, "active"), "active"))
-                cmstats_delete_asset(self->stats, fty_proto_name(bmsg));
+// Maximal number of received samples handled at once, so the timers are not delayed by a flood
+#define CM_SAMPLES_BATCH 1024
 
-            fty_proto_destroy(&bmsg);
-            g_cm_mutex.unlock();
+/// Handle the samples received by the receiver thread
+/// All statistics are computed for "left side of the interval"
+static void s_handle_samples(cm_t* self)
+{
+    cmreceiver_ack(self->receiver);
+
+    cmqueue_t*       queue = self->receiver->queue;
+    cmqueue_sample_t sample;
+    for (int i = 0; i < CM_SAMPLES_BATCH && cmqueue_pop(queue, &sample); i++) {
+        // Assets are usually deleted in bursts, so the deleted assets are collected while
+        // other samples are already waiting and dropped from stats at once
+        if (sample.kind == CMQUEUE_DELETE) {
+            // metrics received before the deletion are computed before it
+            s_handle_stream(self, self->samples, self->published);
+            zlist_append(self->deleted, const_cast<char*>(sample.series->asset.c_str()));
+            if (zlist_size(self->deleted) >= CM_DELETED_BATCH || cmqueue_size(queue) == 0)
+                s_flush_deleted(self);
             continue;
         }
+        // metrics of the assets deleted before this metric must not be kept
+        s_flush_deleted(self);
+        if (s_sample_selected(self, sample.series))
+            self->samples.emplace_back(cmshards_index(self->stats, sample.series->asset.c_str()), sample);
+    }
+    s_handle_stream(self, self->samples, self->published);
+    // series of the popped samples are not referred to anymore
+    cmreceiver_release(self->receiver);
+    cmpublish_append(self->publish, self->published);
+    s_publish(self, "stream metric");
+}
 
-        // If we received a metric message
-        // update statistics for all steps and types
-        // All statistics are computed for "left side of the interval"
-        if (fty_proto_id(bmsg) == FTY_PROTO_METRIC) {
-            s_handle_metric(bmsg, self, false);
-            fty_proto_destroy(&bmsg);
-            g_cm_mutex.unlock();
-            continue;
-        }
+//  --------------------------------------------------------------------------
+//  fty_mc_server actor
 
-        // We received some unexpected message
-        log_warning("%s:\tUnexpected message from sender=%s, subject=%s", self->name, mlm_client_sender(self->client),
-            mlm_client_subject(self->client));
+void fty_mc_server(zsock_t* pipe, void* args)
+{
+    cm_t* self = cm_new(reinterpret_cast<const char*>(args));
+
+    // do not forget to send a signal to actor :)
+    zsock_signal(pipe, 0);
+
+    // readiness of zmq socket is signalled by the change of its state only, so the sockets
+    // are handled again while they have messages waiting
+    cmreactor_t* reactor  = self->reactor;
+    int          commands = cmreactor_socket(
+        reactor, zsock_fd(pipe),
+        [pipe]() {
+            return (zsock_events(pipe) & ZMQ_POLLIN) != 0;
+        },
+        [self, pipe]() {
+            zmsg_t* msg = zmsg_recv(pipe);
+            return msg ? s_handle_command(self, msg) : -1;
+        });
+    // messages are received and decoded by the receiver thread, only the samples are handled here
+    int samples = cmreactor_socket(
+        reactor, cmreceiver_fd(self->receiver),
+        [self]() {
+            return cmqueue_size(self->receiver->queue) != 0;
+        },
+        [self]() {
+            s_handle_samples(self);
+            return 0;
+        });
+    self->rollover_timer = cmreactor_timer(reactor, CLOCK_REALTIME, [self]() {
+        return s_on_rollover(self);
+    });
+    self->pull_timer = cmreactor_timer(reactor, CLOCK_MONOTONIC, [self]() {
+        return s_on_pull(self);
+    });
+    self->smoothing_timer = cmreactor_timer(reactor, CLOCK_MONOTONIC, [self]() {
+        s_publish(self, "smoothing");
+        return 0;
+    });
+    int pulled = cmreactor_socket(reactor, self->pulled, nullptr, [self]() {
+        s_pull_end(self);
+        return 0;
+    });
+
+    if (commands == -1 || samples == -1 || self->rollover_timer == -1 || self->pull_timer == -1 ||
+        self->smoothing_timer == -1 || pulled == -1)
+        log_error("%s:\tCannot create the event loop", self->name);
+    else
+        cmreactor_run(reactor);
 
-        fty_proto_destroy(&bmsg);
-        g_cm_mutex.unlock();
-    }
     // end of main loop, so we are going to die soon
-    g_cm_mutex.lock();
-    if (self->filename) {
-        int r = cmstats_save(self->stats, self->filename);
-        if (r == -1)
-            log_error("%s:\tFailed to save '%s': %s", self->name, self->filename, strerror(errno));
-        else
-            log_info("%s:\tSaved succesfully '%s'", self->name, self->filename);
-    }
-    g_cm_mutex.unlock();
-    zactor_destroy(&metric_pull);
+    s_pull_end(self);
+    s_flush_deleted(self);
+    // statistics waiting for the smoothing window are written now
+    cmpublish_set_window(self->publish, 0);
+    s_publish(self, "exit");
+    // the last state is written synchronously
+    self->checkpoint_async = false;
+    s_save(self);
+    cmcheckpoint_destroy(&self->checkpoint);
+    log_debug("%s:\treactor wakeups=%" PRIu64 ", handlers=%" PRIu64, self->name, reactor->wakeups, reactor->handlers);
     cm_destroy(&self);
-    zpoller_destroy(&poller);
 }
@@ -20,6 +20,7 @@
 */
 
 #include "fty_mc_server.h"
+#include "cmselector.h"
 #include <fty_log.h>
 #include <fty_proto.h>
 
@@ -70,12 +71,10 @@ int main(int argc, char* argv[])
         }
     }
 
-    if (!config) {
-        zconfig_t* cfg = zconfig_load(AGENT_CONF);
-        if (cfg) {
-            log_config = zconfig_get(cfg, "log/config", "/etc/fty/ftylog.cfg");
-            ftylog_setConfigFile(ftylog_getInstance(), log_config);
-        }
+    zconfig_t* cfg = zconfig_load(AGENT_CONF);
+    if (!config && cfg) {
+        log_config = zconfig_get(cfg, "log/config", "/etc/fty/ftylog.cfg");
+        ftylog_setConfigFile(ftylog_getInstance(), log_config);
     }
 
     if (verbose) {
@@ -84,16 +83,40 @@ int main(int argc, char* argv[])
     log_info("%s - started connected to %s", ACTOR_NAME, endpoint);
 
     zactor_t* cm_server = zactor_new(fty_mc_server, const_cast<char*>(ACTOR_NAME));
-    zstr_sendx(cm_server, "TYPES", "min", "max", "arithmetic_mean", "consumption", nullptr);
+    // types and steps are built in, the rules of the config select the computed ones
+    zstr_sendx(cm_server, "TYPES", "min", "max", "arithmetic_mean", "consumption", "p50", "p95", "p99",
+        "time_weighted_mean", "variance", "standard_deviation", nullptr);
     zstr_sendx(cm_server, "STEPS", "15m", "30m", "1h", "8h", "24h", "7d", "30d", nullptr);
-    // TODO: Make this configurable, runtime and build-time default
+    zstr_sendx(cm_server, "SHARDS", cfg ? zconfig_get(cfg, "server/shards", "0") : "0", nullptr);
+    zstr_sendx(cm_server, "WORKERS", cfg ? zconfig_get(cfg, "server/workers", "0") : "0", nullptr);
+    zstr_sendx(cm_server, "WRITERS", cfg ? zconfig_get(cfg, "server/writers", "0") : "0", nullptr);
+    zstr_sendx(cm_server, "SMOOTHING", cfg ? zconfig_get(cfg, "server/smoothing", "0") : "0", nullptr);
+    zstr_sendx(cm_server, "SHMWATCH", cfg ? zconfig_get(cfg, "shm/watch", "") : "", nullptr);
+    zstr_sendx(cm_server, "SELECTOR",
+        cfg ? zconfig_get(cfg, "selector/include", CMSELECTOR_INCLUDE) : CMSELECTOR_INCLUDE,
+        cfg ? zconfig_get(cfg, "selector/exclude", CMSELECTOR_EXCLUDE) : CMSELECTOR_EXCLUDE, nullptr);
+    // rules of the config replace the default ones
+    zconfig_t* rules = cfg ? zconfig_locate(cfg, "rules") : nullptr;
+    if (rules) {
+        zmsg_t* msg = zmsg_new();
+        zmsg_addstr(msg, "RULES");
+        for (zconfig_t* rule = zconfig_child(rules); rule != nullptr; rule = zconfig_next(rule)) {
+            zmsg_addstr(msg, zconfig_get(rule, "quantity", ""));
+            zmsg_addstr(msg, zconfig_get(rule, "asset", ""));
+            zmsg_addstr(msg, zconfig_get(rule, "sender", ""));
+            zmsg_addstr(msg, zconfig_get(rule, "aggregates", "*"));
+            zmsg_addstr(msg, zconfig_get(rule, "steps", "*"));
+        }
+        zmsg_send(&msg, cm_server);
+    }
     zstr_sendx(cm_server, "DIR", "/var/lib/fty/fty-metric-compute", nullptr);
+    zstr_sendx(cm_server, "CHECKPOINT", cfg ? zconfig_get(cfg, "state/checkpoint", "async") : "async",
+        cfg ? zconfig_get(cfg, "state/fsync", "nofsync") : "nofsync", cfg ? zconfig_get(cfg, "state/compact", "96") : "96",
+        nullptr);
     zstr_sendx(cm_server, "CONNECT", endpoint, nullptr);
     // zstr_sendx (cm_server, "PRODUCER", FTY_PROTO_STREAM_METRICS, nullptr);
     zstr_sendx(cm_server, "CONSUMER", FTY_PROTO_STREAM_ASSETS, ".*", nullptr);
-    zstr_sendx(cm_server, "CREATE_PULL", nullptr);
-    // zstr_sendx (cm_server, "CONSUMER", FTY_PROTO_STREAM_METRICS,
-    // "(^realpower.default.*|.*temperature.*|.*humidity.*)", nullptr);
+    zstr_sendx(cm_server, "INGEST", cfg ? zconfig_get(cfg, "server/ingest", "shm") : "shm", nullptr);
 
     // src/malamute.c, under MPL license
     while (true) {
@@ -108,6 +131,7 @@ int main(int argc, char* argv[])
     }
 
     zactor_destroy(&cm_server);
+    zconfig_destroy(&cfg);
 
     log_info("END: fty_agent_cm is stopped");
     return 0;
@@ -0,0 +1,100 @@
+#include "src/cmcheckpoint.h"
+#include "src/fty_mc_server.h"
+#include <catch2/catch.hpp>
+#include <unistd.h>
+
+TEST_CASE("cmcheckpoint test", "[cmcheckpoint]")
+{
+    static const char* file = "cmcheckpoint.bin";
+    unlink(file);
+
+    cmshards_t* stats = cmshards_new(2);
+    REQUIRE(stats);
+
+    uint32_t column    = uint32_t(cmshards_column(stats, "max", "1h", 3600));
+    zlist_t* published = zlist_new();
+    cmshards_update(stats, "TYPE", "DEV", &column, 1, 42, uint64_t(time(nullptr)), "UNIT", published);
+
+    cmcheckpoint_t* self = cmcheckpoint_new(file, true, 0);
+    REQUIRE(self);
+
+    cmcheckpoint_request(self, stats);
+    cmcheckpoint_wait(self);
+
+    cmcheckpoint_info_t info = cmcheckpoint_info(self);
+    CHECK(info.count == 1);
+    CHECK(info.errors == 0);
+    CHECK(info.size > 0);
+    CHECK(zfile_exists(file));
+
+    // stats can change while the snapshot is being written
+    cmcheckpoint_request(self, stats);
+    zlist_t* deleted = zlist_new();
+    zlist_append(deleted, const_cast<char*>("DEV"));
+    cmshards_delete_assets(stats, deleted);
+    zlist_destroy(&deleted);
+    cmcheckpoint_destroy(&self);
+    CHECK(!self);
+
+    cmstats_t* loaded = cmstats_load(file);
+    REQUIRE(loaded);
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(loaded, "TYPE", "max", "1h", "DEV", &acc));
+    CHECK(acc.value == 42);
+    cmstats_destroy(&loaded);
+
+    // failed writes are counted
+    self = cmcheckpoint_new("/nonexistent/cmcheckpoint.bin", false, 0);
+    cmcheckpoint_request(self, stats);
+    cmcheckpoint_wait(self);
+    info = cmcheckpoint_info(self);
+    CHECK(info.count == 0);
+    CHECK(info.errors == 1);
+    cmcheckpoint_destroy(&self);
+
+    zlist_destroy(&published);
+    cmshards_destroy(&stats);
+    unlink(file);
+}
+
+TEST_CASE("cmcheckpoint compaction test", "[cmcheckpoint]")
+{
+    static const char* file  = "cmcheckpoint_compact.bin";
+    static const char* delta = "cmcheckpoint_compact.bin.delta";
+    unlink(file);
+    unlink(delta);
+
+    cmshards_t* stats = cmshards_new(2);
+    REQUIRE(stats);
+
+    uint32_t column    = uint32_t(cmshards_column(stats, "max", "24h", 86400));
+    zlist_t* published = zlist_new();
+
+    // every third snapshot is full
+    cmcheckpoint_t* self = cmcheckpoint_new(file, false, 2);
+    uint64_t        now  = uint64_t(time(nullptr));
+    for (uint64_t i = 0; i < 5; i++) {
+        cmshards_update(stats, "TYPE", "DEV", &column, 1, 42, now + i, "UNIT", published);
+        cmcheckpoint_request(self, stats);
+        cmcheckpoint_wait(self);
+    }
+
+    cmcheckpoint_info_t info = cmcheckpoint_info(self);
+    CHECK(info.count == 5);
+    CHECK(info.full == 2);
+    CHECK(info.delta_size > 0);
+    CHECK(zfile_exists(delta));
+    cmcheckpoint_destroy(&self);
+
+    cmstats_t* loaded = cmstats_load(file);
+    REQUIRE(loaded);
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(loaded, "TYPE", "max", "24h", "DEV", &acc));
+    CHECK(acc.count == 5);
+    cmstats_destroy(&loaded);
+
+    zlist_destroy(&published);
+    cmshards_destroy(&stats);
+    unlink(file);
+    unlink(delta);
+}
@@ -0,0 +1,55 @@
+#include "src/cmpool.h"
+#include "src/cmshards.h"
+#include "src/fty_mc_server.h"
+#include <atomic>
+#include <catch2/catch.hpp>
+
+TEST_CASE("cmpool test", "[cmpool]")
+{
+    cmpool_t* self = cmpool_new(0);
+    REQUIRE(self);
+    CHECK(cmpool_size(self) == 1);
+    cmpool_destroy(&self);
+    CHECK(!self);
+
+    self = cmpool_new(4);
+    REQUIRE(self);
+    CHECK(cmpool_size(self) == 4);
+
+    // every worker runs every job exactly once
+    std::atomic<size_t> calls(0);
+    std::atomic<size_t> workers(0);
+    for (int i = 0; i < 100; i++) {
+        cmpool_run(self, [&](size_t worker) {
+            calls++;
+            workers += worker;
+        });
+    }
+    CHECK(calls == 400);
+    CHECK(workers == 100 * (0 + 1 + 2 + 3));
+
+    // workers update disjoint shards in parallel
+    cmshards_t* stats     = cmshards_new(8);
+    uint32_t    column    = uint32_t(cmshards_column(stats, "max", "1h", 3600));
+    uint64_t    now       = uint64_t(time(nullptr));
+    size_t      nworkers  = cmpool_size(self);
+    cmpool_run(self, [&](size_t worker) {
+        zlist_t* published = zlist_new();
+        for (size_t i = worker; i < cmshards_size(stats); i += nworkers) {
+            cmshard_t*                  shard = stats->shards[i];
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            uint32_t series = cmstats_series(shard->stats, "TYPE", ("DEV" + std::to_string(i)).c_str());
+            cmstats_series_update(shard->stats, series, &column, 1, double(i), now, "UNIT", published);
+        }
+        zlist_destroy(&published);
+    });
+    for (size_t i = 0; i < cmshards_size(stats); i++) {
+        cmstats_acc_t acc;
+        REQUIRE(cmstats_lookup(stats->shards[i]->stats, "TYPE", "max", "1h", ("DEV" + std::to_string(i)).c_str(), &acc));
+        CHECK(acc.value == double(i));
+    }
+    cmshards_destroy(&stats);
+
+    cmpool_destroy(&self);
+    CHECK(!self);
+}
@@ -0,0 +1,123 @@
+#include "src/cmpublish.h"
+#include "src/fty_mc_server.h"
+#include <catch2/catch.hpp>
+#include <fty_shm.h>
+#include <string>
+
+// append count statistics of assets DEV<first>... to the batch
+static void s_append(cmpublish_t* self, size_t first, size_t count, uint32_t step = 900)
+{
+    zlist_t* published = zlist_new();
+    for (size_t i = first; i < first + count; i++) {
+        fty_proto_t* bmsg = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_type(bmsg, "%s", "TYPE_max_15m");
+        fty_proto_set_name(bmsg, "DEV%zu", i);
+        fty_proto_set_value(bmsg, "%zu", i);
+        fty_proto_set_unit(bmsg, "%s", "UNIT");
+        fty_proto_set_time(bmsg, uint64_t(time(nullptr)));
+        fty_proto_set_ttl(bmsg, 2 * step);
+        fty_proto_aux_insert(bmsg, AGENT_CM_STEP, "%" PRIu32, step);
+        zlist_append(published, bmsg);
+    }
+    cmpublish_append(self, published);
+    CHECK(zlist_size(published) == 0);
+    zlist_destroy(&published);
+}
+
+static void s_check(size_t nwriters)
+{
+    cmpublish_t* self = cmpublish_new(nwriters);
+    REQUIRE(self);
+    CHECK(cmpublish_writers(self) == nwriters);
+
+    // nothing to write
+    cmpublish_info_t info;
+    CHECK(cmpublish_flush(self, &info) == 0);
+    CHECK(info.flushes == 0);
+
+    // statistics appended by several calls are written at once
+    s_append(self, 0, 10);
+    s_append(self, 10, 30);
+    CHECK(cmpublish_flush(self, &info) == 40);
+    CHECK(info.count == 40);
+    CHECK(info.errors == 0);
+    CHECK(info.flushes == 1);
+    CHECK(info.size == 40);
+    CHECK(self->batch.empty());
+    for (size_t i = 0; i < 40; i++) {
+        fty_proto_t* bmsg = nullptr;
+        REQUIRE(fty::shm::read_metric("DEV" + std::to_string(i), "TYPE_max_15m", &bmsg) == 0);
+        CHECK(streq(fty_proto_value(bmsg), std::to_string(i).c_str()));
+        fty_proto_destroy(&bmsg);
+    }
+
+    // the largest burst is kept
+    s_append(self, 0, 5);
+    CHECK(cmpublish_flush(self, nullptr) == 5);
+    info = self->info;
+    CHECK(info.count == 45);
+    CHECK(info.size == 5);
+    CHECK(info.max_size == 40);
+
+    // statistics not flushed are dropped
+    s_append(self, 0, 5);
+    cmpublish_destroy(&self);
+    CHECK(!self);
+}
+
+TEST_CASE("cmpublish test", "[cmpublish]")
+{
+    CHECK(fty_shm_set_test_dir(".") == 0);
+    s_check(0);
+    s_check(4);
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("cmpublish smoothing test", "[cmpublish]")
+{
+    CHECK(fty_shm_set_test_dir(".") == 0);
+    cmpublish_t* self = cmpublish_new(0);
+    REQUIRE(self);
+    CHECK(cmpublish_next(self) == -1);
+
+    // the burst is written over 2s window, the shortest steps first
+    cmpublish_set_window(self, 2000);
+    s_append(self, 0, 10, 3600);
+    s_append(self, 10, 10, 900);
+    CHECK(cmpublish_next(self) >= 0);
+    CHECK(cmpublish_next(self) <= 2000);
+
+    zclock_sleep(1000);
+    cmpublish_info_t info;
+    size_t           n = cmpublish_flush(self, &info);
+    CHECK(n >= 10);
+    CHECK(n < 20);
+    CHECK(info.backlog == 20 - n);
+    for (const cmpublish_entry_t& waiting : self->batch)
+        CHECK(waiting.step == 3600);
+    fty_proto_t* bmsg = nullptr;
+    REQUIRE(fty::shm::read_metric("DEV10", "TYPE_max_15m", &bmsg) == 0);
+    fty_proto_destroy(&bmsg);
+
+    // the rest is written by the end of the window
+    zclock_sleep(1100);
+    CHECK(cmpublish_next(self) == 0);
+    CHECK(cmpublish_flush(self, &info) == 20 - n);
+    CHECK(info.backlog == 0);
+    CHECK(info.count == 20);
+    CHECK(cmpublish_next(self) == -1);
+
+    // burst appended after the end of the window starts the new window, even if statistics are still waiting,
+    // it is merged with them by step
+    cmpublish_set_window(self, 200);
+    s_append(self, 0, 10, 3600);
+    zclock_sleep(300);
+    s_append(self, 10, 10, 60);
+    CHECK(self->end_ms > zclock_mono());
+    REQUIRE(self->batch.size() == 20);
+    CHECK(self->batch.front().step == 60);
+    CHECK(self->batch.back().step == 3600);
+
+    cmpublish_destroy(&self);
+    fty_shm_delete_test_dir();
+}
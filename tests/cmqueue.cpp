@@ -0,0 +1,81 @@
+#include "src/cmqueue.h"
+#include <catch2/catch.hpp>
+#include <thread>
+
+TEST_CASE("cmqueue test", "[cmqueue]")
+{
+    cmqueue_t* self = cmqueue_new(3);
+    REQUIRE(self);
+    CHECK(cmqueue_capacity(self) == 4);
+    CHECK(cmqueue_size(self) == 0);
+
+    cmqueue_series_t series{"sender", "realpower.default", "ups", "W", 0, -1, 0, false};
+    cmqueue_sample_t sample{&series, 0, 100, CMQUEUE_METRIC};
+    for (int i = 0; i < 5; i++) {
+        sample.value = i;
+        CHECK(cmqueue_push(self, sample) == (i < 4));
+    }
+    CHECK(cmqueue_size(self) == 4);
+
+    cmqueue_info_t info = cmqueue_info(self);
+    CHECK(info.pushed == 4);
+    CHECK(info.dropped == 1);
+    CHECK(info.depth == 4);
+    CHECK(info.max_depth == 4);
+
+    // samples are popped in order of push
+    cmqueue_sample_t popped;
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(cmqueue_pop(self, &popped));
+        CHECK(popped.series == &series);
+        CHECK(popped.value == i);
+        CHECK(popped.time == 100);
+    }
+    CHECK(!cmqueue_pop(self, &popped));
+    CHECK(cmqueue_size(self) == 0);
+
+    // slots are reused
+    sample.kind = CMQUEUE_DELETE;
+    CHECK(cmqueue_push(self, sample));
+    REQUIRE(cmqueue_pop(self, &popped));
+    CHECK(popped.kind == CMQUEUE_DELETE);
+
+    cmqueue_destroy(&self);
+    CHECK(!self);
+}
+
+TEST_CASE("cmqueue threads test", "[cmqueue]")
+{
+    cmqueue_t* self = cmqueue_new(64);
+    REQUIRE(self);
+
+    // producer retries the full queue, so every sample is received once and in order
+    const int        count = 100000;
+    cmqueue_series_t series{"sender", "voltage.input", "ups", "V", 0, -1, 0, false};
+    std::thread      producer([self, &series]() {
+        for (int i = 0; i < count; i++) {
+            cmqueue_sample_t sample{&series, double(i), uint64_t(i), CMQUEUE_METRIC};
+            while (!cmqueue_push(self, sample))
+                std::this_thread::yield();
+        }
+    });
+
+    int              received = 0;
+    bool             ordered  = true;
+    cmqueue_sample_t sample;
+    while (received < count) {
+        if (!cmqueue_pop(self, &sample)) {
+            std::this_thread::yield();
+            continue;
+        }
+        ordered = ordered && sample.value == received && sample.time == uint64_t(received);
+        received++;
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK(cmqueue_size(self) == 0);
+    CHECK(cmqueue_info(self).pushed == uint64_t(count));
+    CHECK(cmqueue_info(self).max_depth <= 64);
+
+    cmqueue_destroy(&self);
+}
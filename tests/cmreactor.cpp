@@ -0,0 +1,91 @@
+#include "src/cmreactor.h"
+#include "src/fty_mc_server.h"
+#include <catch2/catch.hpp>
+#include <ctime>
+#include <unistd.h>
+
+TEST_CASE("cmreactor test", "[cmreactor]")
+{
+    cmreactor_t* self = cmreactor_new();
+    REQUIRE(self);
+
+    // descriptor
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    int  reads   = 0;
+    bool pending = false;
+    int  source  = cmreactor_socket(
+        self, fds[0],
+        [&pending]() {
+            return pending;
+        },
+        [&]() {
+            reads++;
+            if (pending) {
+                pending = false;
+                return 0;
+            }
+            char c = 0;
+            CHECK(read(fds[0], &c, 1) == 1);
+            return c == 'q' ? -1 : 0;
+        });
+    REQUIRE(source == 0);
+    CHECK(cmreactor_run_once(self, 0) == 0);
+    CHECK(reads == 0);
+    REQUIRE(write(fds[1], "x", 1) == 1);
+    CHECK(cmreactor_run_once(self, 1000) == 0);
+    CHECK(reads == 1);
+    // pending events are handled without waiting
+    pending = true;
+    CHECK(cmreactor_run_once(self, -1) == 0);
+    CHECK(reads == 2);
+
+    // one-shot timers
+    int monotonic = 0;
+    int realtime  = 0;
+    int mtimer    = cmreactor_timer(self, CLOCK_MONOTONIC, [&monotonic]() {
+        monotonic++;
+        return 0;
+    });
+    int rtimer    = cmreactor_timer(self, CLOCK_REALTIME, [&realtime]() {
+        realtime++;
+        return 0;
+    });
+    REQUIRE(mtimer == 1);
+    REQUIRE(rtimer == 2);
+    CHECK(cmreactor_run_once(self, 100) == 0);
+    CHECK(monotonic == 0);
+
+    REQUIRE(cmreactor_timer_set(self, mtimer, 50, false) == 0);
+    int64_t start_ms = zclock_mono();
+    CHECK(cmreactor_run_once(self, 1000) == 0);
+    CHECK(monotonic == 1);
+    CHECK(zclock_mono() - start_ms >= 45);
+    CHECK(cmreactor_run_once(self, 100) == 0);
+    CHECK(monotonic == 1);
+
+    // absolute deadline of the wall clock, also in the past
+    REQUIRE(cmreactor_timer_set(self, rtimer, uint64_t(zclock_time()) + 50, true) == 0);
+    CHECK(cmreactor_run_once(self, 1000) == 0);
+    CHECK(realtime == 1);
+    REQUIRE(cmreactor_timer_set(self, rtimer, uint64_t(zclock_time()) - 1000, true) == 0);
+    CHECK(cmreactor_run_once(self, 1000) == 0);
+    CHECK(realtime == 2);
+
+    // stopped timer is not handled
+    REQUIRE(cmreactor_timer_set(self, mtimer, 50, false) == 0);
+    cmreactor_timer_stop(self, mtimer);
+    CHECK(cmreactor_run_once(self, 200) == 0);
+    CHECK(monotonic == 1);
+
+    // handler ends the loop
+    REQUIRE(write(fds[1], "q", 1) == 1);
+    cmreactor_run(self);
+    CHECK(reads == 3);
+    CHECK(self->wakeups >= 6);
+
+    cmreactor_destroy(&self);
+    CHECK(!self);
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,86 @@
+#include "src/cmrules.h"
+#include "src/fty_mc_server.h"
+#include <catch2/catch.hpp>
+
+TEST_CASE("cmrules test", "[cmrules]")
+{
+    // 15m: min=0, max=1, consumption=2, 1h: min=3, max=4, consumption=5
+    cmstats_t*            stats = cmstats_new();
+    std::vector<uint32_t> columns;
+    for (const char* step : {"15m", "1h"}) {
+        uint32_t seconds = streq(step, "15m") ? 900 : 3600;
+        for (const char* type : {"min", "max", "consumption"})
+            columns.push_back(uint32_t(cmstats_column(stats, type, step, seconds)));
+    }
+
+    cmrules_t* self = cmrules_new();
+    REQUIRE(self);
+    CHECK(self->version != 0);
+    cmrules_add(self, "*", "epdu-", "", "*", "15m");
+    cmrules_add_defaults(self);
+    cmrules_columns(self, stats, columns);
+
+    // all types of 15m for epdu
+    uint32_t series = cmstats_series(stats, "realpower.default", "epdu-1");
+    int32_t  rule   = cmrules_series(self, stats, series);
+    REQUIRE(rule == 0);
+    CHECK(self->rules[size_t(rule)].columns == std::vector<uint32_t>{0, 1, 2});
+    CHECK(stats->series[series].rules_version == self->version);
+
+    // sensor temperature is not computed
+    rule = cmrules_series(self, stats, cmstats_series(stats, "temperature.default", "sensor-1"));
+    REQUIRE(rule == 1);
+    CHECK(self->rules[size_t(rule)].columns.empty());
+    CHECK(cmrules_drop(self, rule));
+
+    // only 15m and 1h extremes of voltages
+    rule = cmrules_series(self, stats, cmstats_series(stats, "voltage.input.L1-N", "ups-1"));
+    REQUIRE(rule == 4);
+    CHECK(!cmrules_drop(self, rule));
+    CHECK(self->rules[size_t(rule)].columns == std::vector<uint32_t>{0, 1, 3, 4});
+
+    // consumption only for realpower
+    rule = cmrules_series(self, stats, cmstats_series(stats, "realpower.default", "ups-1"));
+    REQUIRE(rule == 5);
+    CHECK(self->rules[size_t(rule)].columns == columns);
+    rule = cmrules_series(self, stats, cmstats_series(stats, "temperature.default", "rack-1"));
+    REQUIRE(rule == 6);
+    CHECK(self->rules[size_t(rule)].columns == std::vector<uint32_t>{0, 1, 3, 4});
+    rule = cmrules_series(self, stats, cmstats_series(stats, "humidity.default", "rack-1"));
+    REQUIRE(rule == 7);
+    CHECK(self->rules[size_t(rule)].columns == std::vector<uint32_t>{0, 1, 3, 4});
+
+    // rules by sender
+    CHECK(cmrules_sender(self, "fty_info_linuxmetrics") == 3);
+    CHECK(cmrules_drop(self, cmrules_sender(self, "fty_info_linuxmetrics")));
+    CHECK(cmrules_sender(self, "fty-nut") == -1);
+    CHECK(cmrules_sender(self, nullptr) == -1);
+    CHECK(!cmrules_drop(self, -1));
+
+    // time weighted mean, variance and standard deviation also for the quantities other than realpower
+    cmstats_t*            weighted = cmstats_new();
+    std::vector<uint32_t> wcolumns;
+    for (const char* type : {"consumption", "p95", "time_weighted_mean", "variance", "standard_deviation"})
+        wcolumns.push_back(uint32_t(cmstats_column(weighted, type, "15m", 900)));
+    cmrules_t* defaults = cmrules_new();
+    cmrules_add_defaults(defaults);
+    cmrules_columns(defaults, weighted, wcolumns);
+    rule = cmrules_series(defaults, weighted, cmstats_series(weighted, "current.input.L1", "ups-1"));
+    REQUIRE(rule == 6);
+    CHECK(defaults->rules[size_t(rule)].columns == std::vector<uint32_t>{2, 3, 4});
+    rule = cmrules_series(defaults, weighted, cmstats_series(weighted, "average.temperature", "rack-1"));
+    REQUIRE(rule == 5);
+    CHECK(defaults->rules[size_t(rule)].columns == std::vector<uint32_t>{1, 2, 3, 4});
+    cmrules_destroy(&defaults);
+    cmstats_destroy(&weighted);
+
+    // cached rule of the series is not valid for the new table
+    cmrules_t* fresh = cmrules_new();
+    CHECK(fresh->version != self->version);
+    CHECK(cmrules_series(fresh, stats, series) == -1);
+    cmrules_destroy(&fresh);
+
+    cmrules_destroy(&self);
+    CHECK(!self);
+    cmstats_destroy(&stats);
+}
@@ -0,0 +1,67 @@
+#include "src/cmselector.h"
+#include "src/fty_mc_server.h"
+#include <catch2/catch.hpp>
+#include <regex>
+
+TEST_CASE("cmselector test", "[cmselector]")
+{
+    cmselector_t* self = cmselector_new(CMSELECTOR_INCLUDE, CMSELECTOR_EXCLUDE);
+    REQUIRE(self);
+
+    static const char* selected[] = {"realpower.default", "power.default", "current.output.L1", "current.input.L3",
+        "voltage.output.L2-N", "voltage.input.1", "temperature", "average.temperature", "humidity.default"};
+    static const char* rejected[] = {"realpower.default_max_15m", "realpower.default_arithmetic_mean_1h",
+        "realpower.default_consumption_24h", "temperature_min_15m", "realpower.default_p95_15m", "current.output.L4",
+        "voltage.input.3",
+        "load.default", "realpower.output.L1", ""};
+
+    // rules and regular expression give the same decisions
+    std::regex regex(cmselector_regex(self));
+    for (const char* quantity : selected) {
+        CHECK(cmselector_match(self, quantity));
+        CHECK(std::regex_match(quantity, regex));
+    }
+    for (const char* quantity : rejected) {
+        CHECK(!cmselector_match(self, quantity));
+        CHECK(!std::regex_match(quantity, regex));
+    }
+    CHECK(!cmselector_match(self, nullptr));
+
+    // recurring quantity is decided by cache
+    CHECK(self->hits == 0);
+    CHECK(cmselector_match(self, "realpower.default"));
+    CHECK(!cmselector_match(self, "realpower.default_max_15m"));
+    CHECK(self->hits == 2);
+    cmselector_destroy(&self);
+    CHECK(!self);
+
+    // configured rules, spaces are ignored
+    self = cmselector_new(" load.* , ups.?", "*.input*");
+    CHECK(cmselector_match(self, "load.default"));
+    CHECK(cmselector_match(self, "ups.1"));
+    CHECK(!cmselector_match(self, "ups.12"));
+    CHECK(!cmselector_match(self, "load.input.L1"));
+    CHECK(!cmselector_match(self, "realpower.default"));
+    CHECK(std::regex_match("load.default", std::regex(cmselector_regex(self))));
+    CHECK(!std::regex_match("load.input.L1", std::regex(cmselector_regex(self))));
+    cmselector_destroy(&self);
+
+    // bracket expressions, negated by leading !, ^ and ] at the beginning are literal
+    self = cmselector_new("current.output.L[!12],voltage.[]^x],[^a]*", nullptr);
+    std::regex brackets(cmselector_regex(self));
+    for (const char* quantity : {"current.output.L3", "voltage.]", "voltage.^", "voltage.x", "^b", "ab"}) {
+        CHECK(cmselector_match(self, quantity));
+        CHECK(std::regex_match(quantity, brackets));
+    }
+    for (const char* quantity : {"current.output.L1", "current.output.L2", "current.output.L", "voltage.a", "b"}) {
+        CHECK(!cmselector_match(self, quantity));
+        CHECK(!std::regex_match(quantity, brackets));
+    }
+    cmselector_destroy(&self);
+
+    // nothing is selected without include rules
+    self = cmselector_new("", nullptr);
+    CHECK(!cmselector_match(self, "realpower.default"));
+    CHECK(!std::regex_match("realpower.default", std::regex(cmselector_regex(self))));
+    cmselector_destroy(&self);
+}
@@ -0,0 +1,69 @@
+#include "src/cmshards.h"
+#include "src/fty_mc_server.h"
+#include <catch2/catch.hpp>
+#include <unistd.h>
+
+TEST_CASE("cmshards test", "[cmshards]")
+{
+    static const char* file = "cmshards.bin";
+    unlink(file);
+
+    cmshards_t* self = cmshards_new(4);
+    REQUIRE(self);
+    CHECK(cmshards_size(self) == 4);
+    CHECK(cmshards_index(self, "DEV1") == cmshards_index(self, "DEV1"));
+    CHECK(cmshards_column(self, "unknown", "1h", 3600) == -1);
+
+    uint32_t columns[2];
+    columns[0] = uint32_t(cmshards_column(self, "min", "1h", 3600));
+    columns[1] = uint32_t(cmshards_column(self, "max", "1h", 3600));
+    CHECK(columns[0] == 0);
+    CHECK(columns[1] == 1);
+
+    zlist_t* published = zlist_new();
+    uint64_t now       = uint64_t(time(nullptr));
+    for (int i = 0; i < 100; i++) {
+        std::string asset = "DEV" + std::to_string(i);
+        CHECK(cmshards_update(self, "TYPE", asset.c_str(), columns, 2, i, now, "UNIT", published) == 0);
+    }
+    CHECK(zlist_size(published) == 0);
+
+    // assets are spread over all shards and all series of the asset are in its shard
+    for (cmshard_t* shard : self->shards)
+        CHECK(!shard->stats->assets.empty());
+    cmstats_acc_t acc;
+    REQUIRE(cmshards_lookup(self, "TYPE", "max", "1h", "DEV42", &acc));
+    CHECK(acc.value == 42);
+    const cmstats_t* stats = self->shards[cmshards_index(self, "DEV42")]->stats;
+    CHECK(stats->assets.count("DEV42") == 1);
+
+    zlist_t* deleted = zlist_new();
+    zlist_append(deleted, const_cast<char*>("DEV42"));
+    zlist_append(deleted, const_cast<char*>("DEV7"));
+    cmshards_delete_assets(self, deleted);
+    zlist_destroy(&deleted);
+    CHECK(!cmshards_lookup(self, "TYPE", "max", "1h", "DEV42", nullptr));
+    CHECK(!cmshards_lookup(self, "TYPE", "max", "1h", "DEV7", nullptr));
+    CHECK(cmshards_lookup(self, "TYPE", "max", "1h", "DEV8", nullptr));
+
+    // the state does not depend on the number of shards
+    REQUIRE(cmshards_save(self, file) == 0);
+    cmshards_destroy(&self);
+    self = cmshards_load(file, 3);
+    REQUIRE(self);
+    CHECK(cmshards_size(self) == 3);
+    REQUIRE(cmshards_lookup(self, "TYPE", "min", "1h", "DEV99", &acc));
+    CHECK(acc.value == 99);
+    CHECK(!cmshards_lookup(self, "TYPE", "max", "1h", "DEV42", nullptr));
+    CHECK(cmshards_column(self, "max", "1h", 3600) == 1);
+
+    self = cmshards_resize(&self, 1);
+    CHECK(cmshards_size(self) == 1);
+    REQUIRE(cmshards_lookup(self, "TYPE", "max", "1h", "DEV98", &acc));
+    CHECK(acc.value == 98);
+    CHECK(self->shards[0]->stats->assets.size() == 98);
+
+    zlist_destroy(&published);
+    cmshards_destroy(&self);
+    unlink(file);
+}
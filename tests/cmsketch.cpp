@@ -0,0 +1,78 @@
+#include "src/cmsketch.h"
+#include <catch2/catch.hpp>
+#include <cmath>
+
+TEST_CASE("cmsketch test", "[cmsketch]")
+{
+    cmsketch_t self = {};
+    CHECK(cmsketch_count(&self) == 0);
+    CHECK(std::isnan(cmsketch_quantile(&self, 0.5)));
+
+    // quantiles are estimated within the relative accuracy
+    for (int i = 1; i <= 1000; i++)
+        cmsketch_add(&self, i);
+    cmsketch_add(&self, NAN);
+    CHECK(cmsketch_count(&self) == 1000);
+    CHECK(cmsketch_quantile(&self, 0.50) == Approx(500).epsilon(CMSKETCH_ACCURACY));
+    CHECK(cmsketch_quantile(&self, 0.95) == Approx(950).epsilon(CMSKETCH_ACCURACY));
+    CHECK(cmsketch_quantile(&self, 0.99) == Approx(990).epsilon(CMSKETCH_ACCURACY));
+    CHECK(cmsketch_quantile(&self, 1) == Approx(1000).epsilon(CMSKETCH_ACCURACY));
+
+    // negative values and zeros are ordered before the positive ones
+    cmsketch_t mixed = {};
+    for (double value : {10.0, -10.0, 0.0, -20.0, 20.0})
+        cmsketch_add(&mixed, value);
+    CHECK(cmsketch_quantile(&mixed, 0) == Approx(-20).epsilon(CMSKETCH_ACCURACY));
+    CHECK(cmsketch_quantile(&mixed, 0.25) == Approx(-10).epsilon(CMSKETCH_ACCURACY));
+    CHECK(cmsketch_quantile(&mixed, 0.5) == 0);
+    CHECK(cmsketch_quantile(&mixed, 1) == Approx(20).epsilon(CMSKETCH_ACCURACY));
+
+    // merged sketch is the same as the sketch of all the values
+    cmsketch_t merged = {};
+    cmsketch_t part   = {};
+    for (int i = 1; i <= 1000; i++)
+        cmsketch_add(i % 2 ? &merged : &part, i);
+    cmsketch_merge(&merged, &part);
+    CHECK(cmsketch_count(&merged) == 1000);
+    CHECK(merged.positive.offset == self.positive.offset);
+    CHECK(merged.positive.bins == self.positive.bins);
+
+    // encoded sketch is decoded the same, truncated one is refused
+    std::string buffer;
+    cmsketch_encode(&mixed, buffer);
+    cmsketch_t decoded = {};
+    CHECK(cmsketch_decode(&decoded, buffer.data(), buffer.size()) == buffer.size());
+    CHECK(cmsketch_count(&decoded) == 5);
+    CHECK(decoded.zeros == 1);
+    CHECK(decoded.negative.bins == mixed.negative.bins);
+    CHECK(cmsketch_quantile(&decoded, 0.25) == cmsketch_quantile(&mixed, 0.25));
+    CHECK(cmsketch_decode(&decoded, buffer.data(), buffer.size() - 1) == 0);
+    CHECK(cmsketch_count(&decoded) == 0);
+
+    cmsketch_reset(&self);
+    CHECK(cmsketch_count(&self) == 0);
+    CHECK(self.positive.bins.empty());
+}
+
+TEST_CASE("cmsketch bounded test", "[cmsketch]")
+{
+    // the lowest bins are collapsed, the high quantiles stay accurate
+    cmsketch_t self = {};
+    for (double value = 1e-6; value < 1e12; value *= 1.01)
+        cmsketch_add(&self, value);
+    cmsketch_add(&self, 1e-300);
+    CHECK(self.positive.bins.size() <= CMSKETCH_MAX_BINS);
+    CHECK(self.zeros == 1);
+
+    size_t n = 0;
+    for (double value = 1e-6; value < 1e12; value *= 1.01)
+        n++;
+    double p99 = 1e-6 * std::pow(1.01, std::floor(0.99 * double(n)));
+    CHECK(cmsketch_quantile(&self, 0.99) == Approx(p99).epsilon(0.02));
+
+    cmsketch_t other = {};
+    cmsketch_add(&other, 1e-9 * 2);
+    cmsketch_merge(&self, &other);
+    CHECK(self.positive.bins.size() <= CMSKETCH_MAX_BINS);
+    CHECK(cmsketch_count(&self) == n + 2);
+}
@@ -1,11 +1,14 @@
 #include "src/cmstats.h"
 #include "src/fty_mc_server.h"
 #include <catch2/catch.hpp>
+#include <cmath>
+#include <fty_shm.h>
+#include <map>
 #include <unistd.h>
 
 TEST_CASE("cmstats test", "[cmstats]")
 {
-    static const char* file = "cmstats.zpl";
+    static const char* file = "cmstats.bin";
     unlink(file);
 
     cmstats_t* self = cmstats_new();
@@ -87,7 +90,7 @@ TEST_CASE("cmstats test", "[cmstats]")
     REQUIRE(stats);
 
     fty_proto_print(stats);
-    CHECK(streq(fty_proto_value(stats), "100.989999"));
+    CHECK(streq(fty_proto_value(stats), "100.99"));
     CHECK(streq(fty_proto_aux_string(stats, AGENT_CM_COUNT, nullptr), "2"));
     fty_proto_destroy(&stats);
 
@@ -106,7 +109,7 @@ TEST_CASE("cmstats test", "[cmstats]")
     stats = cmstats_put(self, "consumption", "10s", 10, bmsg);
     REQUIRE(stats);
 
-    r = asprintf(&xxx, "%.1f", 100.99 * 6 + 42.1 * 3);
+    r = asprintf(&xxx, "%.1f", 100.989999 * 6 + 42.11 * 3);
     //printf("---> %s <> %s\n", fty_proto_value(stats), xxx);
     REQUIRE(r != -1); // make gcc @ rhel happy
     CHECK(streq(fty_proto_value(stats), xxx));
@@ -116,22 +119,552 @@ TEST_CASE("cmstats test", "[cmstats]")
     fty_proto_destroy(&bmsg);
     fty_proto_destroy(&stats);
 
-    cmstats_save(self, "cmstats.zpl");
+    cmstats_save(self, "cmstats.bin");
     cmstats_destroy(&self);
-    self = cmstats_load("cmstats.zpl");
+    self = cmstats_load("cmstats.bin");
 
     // TRIVIA: extend the testing of self->stats
     //         hint is - uncomment the print :)
     // cmstats_print (self);
-    CHECK(zhashx_lookup(self->stats, "TYPE_min_10s@ELEMENT_SRC"));
-    CHECK(zhashx_lookup(self->stats, "TYPE_max_10s@ELEMENT_SRC"));
-    CHECK(zhashx_lookup(self->stats, "TYPE_consumption_10s@ELEMENT_SRC"));
+    CHECK(cmstats_lookup(self, "TYPE", "min", "10s", "ELEMENT_SRC", nullptr));
+    CHECK(cmstats_lookup(self, "TYPE", "max", "10s", "ELEMENT_SRC", nullptr));
+    CHECK(cmstats_lookup(self, "TYPE", "consumption", "10s", "ELEMENT_SRC", nullptr));
 
     cmstats_delete_asset(self, "ELEMENT_SRC");
-    CHECK(!zhashx_lookup(self->stats, "TYPE_min_10s@ELEMENT_SRC"));
-    CHECK(!zhashx_lookup(self->stats, "TYPE_max_10s@ELEMENT_SRC"));
-    CHECK(!zhashx_lookup(self->stats, "TYPE_consumption_10s@ELEMENT_SRC"));
+    CHECK(!cmstats_lookup(self, "TYPE", "min", "10s", "ELEMENT_SRC", nullptr));
+    CHECK(!cmstats_lookup(self, "TYPE", "max", "10s", "ELEMENT_SRC", nullptr));
+    CHECK(!cmstats_lookup(self, "TYPE", "consumption", "10s", "ELEMENT_SRC", nullptr));
 
     cmstats_destroy(&self);
     unlink(file);
 }
+
+TEST_CASE("cmstats poll test", "[cmstats]")
+{
+    CHECK(fty_shm_set_test_dir(".") == 0);
+
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+
+    // start at the beginning of the second
+    zclock_sleep(int(1000 - (zclock_time() % 1000)) + 100);
+
+    zmsg_t*      msg  = fty_proto_encode_metric(nullptr, uint64_t(time(nullptr)), 10, "TYPE", "DEV", "42", "UNIT");
+    fty_proto_t* bmsg = fty_proto_decode(&msg);
+    CHECK(!cmstats_put(self, "max", "1s", 1, bmsg));
+    CHECK(!cmstats_put(self, "max", "1h", 3600, bmsg));
+    fty_proto_destroy(&bmsg);
+
+    cmstats_acc_t acc_1s;
+    cmstats_acc_t acc_1h;
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "1s", "DEV", &acc_1s));
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "1h", "DEV", &acc_1h));
+    CHECK(acc_1s.count == 1);
+    CHECK(acc_1s.value == 42);
+
+    // only the 1s interval has ended, its statistic is published
+    zclock_sleep(1000);
+    zlist_t* published = zlist_new();
+    CHECK(cmstats_poll(self, published) == 1);
+    REQUIRE(zlist_size(published) == 1);
+    fty_proto_t* stat = reinterpret_cast<fty_proto_t*>(zlist_pop(published));
+    CHECK(streq(fty_proto_type(stat), "TYPE_max_1s"));
+    CHECK(streq(fty_proto_value(stat), "42.00"));
+    fty_proto_destroy(&stat);
+    zlist_destroy(&published);
+
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "1s", "DEV", &acc));
+    CHECK(acc.count == 0);
+    CHECK(acc.interval_start == acc_1s.interval_start + 1);
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "1h", "DEV", &acc));
+    CHECK(acc.count == 1);
+    CHECK(acc.interval_start == acc_1h.interval_start);
+
+    cmstats_destroy(&self);
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("cmstats sweep test", "[cmstats]")
+{
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+
+    // start at the beginning of the second
+    zclock_sleep(int(1000 - (zclock_time() % 1000)) + 100);
+    uint32_t column    = uint32_t(cmstats_column(self, "max", "1s", 1));
+    zlist_t* published = zlist_new();
+    uint64_t now       = uint64_t(time(nullptr));
+    for (const char* asset : {"DEV1", "DEV2", "DEV3"})
+        cmstats_series_update(self, cmstats_series(self, "TYPE", asset), &column, 1, 42, now, "UNIT", published);
+    CHECK(self->columns[column].ends == std::vector<uint64_t>(3, now + 1));
+    cmstats_delete_asset(self, "DEV2");
+
+    // the ended statistics are found in the interval ends, the ones of the deleted series are dropped
+    zclock_sleep(1000);
+    CHECK(cmstats_poll(self, published) == 2);
+    CHECK(self->columns[column].members.size() == 2);
+    CHECK(self->columns[column].ends == std::vector<uint64_t>(2, now + 2));
+    CHECK(self->columns[column].deadline == now + 2);
+
+    while (zlist_size(published) != 0) {
+        fty_proto_t* stat = reinterpret_cast<fty_proto_t*>(zlist_pop(published));
+        fty_proto_destroy(&stat);
+    }
+    zlist_destroy(&published);
+    cmstats_destroy(&self);
+}
+
+TEST_CASE("cmstats sparse accumulators test", "[cmstats]")
+{
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+
+    std::vector<uint32_t> columns;
+    for (const char* type : {"min", "max", "arithmetic_mean", "consumption"})
+        columns.push_back(uint32_t(cmstats_column(self, type, "1h", 3600)));
+
+    // accumulators are allocated only for the columns the series is computed in
+    zlist_t* published = zlist_new();
+    uint32_t series    = cmstats_series(self, "TYPE", "DEV");
+    cmstats_series_update(self, series, &columns[3], 1, 42, uint64_t(time(nullptr)), "UNIT", published);
+    CHECK(self->series[series].stats.size() == 1);
+    CHECK(!cmstats_lookup(self, "TYPE", "min", "1h", "DEV", nullptr));
+
+    cmstats_series_update(self, series, &columns[0], 2, 43, uint64_t(time(nullptr)) + 1, "UNIT", published);
+    CHECK(self->series[series].stats.size() == 3);
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(self, "TYPE", "consumption", "1h", "DEV", &acc));
+    CHECK(acc.count == 1);
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "1h", "DEV", &acc));
+    CHECK(acc.value == 43);
+    CHECK(!cmstats_lookup(self, "TYPE", "arithmetic_mean", "1h", "DEV", nullptr));
+
+    // the same accumulators are restored from the state
+    static const char* file = "cmstats_sparse.bin";
+    REQUIRE(cmstats_save(self, file) == 0);
+    cmstats_t* loaded = cmstats_load(file);
+    REQUIRE(loaded);
+    CHECK(loaded->series[0].stats.size() == 3);
+    CHECK(cmstats_lookup(loaded, "TYPE", "consumption", "1h", "DEV", nullptr));
+    CHECK(!cmstats_lookup(loaded, "TYPE", "arithmetic_mean", "1h", "DEV", nullptr));
+    cmstats_destroy(&loaded);
+    unlink(file);
+
+    zlist_destroy(&published);
+    cmstats_destroy(&self);
+}
+
+TEST_CASE("cmstats delete assets test", "[cmstats]")
+{
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+
+    const char* assets[] = {"DEV1", "DEV2", "DEV3"};
+    for (const char* asset : assets) {
+        for (const char* quantity : {"TYPE1", "TYPE2"}) {
+            zmsg_t*      msg  = fty_proto_encode_metric(nullptr, uint64_t(time(nullptr)), 10, quantity, asset, "42", "UNIT");
+            fty_proto_t* bmsg = fty_proto_decode(&msg);
+            CHECK(!cmstats_put(self, "max", "10s", 10, bmsg));
+            fty_proto_destroy(&bmsg);
+        }
+    }
+
+    zlist_t* deleted = zlist_new();
+    zlist_autofree(deleted);
+    zlist_append(deleted, const_cast<char*>("DEV1"));
+    zlist_append(deleted, const_cast<char*>("DEV3"));
+    zlist_append(deleted, const_cast<char*>("UNKNOWN"));
+    cmstats_delete_assets(self, deleted);
+    zlist_destroy(&deleted);
+
+    CHECK(!cmstats_lookup(self, "TYPE1", "max", "10s", "DEV1", nullptr));
+    CHECK(!cmstats_lookup(self, "TYPE2", "max", "10s", "DEV1", nullptr));
+    CHECK(cmstats_lookup(self, "TYPE1", "max", "10s", "DEV2", nullptr));
+    CHECK(cmstats_lookup(self, "TYPE2", "max", "10s", "DEV2", nullptr));
+    CHECK(!cmstats_lookup(self, "TYPE1", "max", "10s", "DEV3", nullptr));
+    CHECK(!cmstats_lookup(self, "TYPE2", "max", "10s", "DEV3", nullptr));
+    CHECK(self->assets.size() == 1);
+
+    // ids of the deleted series are reused
+    cmstats_series(self, "TYPE1", "DEV4");
+    CHECK(self->series.size() == 6);
+    CHECK(self->assets["DEV4"].size() == 1);
+
+    cmstats_destroy(&self);
+}
+
+TEST_CASE("cmstats state file test", "[cmstats]")
+{
+    static const char* file   = "cmstats_state.bin";
+    static const char* legacy = "cmstats_state.zpl";
+
+    // legacy zpl state
+    zconfig_t* root = zconfig_new("cmstats", nullptr);
+    zconfig_t* item = zconfig_new("1", root);
+    zconfig_put(item, "metric_topic", "realpower.default_max_15m@DEV");
+    zconfig_put(item, "type", "realpower.default_max_15m");
+    zconfig_put(item, "element_src", "DEV");
+    zconfig_put(item, "value", "42.50");
+    zconfig_put(item, "unit", "W");
+    zconfig_put(item, "ttl", "1800");
+    zconfig_put(item, "aux." AGENT_CM_SUM, "85.000000");
+    zconfig_put(item, "aux." AGENT_CM_COUNT, "2");
+    zconfig_put(item, "aux." AGENT_CM_TYPE, "max");
+    zconfig_put(item, "aux." AGENT_CM_STEP, "900");
+    zconfig_put(item, "aux." AGENT_CM_LASTTS, "1000");
+    REQUIRE(zconfig_save(root, legacy) == 0);
+    zconfig_destroy(&root);
+
+    cmstats_t* self = cmstats_load(legacy);
+    REQUIRE(self);
+    unlink(legacy);
+
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(self, "realpower.default", "max", "15m", "DEV", &acc));
+    CHECK(acc.value == 42.5);
+    CHECK(acc.count == 2);
+    CHECK(acc.last_ts == 1000);
+
+    // binary state keeps everything in full precision
+    zmsg_t*      msg  = fty_proto_encode_metric(nullptr, uint64_t(time(nullptr)), 10, "TYPE", "DEV", "1.23456789", "V");
+    fty_proto_t* bmsg = fty_proto_decode(&msg);
+    CHECK(!cmstats_put(self, "arithmetic_mean", "15m", 900, bmsg));
+    fty_proto_destroy(&bmsg);
+
+    REQUIRE(cmstats_save(self, file) == 0);
+    cmstats_destroy(&self);
+    self = cmstats_load(file);
+    REQUIRE(self);
+
+    REQUIRE(cmstats_lookup(self, "realpower.default", "max", "15m", "DEV", &acc));
+    CHECK(acc.value == 42.5);
+    CHECK(acc.sum == 85);
+    CHECK(acc.count == 2);
+    REQUIRE(cmstats_lookup(self, "TYPE", "arithmetic_mean", "15m", "DEV", &acc));
+    CHECK(acc.value == 1.23456789);
+    CHECK(acc.count == 1);
+    CHECK(self->series[cmstats_series(self, "TYPE", "DEV")].unit == "V");
+    cmstats_destroy(&self);
+
+    // corrupted state is refused
+    FILE* f = fopen(file, "r+b");
+    REQUIRE(f);
+    fseek(f, 30, SEEK_SET);
+    fputc('X', f);
+    fclose(f);
+    CHECK(!cmstats_load(file));
+    unlink(file);
+}
+
+TEST_CASE("cmstats delta state test", "[cmstats]")
+{
+    static const char* file  = "cmstats_delta.bin";
+    static const char* delta = "cmstats_delta.bin.delta";
+    unlink(file);
+    unlink(delta);
+
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+
+    uint64_t now = uint64_t(time(nullptr));
+    for (const char* asset : {"DEV1", "DEV2", "DEV3"}) {
+        zmsg_t*      msg  = fty_proto_encode_metric(nullptr, now, 10, "TYPE", asset, "10", "UNIT");
+        fty_proto_t* bmsg = fty_proto_decode(&msg);
+        CHECK(!cmstats_put(self, "max", "24h", 86400, bmsg));
+        fty_proto_destroy(&bmsg);
+    }
+    CHECK(self->dirty.size() == 3);
+
+    std::string buffer;
+    cmstats_encode(self, buffer);
+    CHECK(self->dirty.empty());
+    REQUIRE(cmstats_write(file, buffer, false) == 0);
+
+    // only the changed series and deleted assets are in the delta
+    zmsg_t*      msg  = fty_proto_encode_metric(nullptr, now + 1, 10, "TYPE", "DEV1", "20", "UNIT");
+    fty_proto_t* bmsg = fty_proto_decode(&msg);
+    CHECK(!cmstats_put(self, "max", "24h", 86400, bmsg));
+    fty_proto_destroy(&bmsg);
+    cmstats_delete_asset(self, "DEV2");
+    CHECK(self->dirty.size() == 1);
+    CHECK(self->deleted.size() == 1);
+
+    buffer.clear();
+    cmstats_encode_delta(self, buffer);
+    size_t first = buffer.size();
+    CHECK(first < 200);
+    REQUIRE(cmstats_append(file, buffer, false) == 0);
+
+    msg  = fty_proto_encode_metric(nullptr, now + 2, 10, "TYPE", "DEV3", "30", "UNIT");
+    bmsg = fty_proto_decode(&msg);
+    CHECK(!cmstats_put(self, "max", "24h", 86400, bmsg));
+    fty_proto_destroy(&bmsg);
+    buffer.clear();
+    cmstats_encode_delta(self, buffer);
+    REQUIRE(cmstats_append(file, buffer, false) == 0);
+    cmstats_destroy(&self);
+
+    // base + deltas
+    self = cmstats_load(file);
+    REQUIRE(self);
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "24h", "DEV1", &acc));
+    CHECK(acc.value == 20);
+    CHECK(acc.count == 2);
+    CHECK(!cmstats_lookup(self, "TYPE", "max", "24h", "DEV2", nullptr));
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "24h", "DEV3", &acc));
+    CHECK(acc.value == 30);
+    CHECK(self->sequence == 3);
+    CHECK(self->dirty.empty());
+    CHECK(self->deleted.empty());
+
+    // incomplete last frame is ignored
+    REQUIRE(truncate(delta, off_t(first + 10)) == 0);
+    cmstats_destroy(&self);
+    self = cmstats_load(file);
+    REQUIRE(self);
+    REQUIRE(cmstats_lookup(self, "TYPE", "max", "24h", "DEV3", &acc));
+    CHECK(acc.value == 10);
+    CHECK(!cmstats_lookup(self, "TYPE", "max", "24h", "DEV2", nullptr));
+
+    // full state drops the delta log
+    REQUIRE(cmstats_save(self, file) == 0);
+    CHECK(!zfile_exists(delta));
+    cmstats_destroy(&self);
+    unlink(file);
+}
+
+TEST_CASE("cmstats parse value test", "[cmstats]")
+{
+    double value = 0;
+    CHECK(cmstats_parse_value("42", &value));
+    CHECK(value == 42);
+    CHECK(cmstats_parse_value("-0.125", &value));
+    CHECK(value == -0.125);
+    CHECK(cmstats_parse_value(" +1e3", &value));
+    CHECK(value == 1000);
+    // full precision is kept
+    CHECK(cmstats_parse_value("230.123456789", &value));
+    CHECK(value == 230.123456789);
+    // the rest of the string is ignored as by atof
+    CHECK(cmstats_parse_value("12.5 W", &value));
+    CHECK(value == 12.5);
+
+    value = 7;
+    CHECK(!cmstats_parse_value(nullptr, &value));
+    CHECK(!cmstats_parse_value("", &value));
+    CHECK(!cmstats_parse_value("abc", &value));
+    CHECK(!cmstats_parse_value("nan", &value));
+    CHECK(value == 7);
+}
+
+TEST_CASE("cmstats rollup test", "[cmstats]")
+{
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+
+    std::vector<uint32_t> columns;
+    for (const char* type : {"min", "max", "arithmetic_mean"}) {
+        columns.push_back(uint32_t(cmstats_column(self, type, "1s", 1)));
+        columns.push_back(uint32_t(cmstats_column(self, type, "3s", 3)));
+    }
+    // longer step is rolled up from the shortest step of the same type dividing it
+    CHECK(self->columns[columns[0]].base == -1);
+    CHECK(self->columns[columns[1]].base == int32_t(columns[0]));
+    CHECK(self->columns[columns[0]].rollups == std::vector<uint32_t>{columns[1]});
+    CHECK(self->columns[columns[3]].base == int32_t(columns[2]));
+    CHECK(cmstats_column(self, "max", "2s", 2) != -1);
+    CHECK(self->columns[columns[3]].base == int32_t(columns[2]));
+
+    // start at the beginning of the 3s interval
+    zclock_sleep(int(3000 - (zclock_time() % 3000)) + 100);
+    uint32_t series    = cmstats_series(self, "TYPE", "DEV");
+    zlist_t* published = zlist_new();
+    uint64_t now       = uint64_t(time(nullptr));
+
+    std::map<std::string, std::string> values;
+    for (int i = 0; i < 3; i++) {
+        const double value[] = {10, 30, 20};
+        cmstats_series_update(self, series, columns.data(), columns.size(), value[i], now + uint64_t(i), "UNIT",
+            published);
+        if (i == 0) {
+            // only the base statistic is updated by the metric
+            cmstats_acc_t acc;
+            REQUIRE(cmstats_lookup(self, "TYPE", "max", "1s", "DEV", &acc));
+            CHECK(acc.count == 1);
+            REQUIRE(cmstats_lookup(self, "TYPE", "max", "3s", "DEV", &acc));
+            CHECK(acc.count == 0);
+            CHECK(acc.interval_start == now - now % 3);
+        }
+        zclock_sleep(1000);
+        cmstats_poll(self, published);
+        while (zlist_size(published) != 0) {
+            fty_proto_t* stat            = reinterpret_cast<fty_proto_t*>(zlist_pop(published));
+            values[fty_proto_type(stat)] = fty_proto_value(stat);
+            fty_proto_destroy(&stat);
+        }
+    }
+    zlist_destroy(&published);
+
+    // statistics of the closed 1s intervals are merged at the end of the 3s interval
+    CHECK(values["TYPE_min_1s"] == "20.00");
+    CHECK(values["TYPE_min_3s"] == "10.00");
+    CHECK(values["TYPE_max_3s"] == "30.00");
+    CHECK(values["TYPE_arithmetic_mean_3s"] == "20.00");
+
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(self, "TYPE", "arithmetic_mean", "3s", "DEV", &acc));
+    CHECK(acc.count == 0);
+    CHECK(acc.interval_start == now - now % 3 + 3);
+
+    cmstats_destroy(&self);
+}
+
+TEST_CASE("cmstats percentile test", "[cmstats]")
+{
+    static const char* file = "cmstats_percentile.bin";
+
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+    CHECK(cmstats_column(self, "p42", "1h", 3600) == -1);
+
+    std::vector<uint32_t> columns;
+    for (const char* type : {"p50", "p95", "p99"}) {
+        columns.push_back(uint32_t(cmstats_column(self, type, "1s", 1)));
+        columns.push_back(uint32_t(cmstats_column(self, type, "3s", 3)));
+        columns.push_back(uint32_t(cmstats_column(self, type, "1h", 3600)));
+    }
+    CHECK(cmstats_aggr_from_str("p95") == CMSTATS_AGGR_P95);
+    CHECK(streq(cmstats_aggr_str(CMSTATS_AGGR_P99), "p99"));
+
+    // start at the beginning of the 3s interval
+    zclock_sleep(int(3000 - (zclock_time() % 3000)) + 100);
+    uint32_t series    = cmstats_series(self, "TYPE", "DEV");
+    uint32_t hourly[]  = {columns[2], columns[5], columns[8]};
+    zlist_t* published = zlist_new();
+    uint64_t now       = uint64_t(time(nullptr));
+
+    // series computed only in 1h is updated by the values directly, percentiles are estimated from the sketch
+    uint32_t other = cmstats_series(self, "TYPE", "OTHER");
+    for (int i = 1; i <= 100; i++)
+        cmstats_series_update(self, other, hourly, 3, i, now + uint64_t(i), "UNIT", published);
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(self, "TYPE", "p50", "1h", "OTHER", &acc));
+    CHECK(acc.count == 100);
+    CHECK(acc.value == Approx(50).epsilon(CMSKETCH_ACCURACY));
+    REQUIRE(cmstats_lookup(self, "TYPE", "p95", "1h", "OTHER", &acc));
+    CHECK(acc.value == Approx(95).epsilon(CMSKETCH_ACCURACY));
+    REQUIRE(cmstats_lookup(self, "TYPE", "p99", "1h", "OTHER", &acc));
+    CHECK(acc.value == Approx(99).epsilon(CMSKETCH_ACCURACY));
+    // p50, p95 and p99 of one step share the sketch of the values
+    CHECK(self->series[other].sketches.size() == 1);
+
+    // sketches are kept in the state file
+    REQUIRE(cmstats_save(self, file) == 0);
+    cmstats_t* loaded = cmstats_load(file);
+    REQUIRE(loaded);
+    unlink(file);
+    cmstats_acc_t loaded_acc;
+    REQUIRE(cmstats_lookup(loaded, "TYPE", "p99", "1h", "OTHER", &loaded_acc));
+    CHECK(loaded_acc.count == 100);
+    CHECK(loaded_acc.value == acc.value);
+    cmstats_destroy(&loaded);
+
+    // sketches of the closed 1s intervals are merged into the 3s percentiles
+    std::map<std::string, double> values;
+    for (int i = 0; i < 3; i++) {
+        const double value[] = {10, 30, 20};
+        cmstats_series_update(self, series, columns.data(), columns.size(), value[i], now + uint64_t(i), "UNIT",
+            published);
+        zclock_sleep(1000);
+        cmstats_poll(self, published);
+        while (zlist_size(published) != 0) {
+            fty_proto_t* stat = reinterpret_cast<fty_proto_t*>(zlist_pop(published));
+            double       v;
+            REQUIRE(cmstats_parse_value(fty_proto_value(stat), &v));
+            values[fty_proto_type(stat)] = v;
+            CHECK(streq(fty_proto_unit(stat), "UNIT"));
+            fty_proto_destroy(&stat);
+        }
+    }
+    zlist_destroy(&published);
+
+    // estimates are within the extremes of the values
+    CHECK(values["TYPE_p50_1s"] == 20);
+    CHECK(values["TYPE_p50_3s"] == Approx(20).epsilon(CMSKETCH_ACCURACY));
+    // rank of the quantile is rounded down, so p99 of 3 values is the middle one
+    CHECK(values["TYPE_p99_3s"] == Approx(20).epsilon(CMSKETCH_ACCURACY));
+    CHECK(values.count("TYPE_p50_1h") == 0);
+    // one sketch per step, the longer steps are merged from the closed intervals of the 1s one
+    CHECK(self->series[series].sketches.size() == 3);
+    CHECK(values["TYPE_p95_1s"] == values["TYPE_p50_1s"]);
+
+    cmstats_destroy(&self);
+}
+
+TEST_CASE("cmstats time weighted mean and variance test", "[cmstats]")
+{
+    static const char* file = "cmstats_variance.bin";
+
+    cmstats_t* self = cmstats_new();
+    REQUIRE(self);
+    CHECK(cmstats_aggr_from_str("standard_deviation") == CMSTATS_AGGR_STANDARD_DEVIATION);
+    CHECK(streq(cmstats_aggr_str(CMSTATS_AGGR_TIME_WEIGHTED_MEAN), "time_weighted_mean"));
+
+    std::vector<uint32_t> columns;
+    for (const char* type : {"time_weighted_mean", "variance", "standard_deviation"}) {
+        columns.push_back(uint32_t(cmstats_column(self, type, "1s", 1)));
+        columns.push_back(uint32_t(cmstats_column(self, type, "3s", 3)));
+    }
+
+    // start at the beginning of the 3s interval
+    zclock_sleep(int(3000 - (zclock_time() % 3000)) + 100);
+    uint32_t series    = cmstats_series(self, "TYPE", "DEV");
+    zlist_t* published = zlist_new();
+    uint64_t now       = uint64_t(time(nullptr));
+
+    // every value is held until the next one, so 10 is weighted by 2s and 40 by 1s (arithmetic mean is 25)
+    uint32_t level = cmstats_series(self, "LEVEL", "DEV");
+    cmstats_series_update(self, level, &columns[1], 1, 10, now, "UNIT", published);
+    cmstats_series_update(self, level, &columns[1], 1, 40, now + 2, "UNIT", published);
+
+    // covered time is kept in the state file
+    REQUIRE(cmstats_save(self, file) == 0);
+    cmstats_t* loaded = cmstats_load(file);
+    REQUIRE(loaded);
+    unlink(file);
+    cmstats_acc_t acc;
+    REQUIRE(cmstats_lookup(loaded, "LEVEL", "time_weighted_mean", "3s", "DEV", &acc));
+    CHECK(acc.count == 2);
+    CHECK(acc.extra == 2);
+    cmstats_destroy(&loaded);
+
+    // statistics of the closed 1s intervals are merged into the 3s ones
+    std::map<std::string, double> values;
+    for (int i = 0; i < 3; i++) {
+        const double value[] = {2, 4, 9};
+        cmstats_series_update(self, series, columns.data(), columns.size(), value[i], now + uint64_t(i), "UNIT",
+            published);
+        zclock_sleep(1000);
+        cmstats_poll(self, published);
+        while (zlist_size(published) != 0) {
+            fty_proto_t* stat = reinterpret_cast<fty_proto_t*>(zlist_pop(published));
+            double       v;
+            REQUIRE(cmstats_parse_value(fty_proto_value(stat), &v));
+            values[fty_proto_type(stat)] = v;
+            fty_proto_destroy(&stat);
+        }
+    }
+    zlist_destroy(&published);
+
+    CHECK(values["LEVEL_time_weighted_mean_3s"] == 20);
+    CHECK(values["TYPE_time_weighted_mean_1s"] == 9);
+    CHECK(values["TYPE_time_weighted_mean_3s"] == 5);
+    // single value has no deviation
+    CHECK(values["TYPE_variance_1s"] == 0);
+    CHECK(values["TYPE_variance_3s"] == 13);
+    CHECK(values["TYPE_standard_deviation_3s"] == Approx(std::sqrt(13.0)).epsilon(0.01));
+
+    cmstats_destroy(&self);
+}
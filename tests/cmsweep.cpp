@@ -0,0 +1,149 @@
+#include "src/cmsweep.h"
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+TEST_CASE("cmsweep test", "[cmsweep]")
+{
+    uint32_t ended[1];
+    CHECK(cmsweep_ended(nullptr, 0, 100, ended) == 0);
+    CHECK(cmsweep_min(nullptr, 0) == UINT64_MAX);
+    CHECK(cmsweep_isa() != nullptr);
+
+    // vectorized kernels agree with the scalar ones, also on the tails shorter than a vector
+    std::mt19937_64 random(42);
+    for (size_t n : {1, 2, 3, 5, 8, 13, 100}) {
+        std::vector<uint64_t> ends(n);
+        for (uint64_t& end : ends)
+            end = 1000 + random() % 100;
+        // the unsigned order is kept for the ends with the highest bit set
+        ends[n / 2] = UINT64_MAX - 1;
+
+        std::vector<uint32_t> found(n);
+        std::vector<uint32_t> expected(n);
+        size_t                nfound    = cmsweep_ended(ends.data(), n, 1050, found.data());
+        size_t                nexpected = cmsweep_ended_scalar(ends.data(), n, 1050, expected.data());
+        REQUIRE(nfound == nexpected);
+        found.resize(nfound);
+        expected.resize(nexpected);
+        CHECK(found == expected);
+        for (uint32_t i : found)
+            CHECK(ends[i] <= 1050);
+        CHECK(cmsweep_min(ends.data(), n) == cmsweep_min_scalar(ends.data(), n));
+    }
+
+    // restart and merge of the hot state agree with the scalar ones, dense and indexed
+    for (size_t n : {1, 2, 3, 5, 8, 13, 100}) {
+        std::vector<double>   value(n), sum(n), expected_value(n), expected_sum(n);
+        std::vector<uint64_t> count(n), start(n), ends(n), expected_count(n), expected_start(n), expected_ends(n);
+        std::vector<uint32_t> index;
+        std::vector<double>   closed_sum;
+        std::vector<uint64_t> closed_count;
+        for (size_t i = 0; i < n; i++) {
+            value[i] = sum[i] = double(random() % 1000);
+            count[i]          = random() % 3;
+            start[i]          = 900;
+            ends[i]           = 1000;
+            if (random() % 2 == 0) {
+                index.push_back(uint32_t(i));
+                closed_sum.push_back(double(random() % 1000));
+                closed_count.push_back(random() % 3);
+            }
+        }
+        expected_value = value;
+        expected_sum   = sum;
+        expected_count = count;
+        cmsweep_merge(sum.data(), count.data(), index.data(), closed_sum.data(), closed_count.data(), index.size());
+        cmsweep_merge_scalar(expected_sum.data(), expected_count.data(), index.data(), closed_sum.data(),
+            closed_count.data(), index.size());
+        CHECK(sum == expected_sum);
+        CHECK(count == expected_count);
+
+        expected_start = start;
+        expected_ends  = ends;
+        cmsweep_restart(nullptr, sum.data(), count.data(), start.data(), ends.data(), index.data(), index.size(),
+            1000, 1100);
+        cmsweep_restart_scalar(nullptr, expected_sum.data(), expected_count.data(), expected_start.data(),
+            expected_ends.data(), index.data(), index.size(), 1000, 1100);
+        CHECK(value == expected_value);
+        CHECK(sum == expected_sum);
+        CHECK(count == expected_count);
+        CHECK(start == expected_start);
+        CHECK(ends == expected_ends);
+
+        cmsweep_restart(value.data(), sum.data(), count.data(), start.data(), ends.data(), nullptr, n, 1100, 1200);
+        CHECK(value == std::vector<double>(n, 0));
+        CHECK(sum == std::vector<double>(n, 0));
+        CHECK(count == std::vector<uint64_t>(n, 0));
+        CHECK(start == std::vector<uint64_t>(n, 1100));
+        CHECK(ends == std::vector<uint64_t>(n, 1200));
+    }
+
+    // sum of the statistic without values is replaced, closed interval without values is skipped
+    double   sum[]          = {5, 7, 9};
+    uint64_t count[]        = {0, 2, 1};
+    uint32_t index[]        = {2, 0, 1};
+    double   closed_sum[]   = {1, 3, 4};
+    uint64_t closed_count[] = {1, 2, 0};
+    cmsweep_merge(sum, count, index, closed_sum, closed_count, 3);
+    CHECK(sum[0] == 3);
+    CHECK(count[0] == 2);
+    CHECK(sum[1] == 7);
+    CHECK(count[1] == 2);
+    CHECK(sum[2] == 10);
+    CHECK(count[2] == 2);
+
+    uint64_t ends[] = {30, 10, 20, 10, 40};
+    uint32_t found[5];
+    CHECK(cmsweep_ended(ends, 5, 20, found) == 3);
+    CHECK(found[0] == 1);
+    CHECK(found[1] == 2);
+    CHECK(found[2] == 3);
+    CHECK(cmsweep_min(ends, 5) == 10);
+}
+
+TEST_CASE("cmsweep benchmark", "[.][benchmark]")
+{
+    // throughput of the sweep over a million statistics, one in 64 of them has ended
+    const size_t          n = 1000000;
+    std::vector<uint64_t> ends(n);
+    std::vector<uint32_t> found(n);
+    for (size_t i = 0; i < n; i++)
+        ends[i] = (i % 64 == 0) ? 900 : 1800;
+
+    auto measure = [&](const char* name, size_t (*ended)(const uint64_t*, size_t, uint64_t, uint32_t*),
+                       uint64_t (*min)(const uint64_t*, size_t)) {
+        const int rounds = 100;
+        size_t    nfound = 0;
+        uint64_t  first  = 0;
+        auto      start  = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            nfound += ended(ends.data(), n, 1000, found.data());
+            first += min(ends.data(), n);
+        }
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("cmsweep %-8s %.1f M statistics/s\n", name, double(rounds) * double(n) / s / 1e6);
+        CHECK(nfound == size_t(rounds) * ((n + 63) / 64));
+        CHECK(first == uint64_t(rounds) * 900);
+    };
+    measure("scalar", cmsweep_ended_scalar, cmsweep_min_scalar);
+    measure(cmsweep_isa(), cmsweep_ended, cmsweep_min);
+
+    // throughput of the restart of a million statistics which have ended together
+    std::vector<double>   value(n), sum(n);
+    std::vector<uint64_t> count(n), start(n);
+    auto restart = [&](const char* name, void (*restart)(double*, double*, uint64_t*, uint64_t*, uint64_t*,
+                                             const uint32_t*, size_t, uint64_t, uint64_t)) {
+        const int rounds = 100;
+        auto      begin  = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+            restart(value.data(), sum.data(), count.data(), start.data(), ends.data(), nullptr, n, uint64_t(r), 1800);
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        printf("cmsweep restart %-8s %.1f M statistics/s\n", name, double(rounds) * double(n) / s / 1e6);
+        CHECK(start[n - 1] == uint64_t(rounds - 1));
+    };
+    restart("scalar", cmsweep_restart_scalar);
+    restart(cmsweep_isa(), cmsweep_restart);
+}
@@ -0,0 +1,59 @@
+#include "src/cmwatch.h"
+#include "src/fty_mc_server.h"
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void s_write(const std::string& path, const char* content)
+{
+    std::ofstream file(path, std::ios::trunc);
+    file << content;
+}
+
+static void s_check(bool inotify)
+{
+    static const char* dir = "cmwatch.dir";
+    mkdir(dir, 0755);
+    s_write(std::string(dir) + "/DEV1@realpower.default", "1");
+    s_write(std::string(dir) + "/DEV2@realpower.default", "2");
+
+    CHECK(!cmwatch_new("nonexistent.dir", inotify));
+    cmwatch_t* self = cmwatch_new(dir, inotify);
+    REQUIRE(self);
+
+    // all files the first time, then only the changed ones
+    std::vector<std::string> names;
+    CHECK(cmwatch_changed(self, names) == 0);
+    CHECK(names == std::vector<std::string>{"DEV1@realpower.default", "DEV2@realpower.default"});
+
+    names.clear();
+    CHECK(cmwatch_changed(self, names) == 0);
+    CHECK(names.empty());
+
+    s_write(std::string(dir) + "/DEV2@realpower.default", "22");
+    s_write(std::string(dir) + "/DEV3@realpower.default", "3");
+    unlink((std::string(dir) + "/DEV1@realpower.default").c_str());
+    names.clear();
+    CHECK(cmwatch_changed(self, names) == 0);
+    CHECK(names == std::vector<std::string>{"DEV2@realpower.default", "DEV3@realpower.default"});
+
+    cmwatch_destroy(&self);
+    CHECK(!self);
+
+    unlink((std::string(dir) + "/DEV2@realpower.default").c_str());
+    unlink((std::string(dir) + "/DEV3@realpower.default").c_str());
+    rmdir(dir);
+}
+
+TEST_CASE("cmwatch test", "[cmwatch]")
+{
+    SECTION("inotify")
+    {
+        s_check(true);
+    }
+    SECTION("rescan")
+    {
+        s_check(false);
+    }
+}
@@ -8,7 +8,7 @@ TEST_CASE("fty mc server test", "[fty_mc_server]")
 {
     CHECK(fty_shm_set_test_dir(".") == 0);
 
-    unlink("state.zpl");
+    unlink("state.bin");
 
     fty_shm_set_default_polling_interval(2);
 
@@ -120,7 +120,7 @@ TEST_CASE("fty mc server test", "[fty_mc_server]")
         fty::shm::read_metric("DEV1", "realpower.default_max_10s", &bmsg);
         const char* type = fty_proto_aux_string(bmsg, AGENT_CM_TYPE, "");
         CHECK(streq(type, "max"));
-        CHECK(streq(fty_proto_value(bmsg), "100"));
+        CHECK(streq(fty_proto_value(bmsg), "100.00"));
         fty_proto_destroy(&bmsg);
     }
     {
@@ -240,8 +240,8 @@ TEST_CASE("fty mc server test", "[fty_mc_server]")
     //    mlm_client_destroy (&consumer_1s);
     //    mlm_client_destroy (&producer);
     zactor_destroy(&server);
-    CHECK(zfile_exists("state.zpl"));
-    unlink("state.zpl");
+    CHECK(zfile_exists("state.bin"));
+    unlink("state.bin");
     fty_shm_delete_test_dir();
 }
 
@@ -260,7 +260,7 @@ TEST_CASE("fty mc server test with consumption", "[fty_mc_server_consumption]")
 
     CHECK(fty_shm_set_test_dir(".") == 0);
 
-    unlink("state.zpl");
+    unlink("state.bin");
 
     fty_shm_set_default_polling_interval(10);
 
@@ -416,7 +416,93 @@ TEST_CASE("fty mc server test with consumption", "[fty_mc_server_consumption]")
 
     mlm_client_destroy(&producer);
     zactor_destroy(&server);
-    CHECK(zfile_exists("state.zpl"));
-    unlink("state.zpl");
+    CHECK(zfile_exists("state.bin"));
+    unlink("state.bin");
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("fty mc server stream test", "[fty_mc_server_stream]")
+{
+    // metrics are consumed from the METRICS stream only, nothing is written to shm by the test
+
+    CHECK(fty_shm_set_test_dir(".") == 0);
+
+    unlink("state.bin");
+
+    static const char* endpoint = "inproc://cm-server-stream-test";
+
+    // create broker
+    zactor_t* server = zactor_new(mlm_server, const_cast<char*>("Malamute"));
+    zstr_sendx(server, "BIND", endpoint, nullptr);
+
+    mlm_client_t* producer = mlm_client_new();
+    mlm_client_connect(producer, endpoint, 5000, "publisher");
+    mlm_client_set_producer(producer, FTY_PROTO_STREAM_METRICS);
+
+    zactor_t* cm_server = zactor_new(fty_mc_server, const_cast<char*>("fty-mc-server"));
+
+    zstr_sendx(cm_server, "TYPES", "min", "max", "arithmetic_mean", nullptr);
+    zstr_sendx(cm_server, "STEPS", "10s", nullptr);
+    zstr_sendx(cm_server, "DIR", ".", nullptr);
+    zstr_sendx(cm_server, "CONNECT", endpoint, nullptr);
+    zstr_sendx(cm_server, "INGEST", "stream", nullptr);
+    zclock_sleep(500);
+
+    // start at the beginning of the 10s interval
+    {
+        int64_t now_ms = zclock_time();
+        int64_t sl     = 10000 - (now_ms % 10000);
+        zclock_sleep(int(sl));
+    }
+
+    // T+1s
+    zclock_sleep(1000);
+    int64_t start_ms = zclock_time();
+    for (const char* value : {"50", "150", "100"}) {
+        zmsg_t* msg = fty_proto_encode_metric(
+            nullptr, static_cast<uint64_t>(time(nullptr)), 10, "realpower.default", "DEV2", value, "W");
+        mlm_client_send(producer, "realpower.default@DEV2", &msg);
+    }
+    // metrics of other quantities than selected are not computed
+    {
+        zmsg_t* msg = fty_proto_encode_metric(
+            nullptr, static_cast<uint64_t>(time(nullptr)), 10, "status.ups", "DEV2", "42", "");
+        mlm_client_send(producer, "status.ups@DEV2", &msg);
+    }
+    wait_time(start_ms, 10);
+
+    // T+11s
+    // statistics of the first interval are published as they arrived, without any shm pull
+    {
+        fty_proto_t* bmsg = nullptr;
+        fty::shm::read_metric("DEV2", "realpower.default_min_10s", &bmsg);
+        CHECK(streq(fty_proto_aux_string(bmsg, AGENT_CM_TYPE, ""), "min"));
+        CHECK(streq(fty_proto_value(bmsg), "50.00"));
+        fty_proto_destroy(&bmsg);
+    }
+    {
+        fty_proto_t* bmsg = nullptr;
+        fty::shm::read_metric("DEV2", "realpower.default_max_10s", &bmsg);
+        CHECK(streq(fty_proto_aux_string(bmsg, AGENT_CM_TYPE, ""), "max"));
+        CHECK(streq(fty_proto_value(bmsg), "150.00"));
+        fty_proto_destroy(&bmsg);
+    }
+    {
+        fty_proto_t* bmsg = nullptr;
+        fty::shm::read_metric("DEV2", "realpower.default_arithmetic_mean_10s", &bmsg);
+        CHECK(streq(fty_proto_aux_string(bmsg, AGENT_CM_TYPE, ""), "arithmetic_mean"));
+        CHECK(streq(fty_proto_value(bmsg), "100.00"));
+        fty_proto_destroy(&bmsg);
+    }
+    {
+        fty_proto_t* bmsg = nullptr;
+        CHECK(fty::shm::read_metric("DEV2", "status.ups_max_10s", &bmsg) != 0);
+        fty_proto_destroy(&bmsg);
+    }
+
+    zactor_destroy(&cm_server);
+    mlm_client_destroy(&producer);
+    zactor_destroy(&server);
+    unlink("state.bin");
     fty_shm_delete_test_dir();
 }